@@ -0,0 +1,138 @@
+#include "lru.h"
+#include "tinylfu.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+constexpr uint64_t MiB = 1 << 20;
+
+struct trace_entry {
+	std::string key;
+	uint64_t bytes;
+};
+
+template<typename P>
+class counting : public P {
+public:
+	counting(uint64_t budget) : P(0, budget) {};
+	void evict(const std::string&) override {}
+};
+
+// Transcodes of the same track vary in size; derive one from the key so every policy sees the same.
+static uint64_t synthetic_size(const std::string& key)
+{
+	return (3 + std::hash<std::string>()(key) % 8) * MiB;
+}
+
+/* Lines are either "<key> [bytes]" or access log lines with a /api/v1/stream/<uuid> request in them,
+ * keyed by track, quality and format like the cache itself. */
+static bool load_trace(const char *path, std::vector<trace_entry>& trace)
+{
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "could not open " << path << std::endl;
+		return false;
+	}
+
+	const std::regex stream_re(R"(/api/v1/stream/([0-9A-Fa-f-]+)(?:\?(?:[^ "]*&)?q=(\d))?(?:[^ "]*&fmt=(\w+))?)");
+	std::string line;
+	while (std::getline(in, line)) {
+		std::smatch sm;
+		if (std::regex_search(line, sm, stream_re)) {
+			std::string key = sm[1].str() + "." + (sm[2].matched ? sm[2].str() : "6") + "." + (sm[3].matched ? sm[3].str() : "mp3");
+			trace.push_back({key, synthetic_size(key)});
+		} else {
+			std::istringstream ls(line);
+			trace_entry e;
+			if (!(ls >> e.key))
+				continue;
+			if (!(ls >> e.bytes))
+				e.bytes = synthetic_size(e.key);
+			trace.push_back(e);
+		}
+	}
+	return true;
+}
+
+/* Daily listening: Zipf-distributed plays over the library, interrupted now and then by a shuffle
+ * through a long playlist of tracks that are played once and never again. */
+static void synthetic_trace(std::vector<trace_entry>& trace, size_t requests, size_t library, size_t scan_every, size_t scan_length)
+{
+	std::mt19937_64 rng(1011);
+	std::vector<double> cdf(library);
+	double sum = 0;
+	for (size_t i = 0; i < library; i++)
+		cdf[i] = sum += 1.0 / std::pow(i + 1, 0.9);
+	std::uniform_real_distribution<double> uni(0, sum);
+
+	size_t cold = 0;
+	while (trace.size() < requests) {
+		if (scan_every > 0 && trace.size() % scan_every == scan_every - 1) {
+			for (size_t i = 0; i < scan_length && trace.size() < requests; i++) {
+				std::string key = "cold-" + std::to_string(cold++);
+				trace.push_back({key, synthetic_size(key)});
+			}
+			continue;
+		}
+		size_t rank = std::lower_bound(cdf.begin(), cdf.end(), uni(rng)) - cdf.begin();
+		std::string key = "track-" + std::to_string(rank);
+		trace.push_back({key, synthetic_size(key)});
+	}
+}
+
+// Same calls as mediadb::get_cached_transcode and the transcoder make: a lookup, then a put on a miss.
+static void replay(const char *name, cache_policy<std::string>& policy, const std::vector<trace_entry>& trace)
+{
+	uint64_t hits = 0, hit_bytes = 0, total_bytes = 0;
+	for (const auto& e : trace) {
+		total_bytes += e.bytes;
+		if (policy.touch(e.key)) {
+			hits++;
+			hit_bytes += e.bytes;
+		} else {
+			policy.miss(e.key);
+			policy.put(e.key, e.bytes);
+		}
+	}
+
+	std::cout << std::left << std::setw(10) << name << std::right
+		<< std::setw(12) << trace.size()
+		<< std::setw(12) << std::fixed << std::setprecision(2) << 100.0 * hits / trace.size()
+		<< std::setw(14) << 100.0 * hit_bytes / total_bytes
+		<< std::setw(12) << (total_bytes - hit_bytes) / MiB << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		std::cerr << "usage: " << argv[0] << " <trace file | --synthetic> [budget MiB = 2048]" << std::endl;
+		return 1;
+	}
+	const uint64_t budget = (argc > 2 ? std::stoull(argv[2]) : 2048) * MiB;
+
+	std::vector<trace_entry> trace;
+	if (std::string(argv[1]) == "--synthetic")
+		synthetic_trace(trace, 500000, 20000, 25000, 3000);
+	else if (!load_trace(argv[1], trace))
+		return 1;
+	if (trace.empty()) {
+		std::cerr << "empty trace" << std::endl;
+		return 1;
+	}
+
+	std::cout << std::left << std::setw(10) << "policy" << std::right
+		<< std::setw(12) << "requests" << std::setw(12) << "hit %" << std::setw(14) << "byte hit %"
+		<< std::setw(12) << "MiB missed" << std::endl;
+	counting<lru<std::string>> l(budget);
+	replay("lru", l, trace);
+	counting<tinylfu<std::string>> t(budget);
+	replay("tinylfu", t, trace);
+	return 0;
+}
@@ -0,0 +1,136 @@
+#include "sampleconv.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+constexpr int FRAME = 4608;     // samples per call, the largest usual decoded frame
+constexpr int MIN_CALLS = 2000; // per measurement
+
+struct conv_pair {
+	AVSampleFormat in, out;
+};
+
+static const conv_pair pairs[] = {
+	{AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P},  // 16-bit FLAC to LAME
+	{AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S16P},  // 24-bit FLAC to LAME
+	{AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16P}, // MP3 or AAC to LAME
+	{AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP},  // 16-bit FLAC to AAC
+	{AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_FLTP},  // 24-bit FLAC to AAC
+	{AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16},  // MP3 or AAC to Opus
+};
+
+struct buffers {
+	AVSampleFormat fmt;
+	uint8_t **data = nullptr;
+
+	buffers(AVSampleFormat f) : fmt(f)
+	{
+		if (av_samples_alloc_array_and_samples(&data, nullptr, 2, FRAME, fmt, 0) < 0)
+			abort();
+	}
+	~buffers()
+	{
+		av_freep(&data[0]);
+		av_freep(&data);
+	}
+
+	// Noise at about -6 dBFS with the odd clipped peak, so every kernel takes its clamping path too.
+	void fill(std::mt19937& rng)
+	{
+		std::normal_distribution<float> d(0, 0.5f);
+		const int planes = av_sample_fmt_is_planar(fmt) ? 2 : 1, per_plane = planes == 2 ? FRAME : FRAME * 2;
+		for (int p = 0; p < planes; p++) {
+			for (int i = 0; i < per_plane; i++) {
+				const float v = d(rng);
+				const double c = std::clamp<double>(v, -1, 1);
+				if (fmt == AV_SAMPLE_FMT_S16 || fmt == AV_SAMPLE_FMT_S16P)
+					reinterpret_cast<int16_t*>(data[p])[i] = std::lrint(c * 32767);
+				else if (fmt == AV_SAMPLE_FMT_S32)
+					reinterpret_cast<int32_t*>(data[p])[i] = std::lrint(c * 2147483392.0) & ~0xff; // 24 bits
+				else
+					reinterpret_cast<float*>(data[p])[i] = v;
+			}
+		}
+	}
+
+	// The largest difference from another buffer, in units of the last place of the format.
+	double max_diff(const buffers& o) const
+	{
+		const int planes = av_sample_fmt_is_planar(fmt) ? 2 : 1, per_plane = planes == 2 ? FRAME : FRAME * 2;
+		double m = 0;
+		for (int p = 0; p < planes; p++) {
+			for (int i = 0; i < per_plane; i++) {
+				double a, b;
+				if (fmt == AV_SAMPLE_FMT_S16 || fmt == AV_SAMPLE_FMT_S16P) {
+					a = reinterpret_cast<int16_t*>(data[p])[i];
+					b = reinterpret_cast<int16_t*>(o.data[p])[i];
+				} else {
+					a = reinterpret_cast<float*>(data[p])[i] * 8388608.0;
+					b = reinterpret_cast<float*>(o.data[p])[i] * 8388608.0;
+				}
+				m = std::max(m, std::abs(a - b));
+			}
+		}
+		return m;
+	}
+};
+
+// Calls fn until it has run for a while, and returns the throughput in millions of samples a second.
+template<typename F>
+static double measure(F fn)
+{
+	using clock = std::chrono::steady_clock;
+	int calls = 0;
+	const auto start = clock::now();
+	auto now = start;
+	while (calls < MIN_CALLS || now - start < std::chrono::milliseconds(200)) {
+		fn();
+		calls++;
+		now = clock::now();
+	}
+	return static_cast<double>(calls) * FRAME / std::chrono::duration<double, std::micro>(now - start).count();
+}
+
+int main()
+{
+	std::mt19937 rng(1);
+	bool ok = true;
+
+	std::cout << std::fixed << std::setprecision(1);
+	for (const auto& p : pairs) {
+		buffers in(p.in), ref(p.out), out(p.out);
+		in.fill(rng);
+
+		SwrContext *swr = swr_alloc_set_opts(nullptr, av_get_default_channel_layout(2), p.out, 44100,
+						     av_get_default_channel_layout(2), p.in, 44100, 0, nullptr);
+		if (swr == nullptr || swr_init(swr) < 0) {
+			std::cerr << "could not set up swresample" << std::endl;
+			return 1;
+		}
+		const double base = measure([&]() {
+			swr_convert(swr, ref.data, FRAME, (const uint8_t **) in.data, FRAME);
+		});
+		swr_free(&swr);
+
+		std::cout << av_get_sample_fmt_name(p.in) << " -> " << av_get_sample_fmt_name(p.out) << std::endl;
+		std::cout << "  swresample " << std::setw(8) << base << " Msamples/s" << std::endl;
+		for (int isa = SC_SCALAR; isa < SC_BEST; isa++) {
+			sampleconv_fn fn = find_sampleconv(p.in, p.out, static_cast<sampleconv_isa>(isa));
+			if (fn == nullptr)
+				continue;
+			const double rate = measure([&]() {
+				fn(out.data, in.data, FRAME);
+			});
+			// Anything past one last place means a rounding or clipping rule differs from swresample.
+			const double diff = out.max_diff(ref);
+			ok &= diff <= 1;
+			std::cout << "  " << std::left << std::setw(10) << sampleconv_isa_name(static_cast<sampleconv_isa>(isa)) << std::right
+				  << " " << std::setw(8) << rate << " Msamples/s  " << std::setw(5) << rate / base << "x  max diff "
+				  << diff << std::endl;
+		}
+	}
+	return ok ? 0 : 1;
+}
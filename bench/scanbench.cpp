@@ -0,0 +1,315 @@
+#include "config.h"
+#include "ffmpeg.h"
+#include "mediadb.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+constexpr int BENCH_SAMPLE_RATE = 44100;
+constexpr int BENCH_TRACK_SECONDS = 2;
+// About what a scanned album cover weighs, so reading tags has to get past it.
+constexpr size_t BENCH_EMBEDDED_ART_BYTES = 256 << 10;
+// Left in every library the bench generates; scans skip it like any other dot file.
+constexpr const char *BENCH_MARKER = ".scanbench";
+
+struct bench_format {
+	const char *ext;
+	AVCodecID codec_id;
+	bool vorbis_keys; // FLAC takes MUSICBRAINZ_* keys, ID3 takes Picard's TXXX descriptions
+};
+
+// The mp4 muxer has no way to write iTunes freeform atoms, so M4A albums never carry MusicBrainz IDs.
+static const bench_format formats[] = {
+	{"flac", AV_CODEC_ID_FLAC, true},
+	{"mp3", AV_CODEC_ID_MP3, false},
+	{"m4a", AV_CODEC_ID_AAC, false},
+};
+
+static const unsigned char cover_png[] = {
+	0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d, 0x49, 0x48, 0x44, 0x52,
+	0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x08, 0x06, 0x00, 0x00, 0x00, 0x1f, 0x15, 0xc4,
+	0x89, 0x00, 0x00, 0x00, 0x0a, 0x49, 0x44, 0x41, 0x54, 0x78, 0x9c, 0x63, 0x00, 0x01, 0x00, 0x00,
+	0x05, 0x00, 0x01, 0x0d, 0x0a, 0x2d, 0xb4, 0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae,
+	0x42, 0x60, 0x82,
+};
+
+static std::string fake_mbid(unsigned kind, unsigned album, unsigned track)
+{
+	char buf[37];
+	snprintf(buf, sizeof(buf), "%08x-%04x-4%03x-8%03x-%012x", 0x5eed0000u + kind, album & 0xffff, track & 0xfff, kind & 0xfff, album * 1000 + track);
+	return buf;
+}
+
+static void fill_sine(AVFrame *frame, int64_t first_sample, double freq)
+{
+	const enum AVSampleFormat fmt = static_cast<enum AVSampleFormat>(frame->format);
+	const bool planar = av_sample_fmt_is_planar(fmt);
+	for (int i = 0; i < frame->nb_samples; i++) {
+		const double v = 0.25 * sin(2 * M_PI * freq * (first_sample + i) / BENCH_SAMPLE_RATE);
+		for (int c = 0; c < frame->channels; c++) {
+			const int idx = planar ? i : i * frame->channels + c;
+			uint8_t *plane = frame->data[planar ? c : 0];
+			switch (fmt) {
+			case AV_SAMPLE_FMT_S16: case AV_SAMPLE_FMT_S16P:
+				reinterpret_cast<int16_t *>(plane)[idx] = v * INT16_MAX;
+				break;
+			case AV_SAMPLE_FMT_S32: case AV_SAMPLE_FMT_S32P:
+				reinterpret_cast<int32_t *>(plane)[idx] = v * INT32_MAX;
+				break;
+			case AV_SAMPLE_FMT_FLT: case AV_SAMPLE_FMT_FLTP:
+				reinterpret_cast<float *>(plane)[idx] = v;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+static int drain_encoder(AVFormatContext *fmt_ctx, AVCodecContext *enc, AVStream *st, AVPacket *pkt)
+{
+	int err;
+	while ((err = avcodec_receive_packet(enc, pkt)) == 0) {
+		av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+		pkt->stream_index = st->index;
+		if ((err = av_interleaved_write_frame(fmt_ctx, pkt)) < 0)
+			return err;
+	}
+	return err == AVERROR(EAGAIN) || err == AVERROR_EOF ? 0 : err;
+}
+
+// The cover followed by zeros up to BENCH_EMBEDDED_ART_BYTES; nothing decodes past its IEND.
+static const std::vector<uint8_t>& embedded_art()
+{
+	static const std::vector<uint8_t> art = [] {
+		std::vector<uint8_t> v(cover_png, cover_png + sizeof(cover_png));
+		v.resize(BENCH_EMBEDDED_ART_BYTES);
+		return v;
+	}();
+	return art;
+}
+
+static int write_track(const fs::path& path, const bench_format& bf, AVDictionary *tags, double freq, bool with_art)
+{
+	AVFormatContext *fmt_ctx = nullptr;
+	AVCodecContext *enc = nullptr;
+	AVStream *st, *pic = nullptr;
+	AVFrame *frame = nullptr;
+	AVPacket *pkt = nullptr;
+	AVCodec *codec;
+	int err, frame_size;
+	int64_t pts = 0;
+
+	if ((err = avformat_alloc_output_context2(&fmt_ctx, nullptr, nullptr, path.c_str())) < 0)
+		return err;
+	if ((codec = avcodec_find_encoder(bf.codec_id)) == nullptr) {
+		err = AVERROR_ENCODER_NOT_FOUND;
+		goto cleanup;
+	}
+	if ((enc = avcodec_alloc_context3(codec)) == nullptr || (st = avformat_new_stream(fmt_ctx, nullptr)) == nullptr ||
+		(frame = av_frame_alloc()) == nullptr || (pkt = av_packet_alloc()) == nullptr) {
+		err = AVERROR(ENOMEM);
+		goto cleanup;
+	}
+
+	enc->sample_rate = BENCH_SAMPLE_RATE;
+	enc->channels = 2;
+	enc->channel_layout = av_get_default_channel_layout(2);
+	enc->sample_fmt = codec->sample_fmts[0];
+	enc->bit_rate = 128000;
+	enc->time_base = {1, BENCH_SAMPLE_RATE};
+	if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	if ((err = avcodec_open2(enc, codec, nullptr)) < 0 || (err = avcodec_parameters_from_context(st->codecpar, enc)) < 0)
+		goto cleanup;
+	st->time_base = enc->time_base;
+	av_dict_copy(&fmt_ctx->metadata, tags, 0);
+
+	// An attached picture becomes a FLAC PICTURE block, an ID3 APIC frame or an MP4 covr atom.
+	if (with_art) {
+		if ((pic = avformat_new_stream(fmt_ctx, nullptr)) == nullptr) {
+			err = AVERROR(ENOMEM);
+			goto cleanup;
+		}
+		pic->disposition = AV_DISPOSITION_ATTACHED_PIC;
+		pic->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+		pic->codecpar->codec_id = AV_CODEC_ID_PNG;
+		pic->codecpar->width = 1;
+		pic->codecpar->height = 1;
+	}
+
+	if ((err = avio_open(&fmt_ctx->pb, path.c_str(), AVIO_FLAG_WRITE)) < 0 || (err = avformat_write_header(fmt_ctx, nullptr)) < 0)
+		goto cleanup;
+	if (pic != nullptr) {
+		// Muxers hold the audio back until every attached picture has arrived.
+		const auto& art = embedded_art();
+		if ((err = av_new_packet(pkt, art.size())) < 0)
+			goto cleanup;
+		memcpy(pkt->data, art.data(), art.size());
+		pkt->stream_index = pic->index;
+		pkt->flags |= AV_PKT_FLAG_KEY;
+		if ((err = av_interleaved_write_frame(fmt_ctx, pkt)) < 0)
+			goto cleanup;
+	}
+
+	frame_size = enc->frame_size > 0 ? enc->frame_size : 1024;
+	frame->nb_samples = frame_size;
+	frame->format = enc->sample_fmt;
+	frame->channels = enc->channels;
+	frame->channel_layout = enc->channel_layout;
+	frame->sample_rate = enc->sample_rate;
+	if ((err = av_frame_get_buffer(frame, 0)) < 0)
+		goto cleanup;
+
+	while (pts < BENCH_SAMPLE_RATE * BENCH_TRACK_SECONDS) {
+		if ((err = av_frame_make_writable(frame)) < 0)
+			goto cleanup;
+		fill_sine(frame, pts, freq);
+		frame->pts = pts;
+		pts += frame_size;
+		if ((err = avcodec_send_frame(enc, frame)) < 0 || (err = drain_encoder(fmt_ctx, enc, st, pkt)) < 0)
+			goto cleanup;
+	}
+	if ((err = avcodec_send_frame(enc, nullptr)) < 0 || (err = drain_encoder(fmt_ctx, enc, st, pkt)) < 0)
+		goto cleanup;
+	err = av_write_trailer(fmt_ctx);
+
+cleanup:
+	av_packet_free(&pkt);
+	av_frame_free(&frame);
+	avcodec_free_context(&enc);
+	if (fmt_ctx != nullptr) {
+		avio_closep(&fmt_ctx->pb);
+		avformat_free_context(fmt_ctx);
+	}
+	return err;
+}
+
+/* Album n uses formats[n % 3], carries MusicBrainz IDs when n is even (and the format allows it),
+ * has a folder cover when n is a multiple of 3, and art embedded in every track when n is odd, which
+ * covers all three formats. Everything is derived from n, so two runs with the same arguments
+ * produce the same library. */
+static bool generate_library(const fs::path& root, unsigned num_albums, unsigned tracks_per_album)
+{
+	fs::create_directories(root);
+	std::ofstream(root / BENCH_MARKER);
+	for (unsigned a = 0; a < num_albums; a++) {
+		const bench_format& bf = formats[a % 3];
+		const bool with_mbids = a % 2 == 0;
+		char dirname[32];
+		snprintf(dirname, sizeof(dirname), "album_%04u", a);
+		fs::path album_dir = root / dirname;
+		fs::create_directories(album_dir);
+
+		if (a % 3 == 0) {
+			std::ofstream cover(album_dir / "cover.png", std::ios::out | std::ios::binary);
+			cover.write(reinterpret_cast<const char *>(cover_png), sizeof(cover_png));
+		}
+
+		for (unsigned t = 0; t < tracks_per_album; t++) {
+			AVDictionary *tags = nullptr;
+			char fname[32];
+			std::string artist = "Artist " + std::to_string(a % 7), guest = "Guest " + std::to_string((a + t) % 11);
+			snprintf(fname, sizeof(fname), "%02u.%s", t + 1, bf.ext);
+
+			av_dict_set(&tags, "title", ("Track " + std::to_string(t + 1)).c_str(), 0);
+			av_dict_set(&tags, "album", ("Album " + std::to_string(a)).c_str(), 0);
+			av_dict_set(&tags, "album_artist", artist.c_str(), 0);
+			av_dict_set(&tags, "artist", (t % 4 == 3 ? artist + "; " + guest : artist).c_str(), 0);
+			av_dict_set(&tags, "track", std::to_string(t + 1).c_str(), 0);
+			av_dict_set(&tags, "disc", "1", 0);
+			av_dict_set(&tags, "date", std::to_string(1970 + a % 50).c_str(), 0);
+			if (with_mbids && bf.codec_id != AV_CODEC_ID_AAC) {
+				av_dict_set(&tags, bf.vorbis_keys ? "MUSICBRAINZ_TRACKID" : "MusicBrainz Release Track Id", fake_mbid(1, a, t).c_str(), 0);
+				av_dict_set(&tags, bf.vorbis_keys ? "MUSICBRAINZ_RELEASEGROUPID" : "MusicBrainz Release Group Id", fake_mbid(2, a, 0).c_str(), 0);
+				av_dict_set(&tags, bf.vorbis_keys ? "MUSICBRAINZ_ARTISTID" : "MusicBrainz Artist Id", fake_mbid(3, a % 7, 0).c_str(), 0);
+				av_dict_set(&tags, bf.vorbis_keys ? "MUSICBRAINZ_ALBUMARTISTID" : "MusicBrainz Album Artist Id", fake_mbid(3, a % 7, 0).c_str(), 0);
+				if (t % 4 == 3)
+					av_dict_set(&tags, bf.vorbis_keys ? "MUSICBRAINZ_ARTISTID" : "MusicBrainz Artist Id",
+						(fake_mbid(3, a % 7, 0) + "; " + fake_mbid(4, (a + t) % 11, 0)).c_str(), 0);
+			}
+
+			int err = write_track(album_dir / fname, bf, tags, 220.0 + 10 * ((a * tracks_per_album + t) % 64), a % 2 == 1);
+			av_dict_free(&tags);
+			if (err < 0) {
+				std::cerr << "scanbench gen " << (album_dir / fname) << " : " << av_err2str(err) << std::endl;
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static uint64_t bytes_read_so_far()
+{
+	std::ifstream io("/proc/self/io");
+	std::string key;
+	uint64_t value;
+	while (io >> key >> value) {
+		if (key == "rchar:")
+			return value;
+	}
+	return 0;
+}
+
+static void run_phase(mediadb& md, const char *name, const fs::path& path)
+{
+	const uint64_t rchar_start = bytes_read_so_far();
+	const auto start = std::chrono::steady_clock::now();
+	const scan_stats stats = md.scan_path(path);
+	const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	const std::chrono::duration<double> probe_time = stats.probe_time, hash_time = stats.hash_time, sqlite_time = stats.sqlite_time;
+
+	std::cout << std::left << std::setw(20) << name << std::right
+		<< std::setw(8) << stats.files_discovered
+		<< std::setw(11) << stats.files_unchanged
+		<< std::setw(10) << std::fixed << std::setprecision(3) << elapsed.count()
+		<< std::setw(12) << std::setprecision(1) << stats.files_discovered / elapsed.count()
+		<< std::setw(12) << std::setprecision(2) << (bytes_read_so_far() - rchar_start) / 1048576.0
+		<< std::setw(10) << std::setprecision(3) << probe_time.count()
+		<< std::setw(10) << hash_time.count()
+		<< std::setw(10) << sqlite_time.count() << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		std::cerr << "usage: " << argv[0] << " <library dir> [albums = 50] [tracks per album = 10]" << std::endl;
+		return 1;
+	}
+	const fs::path root = argv[1];
+	const unsigned num_albums = argc > 2 ? atoi(argv[2]) : 50, tracks_per_album = argc > 3 ? atoi(argv[3]) : 10;
+
+	av_log_set_level(AV_LOG_ERROR);
+	sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
+
+	/* mediadb keeps its database in the library, and every run starts from an empty one: only ever
+	 * delete that in a library the bench made, never in one a server is using. */
+	if (fs::exists(root / BENCH_MARKER)) {
+		std::cout << "Reusing the library at " << root << std::endl;
+	} else if (fs::exists(root)) {
+		std::cerr << root << " exists and was not generated by " << argv[0] << "; give it a new directory" << std::endl;
+		return 1;
+	} else {
+		std::cout << "Generating " << num_albums << " albums of " << tracks_per_album << " tracks at " << root << std::endl;
+		if (!generate_library(root, num_albums, tracks_per_album))
+			return 1;
+	}
+
+	fs::remove(root / (APP_NAME ".db"));
+	fs::path cache_dir = fs::temp_directory_path() / APP_NAME "-scanbench-cache";
+	mediadb md(root.string(), cache_dir.string(), "lru", 0, 64 << 20);
+
+	std::cout << std::left << std::setw(20) << "phase" << std::right
+		<< std::setw(8) << "files" << std::setw(11) << "unchanged" << std::setw(10) << "seconds" << std::setw(12) << "files/s"
+		<< std::setw(12) << "MiB read" << std::setw(10) << "probe s" << std::setw(10) << "hash s" << std::setw(10) << "sqlite s" << std::endl;
+	run_phase(md, "full scan", root);
+	run_phase(md, "no-op rescan", root);
+	run_phase(md, "single album", root / "album_0000");
+	return 0;
+}
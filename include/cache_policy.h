@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/* What a cache index has to do, whatever its replacement policy. Values carry a weight (the
+ * size of a file, say); put() may evict other values, or the new one, through evict(). */
+template<typename T>
+class cache_policy {
+public:
+	virtual ~cache_policy() {}
+
+	virtual size_t size() const = 0;
+	virtual uint64_t weight() const = 0;
+
+	virtual void put(const T& value, uint64_t weight) = 0;
+	// Marks value as just used; false if it is not in the set.
+	virtual bool touch(const T& value) = 0;
+	// Records a lookup of a value that is not in the set.
+	virtual void miss(const T& value) {}
+	// Drops value without evicting it.
+	virtual bool erase(const T& value) = 0;
+	virtual bool contains(const T& value) const = 0;
+
+	virtual void evict(const T& evicted_value) = 0;
+};
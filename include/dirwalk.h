@@ -0,0 +1,44 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+namespace fs = std::filesystem;
+
+struct walk_entry {
+	fs::path path;
+	int64_t mtime; // nanoseconds since the epoch
+	int64_t size;
+};
+
+bool stat_entry(const fs::path& path, walk_entry& out);
+
+/* Walks a directory tree with a pool of threads, one directory per thread at a time, so that
+ * slow metadata lookups (NFS, SMB) overlap instead of queueing behind each other. Regular files
+ * come out of next() in no particular order while the walk is still going; at most max_queued
+ * of them are buffered before the walkers wait for the consumer. */
+class dir_walker {
+private:
+	std::mutex mtx;
+	std::condition_variable dirs_cv, files_cv, space_cv;
+	std::deque<fs::path> dirs;
+	std::deque<walk_entry> files;
+	std::set<std::pair<uint64_t, uint64_t>> visited;
+	size_t busy, max_queued;
+	bool stopping;
+	std::vector<std::thread> threads;
+
+	dir_walker(const dir_walker& o) = delete;
+	void walk_thread();
+	void walk_dir(const fs::path& dir);
+	void push_files(std::vector<walk_entry>& batch);
+
+public:
+	dir_walker(const fs::path& root, unsigned num_threads, size_t max_queued);
+	~dir_walker();
+
+	bool next(walk_entry& out);
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <condition_variable>
 #include <map>
 #include <memory>
@@ -10,6 +11,8 @@
 #include <string>
 #include <thread>
 #include "mediadb.h"
+#include "seekidx.h"
+#include "tcpool.h"
 
 using json = nlohmann::json;
 
@@ -37,6 +40,7 @@ public:
 		} response;
 
 		void reset();
+		std::string header_block();
 	public:
 		session(http_server *server, sockpp::tcp_socket&& sock) : server(server), socket_(std::move(sock))
 		{
@@ -73,8 +77,10 @@ public:
 		bool set_status_code(int code);
 		inline void set_response_header(const std::string& header, const std::string& value) { response.headers[header] = value; };
 		inline void clear_response_headers() { response.headers.clear(); };
-		void write_headers();
-		void write(const char *data, size_t length);
+		bool write_headers();
+		bool write(const char *data, size_t length);
+		bool write_chunk(const char *data, size_t length);
+		bool send_file(int fd, off_t offset, size_t length);
 		void serve_error(int status_code, const std::string& msg);
 	};
 
@@ -91,6 +97,38 @@ public:
 	virtual void pick_route(http_server::session* session) = 0;
 };
 
+// Transcoding ahead of time while the server is idle; off without any qualities.
+struct warmup_options {
+	std::vector<int> qualities;
+	std::string format;
+	std::vector<std::string> playlists;
+	size_t most_played, newest_albums;
+	unsigned jobs;
+	int nice;
+	bool idle_only;
+	uint64_t budget; // stop once the cache holds this many bytes
+};
+
+struct warmup_stats {
+	bool running = false, waiting = false, budget_reached = false;
+	size_t tracks = 0, planned = 0, cached = 0, done = 0, failed = 0, skipped = 0, in_flight = 0;
+	uint64_t bytes = 0;
+	time_t started = 0, finished = 0;
+};
+
+struct server_options {
+	unsigned tc_workers;
+	size_t tc_queue;
+	size_t prefetch_tracks, prefetch_jobs;
+	size_t overload_queue;
+	double overload_load;
+	bool tc_pipeline;
+	bool cache_fsync;
+	size_t chunk_bytes;
+	unsigned chunk_delay_ms;
+	warmup_options warmup;
+};
+
 class surf_server : public http_server {
 private:
 	mediadb& mdb;
@@ -100,6 +138,34 @@ private:
 	std::queue<sockpp::tcp_socket> sockets;
 	bool stop;
 
+	// Transcodes queued or in flight, by tc_job::key(); a second request for the same output attaches to the first.
+	std::mutex tc_mtx;
+	std::map<std::string, std::shared_ptr<tc_job>> tc_jobs;
+	// Guesses at what each listener, by address, plays next (under tc_mtx).
+	std::map<std::string, std::vector<std::shared_ptr<tc_job>>> prefetches;
+	tc_pool tcp;
+	size_t prefetch_tracks, prefetch_jobs;
+	// Past these, streams that allow it get a nearby quality that needs no transcode (see overloaded()).
+	size_t overload_queue;
+	double overload_load;
+	bool tc_pipeline;
+	bool cache_fsync;
+	// Live transcodes go out in chunks of at least chunk_bytes, unless that takes longer than chunk_delay.
+	size_t chunk_bytes;
+	std::chrono::milliseconds chunk_delay;
+
+	// Transcodes made ahead of time run on a pool of their own, warmup_opts.jobs wide (warmup.cpp).
+	const warmup_options warmup_opts;
+	const tc_format *warmup_fmt;
+	tc_pool warmup_pool;
+	std::mutex warmup_mtx;
+	std::condition_variable warmup_cv;
+	warmup_stats warmup_progress;
+	bool warmup_requested;
+	// The thread running each warm-up job, so one a listener wants can be sped up (under warmup_mtx).
+	std::map<const tc_job*, long> warmup_tids;
+	std::thread warmup_thread;
+
 	/* GET requests, return JSON, can be used in multiget */
 	void api_v1_albums(http_server::session* sn);
 	void api_v1_artists(http_server::session* sn);
@@ -117,9 +183,30 @@ private:
 	/* GET */
 	void api_v1_search(http_server::session* sn, const std::string& q);
 	void api_v1_stream(http_server::session* sn, const std::string& track_uuid);
-
-	void api_v1_stream_cached(http_server::session* sn, const std::string& path_to_tc);
-	void api_v1_transcode(http_server::session* sn, const std::string& track_uuid, const std::string& track_path, int quality);
+	void api_v1_hls_playlist(http_server::session* sn, const std::string& track_uuid);
+	void api_v1_hls_segment(http_server::session* sn, const std::string& track_uuid, int segment);
+	void track_started(http_server::session* sn, const std::string& track_uuid, int quality, const tc_format *fmt, bool prefetch = true);
+	void prefetch_next(http_server::session* sn, const std::string& track_uuid, int quality, const tc_format *fmt);
+	bool overloaded();
+	bool stream_neighbour(http_server::session* sn, const std::string& track_uuid, const track_source& track, int quality, int tolerance, const tc_format *fmt);
+	void api_v1_scan(http_server::session* sn);
+	void api_v1_warmup(http_server::session* sn);
+
+	void api_v1_stream_cached(http_server::session* sn, const std::string& path_to_tc, const tc_format *fmt, const seek_point *from = nullptr);
+	void api_v1_stream_file(http_server::session* sn, const std::string& path, const std::string& content_type, const std::string& quality);
+	void api_v1_stream_job(http_server::session* sn, std::shared_ptr<tc_job> job);
+	void api_v1_transcode(std::shared_ptr<tc_job> job);
+	void complete_after_seek(std::shared_ptr<tc_job> job);
+	std::shared_ptr<tc_job> attach_or_submit(std::shared_ptr<tc_job> job, bool listen);
+	void promote_job(std::shared_ptr<tc_job> job, tc_priority priority);
+	void prefetch_segment(const std::string& track_uuid, const track_source& track, int quality, const tc_format *fmt, int segment);
+	static bool is_passthrough(const track_source& track, int quality, const tc_format *fmt);
+
+	void warmup_run();
+	void warmup_pass();
+	void warmup_track(const std::string& track_uuid, std::vector<std::vector<std::shared_ptr<tc_job>>>& in_flight);
+	void warmup_transcode(std::shared_ptr<tc_job> job);
+	bool warmup_renice(const tc_job *job);
 
 	void api_v1_plist_DELETE(http_server::session* sn, const std::string& plist_uuid);
 	void api_v1_plist_PUT(http_server::session* sn, const std::string& plist_uuid);
@@ -128,7 +215,7 @@ private:
 	void write_json(http_server::session* sn, const json& doc);
 
 public:
-	surf_server(mediadb& mdb, unsigned short port);
+	surf_server(mediadb& mdb, unsigned short port, const server_options& opts);
 	~surf_server();
 
 	void accept();
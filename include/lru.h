@@ -1,21 +1,31 @@
 #pragma once
+#include <cstdint>
 #include <list>
 #include <map>
+#include "cache_policy.h"
 
+/* Least recently used set. Each value carries a weight (the size of a file, say); values fall off
+ * the back whenever there are more than max_size of them or their weights add up to more than
+ * max_weight. A limit of 0 means no limit. */
 template<typename T>
-class lru {
+class lru : public cache_policy<T> {
 private:
-	typedef typename std::list<T>::iterator list_iterator_t;
-	std::list<T> l;
+	struct entry {
+		T value;
+		uint64_t weight;
+	};
+	typedef typename std::list<entry>::iterator list_iterator_t;
+	std::list<entry> l;
 	std::map<T, list_iterator_t> m;
 	size_t max_size;
+	uint64_t max_weight, total_weight;
 public:
 
-	lru(size_t sz) : max_size(sz)
+	lru(size_t sz, uint64_t max_weight = 0) : max_size(sz), max_weight(max_weight), total_weight(0)
 	{
 	}
 
-	inline size_t size() const
+	inline size_t size() const override
 	{
 		return m.size();
 	}
@@ -24,29 +34,59 @@ public:
 		return max_size;
 	}
 
-	void put(const T& value)
+	inline uint64_t weight() const override
+	{
+		return total_weight;
+	}
+
+	inline uint64_t get_max_weight() const {
+		return max_weight;
+	}
+
+	void put(const T& value, uint64_t weight = 1) override
 	{
 		auto it = m.find(value);
-		l.push_front(value);
+		l.push_front({value, weight});
+		total_weight += weight;
 		if (it != m.end()) {
+			total_weight -= it->second->weight;
 			l.erase(it->second);
 			m.erase(it);
 		}
 		m[value] = l.begin();
 
-		if (m.size() > max_size) {
+		while (!l.empty() && ((max_size > 0 && m.size() > max_size) || (max_weight > 0 && total_weight > max_weight))) {
 			auto last = l.end();
 			last--;
-			evict(*last);
-			m.erase(*last);
+			this->evict(last->value);
+			total_weight -= last->weight;
+			m.erase(last->value);
 			l.pop_back();
 		}
 	}
 
-	inline bool contains(const T& value) const
+	bool touch(const T& value) override
 	{
-		return m.find(value) != m.end();
+		auto it = m.find(value);
+		if (it == m.end())
+			return false;
+		l.splice(l.begin(), l, it->second);
+		return true;
 	}
 
-	virtual void evict(const T& evicted_value) = 0;
+	bool erase(const T& value) override
+	{
+		auto it = m.find(value);
+		if (it == m.end())
+			return false;
+		total_weight -= it->second->weight;
+		l.erase(it->second);
+		m.erase(it);
+		return true;
+	}
+
+	inline bool contains(const T& value) const override
+	{
+		return m.find(value) != m.end();
+	}
 };
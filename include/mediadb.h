@@ -1,12 +1,19 @@
 #pragma once
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include "config.h"
+#include "dirwalk.h"
 #include <filesystem>
+#include <mutex>
 #include <optional>
 #include <sqlite3.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include "lru.h"
+#include "tccache.h"
 namespace fs = std::filesystem;
 
 class audio_tag {
@@ -40,10 +47,34 @@ public:
 
 	std::array<std::string, SVAL_MAX> stag;
 	std::array<std::vector<std::string>, LVAL_MAX> ltag;
+	uint64_t bytes_hashed = 0;
+	std::chrono::nanoseconds hash_time{0};
 
 	int populate(const fs::path& item);
 };
 
+struct scan_stats {
+	bool running = false;
+	std::string root, error; // error: why the scan stopped short, if it did
+	size_t files_discovered = 0, files_unchanged = 0, files_probed = 0, files_skipped = 0, files_failed = 0;
+	uint64_t bytes_hashed = 0;
+	std::chrono::nanoseconds elapsed{0}, probe_time{0}, hash_time{0}, sqlite_time{0};
+};
+
+struct uuid128 {
+	uint64_t hi, lo;
+	inline bool operator==(const uuid128& o) const { return hi == o.hi && lo == o.lo; }
+};
+
+struct uuid128_hash {
+	inline size_t operator()(const uuid128& k) const { return k.hi ^ (k.lo * 0x9e3779b97f4a7c15ULL); }
+};
+
+struct track_source {
+	std::string path, format;
+	int64_t bitrate, duration_ms;
+};
+
 class db_connection {
 private:
 	sqlite3 *db;
@@ -56,15 +87,6 @@ public:
 
 class mediadb {
 private:
-	class tccache : public lru<fs::path> {
-	public:
-		tccache(size_t sz) : lru<fs::path>(sz) {};
-		void evict(const fs::path& evicted_value) override
-		{
-			fs::remove(evicted_value);
-		}
-	};
-
 	enum prep_stmt_type {
 		INSERT_ARTISTS,
 		INSERT_ALBUMS,
@@ -74,22 +96,60 @@ private:
 		PREP_STMT_MAX
 	};
 
+	// Per-scan state; artists and albums already upserted during this scan are skipped, and so are
+	// tracks whose file still has the modification time and size recorded for it.
+	struct scan_session {
+		sqlite3_stmt* stmt[PREP_STMT_MAX] = {};
+		std::unordered_set<uuid128, uuid128_hash> artists, albums;
+		std::unordered_map<std::string, std::pair<int64_t, int64_t>> known_files;
+		scan_stats stats;
+	};
+
 	fs::path media_path, cache_path;
 	tccache cache;
 	std::map<std::string, std::chrono::system_clock::time_point> mod_times;
+	mutable std::mutex mod_mtx, scan_mtx;
+	scan_stats progress;
+	std::chrono::steady_clock::time_point scan_started;
+	std::thread scan_thread;
+	// Plays by track (count, last) not yet in the PLAYS table; play_thread writes them out in batches.
+	std::mutex play_mtx;
+	std::condition_variable play_cv;
+	std::unordered_map<std::string, std::pair<int64_t, int64_t>> pending_plays;
+	bool play_stop = false;
+	std::thread play_thread;
 
 	mediadb(const mediadb& o) = delete;
 	void init_db(sqlite3*);
+	void init_plays_table(sqlite3*);
+	void upgrade_db(sqlite3*, int from_version);
+	void load_known_files(const db_connection& dbc, const fs::path& root, scan_session& ss);
 	void init_prepped_inserts(sqlite3*, sqlite3_stmt**);
-	void scan_file(const db_connection& dbc, const fs::path& path, sqlite3_stmt** stmt);
+	void scan_file(const db_connection& dbc, const walk_entry& entry, scan_session& ss);
+	void scan_root(const db_connection& dbc, const fs::path& path, scan_session& ss);
+	void publish_progress(const scan_session& ss);
+	void touch_mod_time(const fs::path& root);
+	void play_run();
+	bool flush_plays();
 
 public:
-	mediadb(const std::string& media_path, const std::string& cache_path, size_t cache_size);
+	mediadb(const std::string& media_path, const std::string& cache_path, const std::string& cache_policy, size_t cache_size, uint64_t cache_budget);
+	~mediadb();
+	inline const fs::path& library_path() const { return media_path; };
 	inline db_connection dbconn() { return db_connection((media_path / APP_NAME ".db").string()); };
 
-	void scan_path(const fs::path& path);
-	std::optional<std::string> get_track_path(const std::string& track_uuid);
-	std::pair<std::string, bool> get_cached_transcode(const std::string& track_uuid, int quality);
+	scan_stats scan_path(const fs::path& path);
+	bool start_scan(const fs::path& path);
+	scan_stats scan_status() const;
+	std::optional<track_source> get_track(const std::string& track_uuid);
+	std::vector<std::string> next_tracks(const std::string& track_uuid, const std::string& plist_uuid, size_t n);
+	void record_play(const std::string& track_uuid);
+	std::vector<std::string> warmup_tracks(size_t most_played, size_t newest_albums, const std::vector<std::string>& playlists);
+	std::pair<std::string, bool> get_cached_transcode(const std::string& key);
+	bool has_cached_transcode(const std::string& key);
+	std::string cached_transcode_path(const std::string& key);
+	void add_cached_transcode(const std::string& path, uint64_t bytes);
+	inline std::pair<size_t, uint64_t> cache_usage() { return cache.usage(); };
 	std::chrono::system_clock::time_point latest_mod_time() const;
 };
 
@@ -0,0 +1,16 @@
+#pragma once
+#include "ffmpeg.h"
+#include <cstddef>
+
+/* Reading media files through FFmpeg with a buffer large enough that several readers at once do
+ * not turn a spinning disk's sequential reads into seeks. The kernel is told to read ahead of each
+ * refill, so the next one is usually already in memory. */
+
+constexpr size_t MEDIA_READ_AHEAD_DEFAULT = 1 << 20;
+
+// Applies to inputs opened after it is called; set it once at startup.
+void set_media_read_ahead(size_t bytes);
+
+// avformat_open_input on a plain file, which has to be closed with close_media_input.
+int open_media_input(AVFormatContext **ctx, const char *path);
+void close_media_input(AVFormatContext **ctx);
@@ -0,0 +1,18 @@
+#pragma once
+#include "ffmpeg.h"
+
+/* Sample format conversion for stereo audio that needs no resampling, which is most of a typical
+ * library: 44.1 kHz FLAC decodes to s16 or s32 and MP3 or AAC to fltp, and the encoders want s16p
+ * (LAME), fltp (AAC) or s16 (Opus). Buffers are laid out as FFmpeg does, one pointer per plane. */
+typedef void (*sampleconv_fn)(uint8_t *const *dst, const uint8_t *const *src, int samples);
+
+enum sampleconv_isa {
+	SC_SCALAR,
+	SC_SSE2,
+	SC_AVX2,
+	SC_BEST // the fastest this CPU supports
+};
+
+// Returns nullptr if there is no kernel for the pair, or none for that isa on this CPU.
+sampleconv_fn find_sampleconv(AVSampleFormat in, AVSampleFormat out, sampleconv_isa isa = SC_BEST);
+const char *sampleconv_isa_name(sampleconv_isa isa);
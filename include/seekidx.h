@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Where in a cached transcode each moment starts, so a time can be turned into a byte range
+ * without decoding anything. Kept next to the cache file it belongs to. */
+
+constexpr const char *SEEK_INDEX_SUFFIX = ".idx";
+constexpr int64_t SEEK_INDEX_INTERVAL_MS = 100;
+
+struct seek_point {
+	uint32_t ms;
+	uint32_t offset; // of the first byte of a frame, in the cache file
+};
+
+struct seek_index {
+	std::vector<seek_point> points;
+	uint32_t frames = 0;
+
+	// Records a frame, keeping at most one point per interval.
+	void add(int64_t ms, int64_t offset);
+	// The last point at or before ms, or nullptr if there are none.
+	const seek_point *find(int64_t ms) const;
+};
+
+// Returns the size of the file written, or 0 if it could not be.
+uint64_t write_seek_index(const std::string& path, const seek_index& idx);
+bool read_seek_index(const std::string& path, seek_index& idx);
+
+/* A silent MP3 frame holding a Xing header, for the start of a VBR file so players know its length
+ * and can seek in it. Empty if the sample rate is not one MP3 has. Fill in the table once the rest
+ * of the file is written: first is the frame's own offset, and bytes what follows it including itself. */
+std::vector<uint8_t> mp3_xing_frame(int sample_rate, int channels);
+void mp3_fill_xing(std::vector<uint8_t>& frame, const seek_index& idx, int sample_rate, uint32_t first, uint32_t bytes);
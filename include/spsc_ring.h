@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/* A bounded queue between exactly one producer thread and one consumer thread, without locks.
+ * The slots are allocated up front and reused: the producer fills the slot claim() gives it and
+ * publishes it, the consumer reads front() and pops it when done. Either side gets nullptr
+ * instead of waiting, and decides for itself how to wait. */
+template<typename T>
+class spsc_ring {
+private:
+	std::vector<T> slots;
+	const size_t mask;
+	// Counters only ever increase; each is written by one side and read by the other.
+	alignas(64) std::atomic<size_t> head{0};
+	alignas(64) std::atomic<size_t> tail{0};
+
+	static size_t round_up(size_t n)
+	{
+		size_t p = 2;
+		while (p < n)
+			p <<= 1;
+		return p;
+	}
+
+	spsc_ring(const spsc_ring& o) = delete;
+
+public:
+	spsc_ring(size_t capacity) : slots(round_up(capacity)), mask(slots.size() - 1) {};
+
+	// Every slot, to set up or tear down whatever they own while neither side is running.
+	inline std::vector<T>& storage() { return slots; };
+
+	T *claim()
+	{
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == slots.size())
+			return nullptr;
+		return &slots[t & mask];
+	}
+
+	void publish()
+	{
+		tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	T *front()
+	{
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &slots[h & mask];
+	}
+
+	void pop()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
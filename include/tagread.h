@@ -0,0 +1,15 @@
+#pragma once
+#include "ffmpeg.h"
+#include <filesystem>
+namespace fs = std::filesystem;
+
+struct native_stream_info {
+	AVCodecID codec_id;
+	int64_t bit_rate;
+	int64_t duration_ms;
+};
+
+/* Reads codec, duration and tags of FLAC, MP3 and MP4 files straight from their headers, filling
+ * dict with the keys FFmpeg's demuxers would produce. Anything else yields AVERROR_PATCHWELCOME
+ * so the caller can fall back to a full probe. */
+int read_native_tags(const fs::path& p, AVDictionary** dict, native_stream_info* info);
@@ -0,0 +1,55 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "lru.h"
+#include "tinylfu.h"
+namespace fs = std::filesystem;
+
+struct path_hash {
+	inline size_t operator()(const fs::path& p) const { return fs::hash_value(p); }
+};
+
+/* Index of the transcodes on disk, bounded by entry count and by bytes. Entries are spread over
+ * shards by name so concurrent streams rarely wait on each other; each shard gets an equal share
+ * of the limits. Evicted files are deleted after the shard lock is released. */
+class tccache {
+private:
+	// Any policy, with evictions collected instead of acted upon.
+	template<typename P>
+	class collecting : public P {
+	public:
+		std::vector<fs::path>& evicted;
+
+		collecting(std::vector<fs::path>& evicted, size_t sz, uint64_t max_bytes) : P(sz, max_bytes), evicted(evicted) {};
+		void evict(const fs::path& evicted_value) override
+		{
+			evicted.push_back(evicted_value);
+		}
+	};
+
+	struct shard {
+		std::mutex mtx;
+		std::vector<fs::path> evicted;
+		std::unique_ptr<cache_policy<fs::path>> policy;
+	};
+
+	std::vector<std::unique_ptr<shard>> shards;
+
+	tccache(const tccache& o) = delete;
+	shard& shard_for(const fs::path& p);
+	static void remove_evicted(std::vector<fs::path>& evicted);
+
+public:
+	// policy is "lru" or "tinylfu".
+	tccache(const std::string& policy, size_t max_entries, uint64_t max_bytes);
+
+	void put(const fs::path& p, uint64_t bytes);
+	bool touch(const fs::path& p);
+	void miss(const fs::path& p);
+	void erase(const fs::path& p);
+	void rebuild(const fs::path& dir);
+	std::pair<size_t, uint64_t> usage();
+};
@@ -0,0 +1,106 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "sampleconv.h"
+#include "seekidx.h"
+#include "spsc_ring.h"
+#include "transcode.h"
+
+/* The two halves of a transcode. Everything either half needs per frame (packets, frames, the
+ * conversion buffer and the fifo) is allocated when it is opened and reused until it is
+ * destroyed, so the steady state does no allocation of its own. */
+
+// Demuxer and decoder for the first audio stream of a file.
+struct tc_source {
+	AVFormatContext *fmt_ctx = nullptr;
+	AVCodecContext *codec_ctx = nullptr;
+	int stream = -1;
+	AVPacket *pkt = nullptr;
+	AVFrame *frame = nullptr;
+
+	tc_source() {};
+	tc_source(const tc_source& o) = delete;
+	~tc_source();
+
+	int open(const std::string& path);
+	// Decoding resumes at the last keyframe at or before ms.
+	int seek(int64_t ms);
+	// Decodes the next frame into frame, or sets *finished once there are no more.
+	int decode(bool *finished);
+};
+
+// Resampled audio handed from the decoding thread to the encoding thread in pipelined mode.
+struct pcm_block {
+	uint8_t **data = nullptr;
+	int capacity = 0;
+	int first = 0, count = 0; // the samples still to be encoded
+	bool eof = false;         // nothing follows; error says why
+	int error = 0;
+};
+
+// Resampler, encoder and muxer writing one job's output, trimmed to the job's start and end.
+struct tc_sink {
+	tc_job *job = nullptr;
+	AVFormatContext *fmt_ctx = nullptr;
+	AVCodecContext *codec_ctx = nullptr;
+	SwrContext *resample_ctx = nullptr;
+	sampleconv_fn conv_fn = nullptr; // used instead of resample_ctx when there is nothing to resample
+	AVAudioFifo *fifo = nullptr;
+	AVFrame *frame = nullptr;
+	AVPacket *pkt = nullptr;
+	uint8_t **conv = nullptr;
+	int conv_capacity = 0;
+	// Pipelined mode replaces the fifo with a ring of blocks, and fills frame a block at a time.
+	std::unique_ptr<spsc_ring<pcm_block>> ring;
+	int filled = 0;
+
+	// Cache files of whole tracks in formats that can be started at any frame are indexed.
+	bool indexed = false;
+	seek_index index;
+	std::vector<uint8_t> xing; // an MP3 cache file's Xing frame, at xing_at
+	int64_t xing_at = -1;
+
+	int in_sample_rate = 0;
+	AVRational in_time_base = {0, 1};
+	// Positions in the track, in output samples. next_sample is unknown (-1) after a seek until
+	// the first frame arrives.
+	int64_t next_sample = 0, start_sample = 0, end_sample = INT64_MAX;
+	uint64_t pts = 0;
+
+	// How it ended: complete, or fail says what went wrong and error has the code.
+	bool complete = false;
+	const char *fail = nullptr;
+	int error = 0;
+
+	tc_sink() {};
+	tc_sink(const tc_sink& o) = delete;
+	~tc_sink();
+
+	int open(tc_job *job, const AVCodecContext *in);
+	// Converts a decoded frame and queues it for the encoder.
+	int store(const AVFrame *in);
+	inline bool done() const { return next_sample >= end_sample; };
+	// Encodes every whole frame queued, and what is left over too if flush is set.
+	int encode(bool flush);
+	// Drains the encoder and writes the trailer.
+	int finish();
+
+	int open_ring(size_t blocks);
+	// Converts a decoded frame into a block of the ring (decoding thread).
+	int store_block(const AVFrame *in, pcm_block& b);
+	// Encodes blocks from the ring until the last one (encoding thread).
+	int encode_ring();
+
+private:
+	int resample(const AVFrame *in, uint8_t **dst, int capacity, int *skip);
+	int send(const AVFrame *f);
+	int send_filled();
+	int reserve_conv(int samples);
+};
+
+// Runs a transcode from start to end on this thread, decoding once for every sink. A sink that
+// fails or is cancelled drops out and the rest carry on.
+void tc_run(tc_source& src, const std::vector<tc_sink*>& sinks);
+// One sink, with decoding and resampling on a thread of their own, overlapping with encoding.
+void tc_run_pipelined(tc_source& src, tc_sink& sink);
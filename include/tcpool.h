@@ -0,0 +1,44 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "transcode.h"
+
+/* A fixed set of transcode workers fed from one queue per priority class. Workers always take
+ * the most urgent job waiting. Background classes may only fill half the queue, so a burst of
+ * prefetches cannot lock out someone pressing play. */
+class tc_pool {
+public:
+	typedef std::function<void(std::shared_ptr<tc_job>)> runner_t;
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::array<std::deque<std::shared_ptr<tc_job>>, TC_PRIORITY_MAX> queues;
+	std::array<size_t, TC_PRIORITY_MAX> running{};
+	runner_t run;
+	size_t max_queued, num_queued, num_active;
+	bool stopping;
+	std::vector<std::thread> threads;
+
+	tc_pool(const tc_pool& o) = delete;
+	void worker();
+
+public:
+	tc_pool(unsigned num_workers, size_t max_queued, runner_t run);
+	~tc_pool();
+
+	bool submit(std::shared_ptr<tc_job> job);
+	void promote(const std::shared_ptr<tc_job>& job, tc_priority priority);
+	bool withdraw(const std::shared_ptr<tc_job>& job);
+	size_t queued();
+	size_t active();
+	size_t pending(tc_priority priority);
+	bool saturated(size_t waiting);
+	inline size_t workers() const { return threads.size(); };
+};
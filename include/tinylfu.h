@@ -0,0 +1,227 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <vector>
+#include "cache_policy.h"
+
+/* Count-min sketch of how often keys were seen lately, with 4-bit counters. Every sample_size
+ * increments all counters are halved, so old popularity fades. */
+class freq_sketch {
+private:
+	static constexpr int DEPTH = 4;
+	std::vector<uint8_t> table;
+	size_t mask, additions, sample_size;
+
+	inline size_t index(uint64_t h, int row) const
+	{
+		const uint64_t h2 = (h * 0x9e3779b97f4a7c15ULL) >> 32 | 1;
+		return row * (mask + 1) + ((h + row * h2) & mask);
+	}
+
+public:
+	freq_sketch(size_t width)
+	{
+		size_t w = 64;
+		while (w < width)
+			w <<= 1;
+		table.assign(DEPTH * w, 0);
+		mask = w - 1;
+		additions = 0;
+		sample_size = 10 * w;
+	}
+
+	int frequency(uint64_t h) const
+	{
+		int f = 15;
+		for (int i = 0; i < DEPTH; i++)
+			f = std::min<int>(f, table[index(h, i)]);
+		return f;
+	}
+
+	void increment(uint64_t h)
+	{
+		bool added = false;
+		for (int i = 0; i < DEPTH; i++) {
+			uint8_t& c = table[index(h, i)];
+			if (c < 15) {
+				c++;
+				added = true;
+			}
+		}
+
+		if (added && ++additions >= sample_size) {
+			for (auto& c : table)
+				c >>= 1;
+			additions /= 2;
+		}
+	}
+};
+
+/* W-TinyLFU: new values wait in a small LRU window; when they leave it they only displace the
+ * main area's least recent value if they have been asked for more often, so one pass over a long
+ * tail of rarely played values cannot flush the popular ones. The main area is a segmented LRU:
+ * values hit again while on probation move to the protected segment.
+ *
+ * The window and segments are sized by weight if there is a weight limit, else by entry count. */
+template<typename T, typename Hash = std::hash<T>>
+class tinylfu : public cache_policy<T> {
+private:
+	enum segment { WINDOW, PROBATION, PROTECTED };
+	struct entry {
+		T value;
+		uint64_t weight;
+		segment seg;
+	};
+	typedef std::list<entry> queue_t;
+	typedef typename queue_t::iterator list_iterator_t;
+
+	queue_t queues[3]; // most recent at the front
+	uint64_t queue_cost[3];
+	std::map<T, list_iterator_t> m;
+	freq_sketch sketch;
+	Hash hash;
+	size_t max_size;
+	uint64_t max_weight, total_weight, budget, window_max, protected_max;
+
+	inline uint64_t cost(const entry& e) const
+	{
+		return max_weight > 0 ? e.weight : 1;
+	}
+
+	void move(list_iterator_t it, segment to)
+	{
+		queue_cost[it->seg] -= cost(*it);
+		queue_cost[to] += cost(*it);
+		queues[to].splice(queues[to].begin(), queues[it->seg], it);
+		it->seg = to;
+	}
+
+	void drop(list_iterator_t it, bool evicted)
+	{
+		if (evicted)
+			this->evict(it->value);
+		queue_cost[it->seg] -= cost(*it);
+		total_weight -= it->weight;
+		m.erase(it->value);
+		queues[it->seg].erase(it);
+	}
+
+	list_iterator_t main_victim()
+	{
+		auto& q = queues[PROBATION].empty() ? queues[PROTECTED] : queues[PROBATION];
+		return std::prev(q.end());
+	}
+
+	// Moves whatever overflows the window into the main area, if it earns its place there. The
+	// newest value always stays, so a window smaller than one file still works.
+	void maintain()
+	{
+		const uint64_t main_max = budget - window_max;
+		while (queue_cost[WINDOW] > window_max && queues[WINDOW].size() > 1) {
+			list_iterator_t cand = std::prev(queues[WINDOW].end());
+			if (cost(*cand) > main_max) {
+				drop(cand, true);
+				continue;
+			}
+
+			const int cand_freq = sketch.frequency(hash(cand->value));
+			bool admitted = true;
+			while (queue_cost[PROBATION] + queue_cost[PROTECTED] + cost(*cand) > main_max) {
+				list_iterator_t victim = main_victim();
+				if (cand_freq > sketch.frequency(hash(victim->value))) {
+					drop(victim, true);
+				} else {
+					admitted = false;
+					break;
+				}
+			}
+
+			if (admitted)
+				move(cand, PROBATION);
+			else
+				drop(cand, true);
+		}
+
+		// What the window kept may still not fit with everything else.
+		while (!m.empty() && ((max_size > 0 && m.size() > max_size) || queue_cost[WINDOW] + queue_cost[PROBATION] + queue_cost[PROTECTED] > budget)) {
+			if (queues[PROBATION].empty() && queues[PROTECTED].empty())
+				drop(std::prev(queues[WINDOW].end()), true);
+			else
+				drop(main_victim(), true);
+		}
+	}
+
+public:
+	tinylfu(size_t sz, uint64_t max_weight = 0, size_t sketch_width = 1024)
+		: queue_cost{0, 0, 0}, sketch(sketch_width), max_size(sz), max_weight(max_weight), total_weight(0)
+	{
+		budget = max_weight > 0 ? max_weight : sz > 0 ? sz : UINT64_MAX;
+		window_max = std::max<uint64_t>(budget / 100, 1);
+		protected_max = (budget - window_max) * 4 / 5;
+	}
+
+	inline size_t size() const override
+	{
+		return m.size();
+	}
+
+	inline uint64_t weight() const override
+	{
+		return total_weight;
+	}
+
+	void put(const T& value, uint64_t weight = 1) override
+	{
+		auto it = m.find(value);
+		if (it != m.end()) {
+			queue_cost[it->second->seg] -= cost(*it->second);
+			total_weight -= it->second->weight;
+			it->second->weight = weight;
+			queue_cost[it->second->seg] += cost(*it->second);
+			total_weight += weight;
+			touch(value);
+		} else {
+			queues[WINDOW].push_front({value, weight, WINDOW});
+			queue_cost[WINDOW] += cost(queues[WINDOW].front());
+			total_weight += weight;
+			m[value] = queues[WINDOW].begin();
+		}
+		maintain();
+	}
+
+	bool touch(const T& value) override
+	{
+		sketch.increment(hash(value));
+		auto it = m.find(value);
+		if (it == m.end())
+			return false;
+
+		list_iterator_t e = it->second;
+		move(e, e->seg == PROBATION ? PROTECTED : e->seg);
+		while (queue_cost[PROTECTED] > protected_max && queues[PROTECTED].size() > 1)
+			move(std::prev(queues[PROTECTED].end()), PROBATION);
+		return true;
+	}
+
+	void miss(const T& value) override
+	{
+		sketch.increment(hash(value));
+	}
+
+	bool erase(const T& value) override
+	{
+		auto it = m.find(value);
+		if (it == m.end())
+			return false;
+		drop(it->second, false);
+		return true;
+	}
+
+	inline bool contains(const T& value) const override
+	{
+		return m.find(value) != m.end();
+	}
+};
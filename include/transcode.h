@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ffmpeg.h"
+
+enum tc_priority {
+	TC_INTERACTIVE = 0, // someone is listening
+	TC_PREFETCH,        // someone is probably about to listen
+	TC_WARMUP,          // filling the cache while idle
+	TC_PRIORITY_MAX
+};
+
+/* An output format: container, codec and what q=0 (best) to q=9 (smallest) mean for it. MP3 uses
+ * LAME's VBR levels directly; the others map q to a target bitrate. */
+struct tc_format {
+	const char *name;  // as in ?fmt=
+	const char *muxer;
+	const char *ext;
+	const char *mime;
+	AVCodecID codec_id;
+	const char *encoder; // preferred encoder, if it is built in
+	int sample_rate;
+	int kbps[10];
+	const char *mux_opts; // key=value:key=value
+};
+
+const tc_format *find_tc_format(const std::string& name);
+
+/* One transcode of a track at a quality. The encoder appends to data and every listener follows
+ * it from its own offset, so a listener that attaches late still gets the stream from the start. */
+struct tc_job {
+	const std::string track_uuid, track_path;
+	const int quality;
+	const tc_format *fmt;
+	// Only a pool changes it, under its lock, but anyone may look.
+	std::atomic<tc_priority> priority;
+	int64_t start_ms = 0; // jobs that start past zero stream a seek and are never cached...
+	int64_t end_ms = 0;   // 0 for the end of the track
+	int segment = -1;     // ...unless they make one segment of an HLS stream
+
+	/* Other outputs of the same track that share this job's decode. They are in the registry like
+	 * any job, but only this one is in the pool. Both fields are guarded by the registry lock, as
+	 * is started, which is set once the decode has begun and nothing more can join. */
+	std::vector<std::shared_ptr<tc_job>> branches;
+	std::weak_ptr<tc_job> host;
+	bool started = false;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::string data;
+	size_t length = 0; // of data, which is let go once finished if nobody is reading it
+	bool finished = false;
+	int error = 0;
+	std::string error_msg;
+
+	// Set once the last listener leaves a job nobody else wants; the encoder gives up at its next write.
+	size_t listeners = 0;
+	bool keep;
+	std::atomic<bool> cancelled{false};
+
+	// Output is also written to cache_tmp, next to where it will be cached, and renamed into place when complete.
+	int cache_fd = -1;
+	std::string cache_tmp;
+
+	tc_job(const std::string& track_uuid, const std::string& track_path, int quality, const tc_format *fmt, tc_priority priority)
+		: track_uuid(track_uuid), track_path(track_path), quality(quality), fmt(fmt), priority(priority), keep(priority != TC_INTERACTIVE) {};
+
+	// Names the output in the registry of jobs and in the cache.
+	static std::string key(const std::string& track_uuid, int quality, const tc_format *fmt, int segment = -1)
+	{
+		std::string k = track_uuid + "." + std::to_string(quality) + ".";
+		if (segment >= 0)
+			k += std::to_string(segment) + ".";
+		return k + fmt->ext;
+	}
+	inline std::string key() const { return key(track_uuid, quality, fmt, segment); };
+	inline bool full_length() const { return start_ms == 0 && segment < 0; };
+
+	// Fails if the job was already cancelled; the caller should start a new one.
+	bool attach()
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		if (cancelled)
+			return false;
+		listeners++;
+		return true;
+	}
+
+	void detach()
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		if (--listeners == 0 && !keep && !finished)
+			cancelled = true;
+	}
+
+	bool done()
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		return finished;
+	}
+
+	// Cancels the job if nobody is listening to it; it was only ever a guess.
+	void abandon()
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		if (listeners == 0 && !finished)
+			cancelled = true;
+	}
+
+	void append(const uint8_t *buf, size_t len)
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		data.append(reinterpret_cast<const char*>(buf), len);
+		cv.notify_all();
+	}
+
+	void finish(int err, const std::string& msg = "")
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		finished = true;
+		error = err;
+		error_msg = msg;
+		length = data.size();
+		// Nobody can attach any more, so with no listeners the output is only in the cache now.
+		if (listeners == 0)
+			std::string().swap(data);
+		cv.notify_all();
+	}
+
+	/* Copies what is past offset into out, waiting for the encoder if there is nothing yet. Until
+	 * the deadline it also waits for at least batch bytes, so the small pieces muxers write go out
+	 * together. Returns false once the job is finished and everything has been read. */
+	bool read(size_t offset, std::vector<char>& out, size_t batch = 1,
+		std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::min())
+	{
+		std::unique_lock<std::mutex> lck(mtx);
+		if (!cv.wait_until(lck, deadline, [&] { return data.size() >= offset + batch || finished; }))
+			cv.wait(lck, [&] { return data.size() > offset || finished; });
+		out.assign(data.begin() + std::min(offset, data.size()), data.end());
+		return !out.empty();
+	}
+};
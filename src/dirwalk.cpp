@@ -0,0 +1,125 @@
+#include "dirwalk.h"
+#include <sys/stat.h>
+constexpr size_t WALK_BATCH = 32;
+
+static int64_t mtime_ns(const struct stat& st)
+{
+#ifdef __APPLE__
+	return st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+	return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+bool stat_entry(const fs::path& path, walk_entry& out)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	out.path = path;
+	out.mtime = mtime_ns(st);
+	out.size = st.st_size;
+	return true;
+}
+
+dir_walker::dir_walker(const fs::path& root, unsigned num_threads, size_t max_queued)
+	: busy(0), max_queued(max_queued), stopping(false)
+{
+	struct stat st;
+	if (stat(root.c_str(), &st) == 0)
+		visited.emplace(st.st_dev, st.st_ino);
+	dirs.push_back(root);
+
+	if (num_threads == 0)
+		num_threads = 1;
+	for (unsigned i = 0; i < num_threads; i++)
+		threads.emplace_back(&dir_walker::walk_thread, this);
+}
+
+dir_walker::~dir_walker()
+{
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		stopping = true;
+	}
+	dirs_cv.notify_all();
+	space_cv.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+void dir_walker::walk_thread()
+{
+	std::unique_lock<std::mutex> lck(mtx);
+	while (true) {
+		dirs_cv.wait(lck, [this] { return stopping || !dirs.empty() || busy == 0; });
+		if (stopping || dirs.empty())
+			break;
+
+		fs::path dir = std::move(dirs.front());
+		dirs.pop_front();
+		busy++;
+		lck.unlock();
+		walk_dir(dir);
+		lck.lock();
+		busy--;
+	}
+
+	// Whoever finds the walk finished wakes everyone else up, including the consumer.
+	dirs_cv.notify_all();
+	files_cv.notify_all();
+}
+
+void dir_walker::walk_dir(const fs::path& dir)
+{
+	std::error_code ec;
+	std::vector<walk_entry> batch;
+	struct stat st;
+
+	for (fs::directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+		const fs::path& p = it->path();
+		if (stat(p.c_str(), &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			// Directory symlinks are followed, so guard against loops.
+			std::lock_guard<std::mutex> lck(mtx);
+			if (visited.emplace(st.st_dev, st.st_ino).second && !stopping) {
+				dirs.push_back(p);
+				dirs_cv.notify_one();
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			batch.push_back({p, mtime_ns(st), st.st_size});
+			if (batch.size() >= WALK_BATCH)
+				push_files(batch);
+		}
+	}
+	push_files(batch);
+}
+
+void dir_walker::push_files(std::vector<walk_entry>& batch)
+{
+	if (batch.empty())
+		return;
+
+	std::unique_lock<std::mutex> lck(mtx);
+	space_cv.wait(lck, [this] { return stopping || files.size() < max_queued; });
+	for (auto& e : batch)
+		files.push_back(std::move(e));
+	batch.clear();
+	files_cv.notify_one();
+}
+
+bool dir_walker::next(walk_entry& out)
+{
+	std::unique_lock<std::mutex> lck(mtx);
+	files_cv.wait(lck, [this] { return !files.empty() || (dirs.empty() && busy == 0); });
+	if (files.empty())
+		return false;
+
+	out = std::move(files.front());
+	files.pop_front();
+	space_cv.notify_one();
+	return true;
+}
@@ -1,6 +1,11 @@
 #include "http.h"
 #include <iostream>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "picohttpparser.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 static const char *status_code_name(int code)
 {
@@ -161,12 +166,29 @@ bool http_server::session::set_status_code(int code)
 	return true;
 }
 
-void http_server::session::write_headers()
+// Writes every byte of iov, resuming partial writes.
+static bool writev_all(int fd, iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t r = ::writev(fd, iov, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		for (; n > 0 && static_cast<size_t>(r) >= iov->iov_len; iov++, n--)
+			r -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + r;
+			iov->iov_len -= r;
+		}
+	}
+	return true;
+}
+
+std::string http_server::session::header_block()
 {
 	if (response.status_code == 0)
 		throw std::invalid_argument("cannot write a response without a valid status");
-	if (response.header_written)
-		return;
 
 	std::stringstream ss;
 	ss << "HTTP/1." << request.minor_version << " " << response.status_code << " " << status_code_name(response.status_code) << "\r\n"
@@ -176,15 +198,76 @@ void http_server::session::write_headers()
 	for (auto it = response.headers.begin(); it != response.headers.end(); ++it)
 		ss << it->first << ": " << it->second << "\r\n";
 	ss << "\r\n";
+	return ss.str();
+}
+
+bool http_server::session::write_headers()
+{
+	if (response.header_written)
+		return true;
 
-	socket_.write(ss.str());
+	const std::string hdr = header_block();
 	response.header_written = true;
+	return socket_.write(hdr) == static_cast<ssize_t>(hdr.length());
+}
+
+// Returns false once the peer has gone away, so long responses can stop early.
+bool http_server::session::write(const char *data, size_t length)
+{
+	if (response.header_written == false && !write_headers())
+		return false;
+
+	return socket_.write(data, length) == static_cast<ssize_t>(length);
 }
 
-void http_server::session::write(const char *data, size_t length)
+/* Sends one chunk of a chunked response, framed and behind the headers if they have not gone out
+ * yet, in one system call so it leaves in as few segments as it can. An empty chunk ends the
+ * response. */
+bool http_server::session::write_chunk(const char *data, size_t length)
 {
-	if (response.header_written == false)
-		write_headers();
+	std::string hdr;
+	if (response.header_written == false) {
+		hdr = header_block();
+		response.header_written = true;
+	}
+
+	char cel[20];
+	int celln = snprintf(cel, sizeof(cel), "%zX\r\n", length);
+	iovec iov[] = {
+		{const_cast<char*>(hdr.data()), hdr.length()},
+		{cel, static_cast<size_t>(celln)},
+		{const_cast<char*>(data), length},
+		{const_cast<char*>("\r\n"), 2},
+	};
+	return writev_all(socket_.handle(), iov, 4);
+}
 
-	socket_.write(data, length);
+// Sends length bytes of fd from offset, by sendfile where there is one.
+bool http_server::session::send_file(int fd, off_t offset, size_t length)
+{
+	if (response.header_written == false && !write_headers())
+		return false;
+
+#ifdef __linux__
+	while (length > 0) {
+		ssize_t r = sendfile(socket_.handle(), fd, &offset, std::min<size_t>(length, 1 << 30));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		length -= r;
+	}
+#else
+	std::vector<char> buf(65536);
+	while (length > 0) {
+		ssize_t r = pread(fd, buf.data(), std::min(length, buf.size()), offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0 || socket_.write(buf.data(), r) != r)
+			return false;
+		offset += r;
+		length -= r;
+	}
+#endif
+	return true;
 }
@@ -2,10 +2,13 @@
 #include "ffmpeg.h"
 #include "ini.h"
 #include "mediadb.h"
+#include "mediaio.h"
 #include "http.h"
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <regex>
+#include <sstream>
 #include <sago/platform_folders.h>
 #include <sqlite3.h>
 #include <string>
@@ -28,20 +31,86 @@ static void ignore_broken_pipes(void)
 }
 
 typedef struct {
-	std::string media_dir;
-	int port, cache_size;
+	std::string media_dir, cache_policy;
+	int port, cache_size, cache_budget, read_ahead;
+	int tc_workers, tc_queue, tc_prefetch, tc_prefetch_jobs, tc_overload_queue;
+	double tc_overload_load;
+	int chunk_size, chunk_delay;
+	bool tc_pipeline, cache_fsync;
+	std::string warmup_qualities, warmup_format, warmup_playlists;
+	int warmup_most_played, warmup_newest, warmup_jobs, warmup_nice, warmup_budget;
+	bool warmup_idle;
 } inidata;
 
+// "a, b,c" to {"a", "b", "c"}, leaving out empty items.
+static std::vector<std::string> split_list(const std::string& s)
+{
+	std::vector<std::string> items;
+	std::stringstream ss(s);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		item.erase(0, item.find_first_not_of(" \t"));
+		item.erase(item.find_last_not_of(" \t") + 1);
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
 static int ini_parser(void* user, const char* section, const char* name, const char* value)
 {
 	#define MATCH(s, n) (strcmp(section, s) == 0 && strcmp(name, n) == 0)
 	inidata *cfg = reinterpret_cast<inidata *>(user);
 	if (MATCH("net", "port"))
 		cfg->port = atoi(value);
+	else if (MATCH("net", "chunk_size"))
+		cfg->chunk_size = atoi(value);
+	else if (MATCH("net", "chunk_delay"))
+		cfg->chunk_delay = atoi(value);
 	else if (MATCH("media", "path"))
 		cfg->media_dir = value;
 	else if (MATCH("media", "cache_size"))
 		cfg->cache_size = atoi(value);
+	else if (MATCH("media", "cache_policy"))
+		cfg->cache_policy = value;
+	else if (MATCH("media", "cache_budget"))
+		cfg->cache_budget = atoi(value);
+	else if (MATCH("media", "cache_fsync"))
+		cfg->cache_fsync = atoi(value) != 0;
+	else if (MATCH("media", "read_ahead"))
+		cfg->read_ahead = atoi(value);
+	else if (MATCH("transcode", "workers"))
+		cfg->tc_workers = atoi(value);
+	else if (MATCH("transcode", "queue"))
+		cfg->tc_queue = atoi(value);
+	else if (MATCH("transcode", "pipeline"))
+		cfg->tc_pipeline = atoi(value) != 0;
+	else if (MATCH("transcode", "prefetch"))
+		cfg->tc_prefetch = atoi(value);
+	else if (MATCH("transcode", "prefetch_jobs"))
+		cfg->tc_prefetch_jobs = atoi(value);
+	else if (MATCH("transcode", "overload_queue"))
+		cfg->tc_overload_queue = atoi(value);
+	else if (MATCH("transcode", "overload_load"))
+		cfg->tc_overload_load = atof(value);
+	else if (MATCH("warmup", "qualities"))
+		cfg->warmup_qualities = value;
+	else if (MATCH("warmup", "format"))
+		cfg->warmup_format = value;
+	else if (MATCH("warmup", "playlists"))
+		cfg->warmup_playlists = value;
+	else if (MATCH("warmup", "most_played"))
+		cfg->warmup_most_played = atoi(value);
+	else if (MATCH("warmup", "newest"))
+		cfg->warmup_newest = atoi(value);
+	else if (MATCH("warmup", "jobs"))
+		cfg->warmup_jobs = atoi(value);
+	else if (MATCH("warmup", "nice"))
+		cfg->warmup_nice = atoi(value);
+	else if (MATCH("warmup", "idle"))
+		cfg->warmup_idle = atoi(value) != 0;
+	else if (MATCH("warmup", "budget"))
+		cfg->warmup_budget = atoi(value);
 	else
 		return 0;
 
@@ -61,33 +130,170 @@ int main(int argc, char **argv)
 		cfg.port = 27440;
 	else
 		cfg.port = atoi(env);
+	if ((env = std::getenv("SURF_CHUNK_SIZE")) == nullptr)
+		cfg.chunk_size = 16;
+	else
+		cfg.chunk_size = atoi(env);
+	if ((env = std::getenv("SURF_CHUNK_DELAY")) == nullptr)
+		cfg.chunk_delay = 20;
+	else
+		cfg.chunk_delay = atoi(env);
 	if ((env = std::getenv("SURF_MAX_CACHE")) == nullptr)
-		cfg.cache_size = 64;
+		cfg.cache_size = 0;
 	else
 		cfg.cache_size = atoi(env);
+	if ((env = std::getenv("SURF_CACHE_BUDGET")) == nullptr)
+		cfg.cache_budget = 2048;
+	else
+		cfg.cache_budget = atoi(env);
 	if ((env = std::getenv("SURF_MEDIA")) != nullptr)
 		cfg.media_dir = env;
+	if ((env = std::getenv("SURF_CACHE_POLICY")) == nullptr)
+		cfg.cache_policy = "lru";
+	else
+		cfg.cache_policy = env;
+	if ((env = std::getenv("SURF_CACHE_FSYNC")) == nullptr)
+		cfg.cache_fsync = false;
+	else
+		cfg.cache_fsync = atoi(env) != 0;
+	if ((env = std::getenv("SURF_READ_AHEAD")) == nullptr)
+		cfg.read_ahead = MEDIA_READ_AHEAD_DEFAULT >> 10;
+	else
+		cfg.read_ahead = atoi(env);
+	if ((env = std::getenv("SURF_TC_WORKERS")) == nullptr)
+		cfg.tc_workers = std::max(1U, std::thread::hardware_concurrency() / 2);
+	else
+		cfg.tc_workers = atoi(env);
+	if ((env = std::getenv("SURF_TC_QUEUE")) == nullptr)
+		cfg.tc_queue = 32;
+	else
+		cfg.tc_queue = atoi(env);
+	if ((env = std::getenv("SURF_TC_PREFETCH")) == nullptr)
+		cfg.tc_prefetch = 1;
+	else
+		cfg.tc_prefetch = atoi(env);
+	if ((env = std::getenv("SURF_TC_PREFETCH_JOBS")) == nullptr)
+		cfg.tc_prefetch_jobs = -1; // half the workers, once their number is settled
+	else
+		cfg.tc_prefetch_jobs = atoi(env);
+	if ((env = std::getenv("SURF_TC_OVERLOAD_QUEUE")) == nullptr)
+		cfg.tc_overload_queue = 0;
+	else
+		cfg.tc_overload_queue = atoi(env);
+	if ((env = std::getenv("SURF_TC_OVERLOAD_LOAD")) == nullptr)
+		cfg.tc_overload_load = 0;
+	else
+		cfg.tc_overload_load = atof(env);
+	if ((env = std::getenv("SURF_TC_PIPELINE")) == nullptr)
+		cfg.tc_pipeline = std::thread::hardware_concurrency() > 1;
+	else
+		cfg.tc_pipeline = atoi(env) != 0;
+	if ((env = std::getenv("SURF_WARMUP_QUALITIES")) != nullptr)
+		cfg.warmup_qualities = env;
+	if ((env = std::getenv("SURF_WARMUP_FORMAT")) == nullptr)
+		cfg.warmup_format = "mp3";
+	else
+		cfg.warmup_format = env;
+	if ((env = std::getenv("SURF_WARMUP_PLAYLISTS")) != nullptr)
+		cfg.warmup_playlists = env;
+	if ((env = std::getenv("SURF_WARMUP_MOST_PLAYED")) == nullptr)
+		cfg.warmup_most_played = 100;
+	else
+		cfg.warmup_most_played = atoi(env);
+	if ((env = std::getenv("SURF_WARMUP_NEWEST")) == nullptr)
+		cfg.warmup_newest = 10;
+	else
+		cfg.warmup_newest = atoi(env);
+	if ((env = std::getenv("SURF_WARMUP_JOBS")) == nullptr)
+		cfg.warmup_jobs = 1;
+	else
+		cfg.warmup_jobs = atoi(env);
+	if ((env = std::getenv("SURF_WARMUP_NICE")) == nullptr)
+		cfg.warmup_nice = 10;
+	else
+		cfg.warmup_nice = atoi(env);
+	if ((env = std::getenv("SURF_WARMUP_IDLE")) == nullptr)
+		cfg.warmup_idle = true;
+	else
+		cfg.warmup_idle = atoi(env) != 0;
+	if ((env = std::getenv("SURF_WARMUP_BUDGET")) == nullptr)
+		cfg.warmup_budget = -1; // half the cache budget
+	else
+		cfg.warmup_budget = atoi(env);
 
 	int ini_parsed = ini_parse(config_path.c_str(), ini_parser, &cfg);
+	if (cfg.tc_prefetch_jobs < 0)
+		cfg.tc_prefetch_jobs = std::max(1, cfg.tc_workers / 2);
+	if (cfg.warmup_budget < 0)
+		cfg.warmup_budget = std::max(0, cfg.cache_budget) / 2;
+
+	std::vector<int> warmup_qualities;
+	for (const auto& q : split_list(cfg.warmup_qualities)) {
+		if (q.size() == 1 && q[0] >= '0' && q[0] <= '9' && std::find(warmup_qualities.begin(), warmup_qualities.end(), q[0] - '0') == warmup_qualities.end())
+			warmup_qualities.push_back(q[0] - '0');
+		else
+			std::cerr << "Ignoring warm-up quality " << q << " (should be 0 to 9)" << std::endl;
+	}
+	if (!warmup_qualities.empty() && find_tc_format(cfg.warmup_format) == nullptr) {
+		std::cerr << "Unknown warm-up format " << cfg.warmup_format << "; warm-up is off." << std::endl;
+		warmup_qualities.clear();
+	}
 	if (cfg.media_dir == "") {
 		sago::PlatformFolders p;
 		cfg.media_dir = p.getMusicFolder();
 	}
 
 	std::cout << "Configuration: (" << (ini_parsed < 0 ? "unable to load" : "loaded") << " from " << config_path << ")" << std::endl
-		<< "\tport:\t\t" << cfg.port << std::endl
-		<< "\tcache size:\t" << cfg.cache_size << std::endl
-		<< "\tpath:\t\t" << cfg.media_dir << std::endl;
+		<< "\tport:\t\t" << cfg.port << " (chunks of " << cfg.chunk_size << " KiB or " << cfg.chunk_delay << " ms)" << std::endl
+		<< "\tcache size:\t" << (cfg.cache_size > 0 ? std::to_string(cfg.cache_size) + " files, " : "") << cfg.cache_budget << " MiB, " << cfg.cache_policy << (cfg.cache_fsync ? ", fsync" : "") << std::endl
+		<< "\ttranscoders:\t" << cfg.tc_workers << " (queue " << cfg.tc_queue << ")" << (cfg.tc_pipeline ? ", pipelined" : "")
+			<< ", prefetching " << cfg.tc_prefetch << " track(s) with up to " << cfg.tc_prefetch_jobs << std::endl
+		<< "\toverloaded:\twith " << cfg.tc_overload_queue << " transcode(s) waiting"
+			<< (cfg.tc_overload_load > 0 ? " or load over " + std::to_string(cfg.tc_overload_load) + " per thread" : "") << std::endl
+		<< "\tpath:\t\t" << cfg.media_dir << " (read-ahead " << cfg.read_ahead << " KiB)" << std::endl
+		<< "\twarm-up:\t";
+	if (warmup_qualities.empty()) {
+		std::cout << "off" << std::endl;
+	} else {
+		std::cout << cfg.warmup_format << " q=";
+		for (size_t i = 0; i < warmup_qualities.size(); i++)
+			std::cout << (i > 0 ? "," : "") << warmup_qualities[i];
+		std::cout << " up to " << cfg.warmup_budget << " MiB, " << cfg.warmup_jobs << " job(s) at nice " << cfg.warmup_nice
+			<< (cfg.warmup_idle ? " when idle" : "") << std::endl;
+	}
 
 	av_log_set_level(AV_LOG_ERROR);
 	sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
 	ignore_broken_pipes();
+	set_media_read_ahead(static_cast<size_t>(std::max(0, cfg.read_ahead)) << 10);
 
-	mediadb md(cfg.media_dir, cache_path, cfg.cache_size);
-	md.scan_path(cfg.media_dir);
+	mediadb md(cfg.media_dir, cache_path, cfg.cache_policy, std::max(0, cfg.cache_size), static_cast<uint64_t>(std::max(0, cfg.cache_budget)) << 20);
+	auto cache_usage = md.cache_usage();
+	std::cout << "Transcode cache holds " << cache_usage.first << " files, " << (cache_usage.second >> 20) << " MiB." << std::endl;
+	md.start_scan(cfg.media_dir);
 
-	surf_server server(md, cfg.port);
-	std::cout << "Now accepting new connections." << std::endl;
+	server_options opts;
+	opts.tc_workers = std::max(1, cfg.tc_workers);
+	opts.tc_queue = std::max(1, cfg.tc_queue);
+	opts.tc_pipeline = cfg.tc_pipeline;
+	opts.prefetch_tracks = std::max(0, cfg.tc_prefetch);
+	opts.prefetch_jobs = std::max(0, cfg.tc_prefetch_jobs);
+	opts.overload_queue = std::max(0, cfg.tc_overload_queue);
+	opts.overload_load = std::max(0.0, cfg.tc_overload_load);
+	opts.cache_fsync = cfg.cache_fsync;
+	opts.chunk_bytes = static_cast<size_t>(std::max(0, cfg.chunk_size)) << 10;
+	opts.chunk_delay_ms = std::max(0, cfg.chunk_delay);
+	opts.warmup.qualities = warmup_qualities;
+	opts.warmup.format = cfg.warmup_format;
+	opts.warmup.playlists = split_list(cfg.warmup_playlists);
+	opts.warmup.most_played = std::max(0, cfg.warmup_most_played);
+	opts.warmup.newest_albums = std::max(0, cfg.warmup_newest);
+	opts.warmup.jobs = std::max(1, cfg.warmup_jobs);
+	opts.warmup.nice = cfg.warmup_nice;
+	opts.warmup.idle_only = cfg.warmup_idle;
+	opts.warmup.budget = static_cast<uint64_t>(cfg.warmup_budget) << 20;
+	surf_server server(md, cfg.port, opts);
+	std::cout << "Now accepting new connections; the library scan continues in the background (see /api/v1/scan)." << std::endl;
 	server.run();
 
 	return 0;
@@ -1,6 +1,14 @@
 #include "config.h"
 #include "mediadb.h"
+#include <algorithm>
+#include <functional>
+#include <iostream>
 #include <sstream>
+constexpr int SURF_DB_VERSION = 4;
+constexpr size_t SCAN_COMMIT_INTERVAL = 256;
+constexpr auto PLAY_FLUSH_INTERVAL = std::chrono::seconds(30);
+constexpr unsigned SCAN_WALK_THREADS = 8;
+constexpr size_t SCAN_WALK_QUEUE = 4096;
 
 /* I want RAII! */
 db_connection::db_connection(const std::string& uri)
@@ -11,6 +19,7 @@ db_connection::db_connection(const std::string& uri)
 
 	sqlite3_exec(db, "PRAGMA synchronous = OFF", nullptr, nullptr, nullptr);
 	sqlite3_exec(db, "PRAGMA journal_mode = MEMORY", nullptr, nullptr, nullptr);
+	sqlite3_busy_timeout(db, 1000);
 }
 
 db_connection::~db_connection()
@@ -18,8 +27,8 @@ db_connection::~db_connection()
 	sqlite3_close(db);
 }
 
-mediadb::mediadb(const std::string& media_path, const std::string& cache_path, size_t cache_size)
-	: media_path(media_path), cache_path(cache_path), cache(cache_size)
+mediadb::mediadb(const std::string& media_path, const std::string& cache_path, const std::string& cache_policy, size_t cache_size, uint64_t cache_budget)
+	: media_path(media_path), cache_path(cache_path), cache(cache_policy, cache_size, cache_budget)
 {
 	fs::path db_path = this->media_path / (APP_NAME ".db");
 	fs::create_directories(media_path);
@@ -43,8 +52,24 @@ mediadb::mediadb(const std::string& media_path, const std::string& cache_path, s
 
 	if (db_version == 0)
 		init_db(db);
+	else if (db_version < SURF_DB_VERSION)
+		upgrade_db(db, db_version);
 
 	sqlite3_close(db);
+	cache.rebuild(this->cache_path);
+	play_thread = std::thread(&mediadb::play_run, this);
+}
+
+mediadb::~mediadb()
+{
+	{
+		std::lock_guard<std::mutex> lck(play_mtx);
+		play_stop = true;
+	}
+	play_cv.notify_all();
+	play_thread.join();
+	if (scan_thread.joinable())
+		scan_thread.join();
 }
 
 void mediadb::init_db(sqlite3* db)
@@ -52,7 +77,7 @@ void mediadb::init_db(sqlite3* db)
 	int rc;
 	if ((rc = sqlite3_exec(db, "DELETE FROM SURF_DB_META", nullptr, nullptr, nullptr)) != SQLITE_OK)
 		throw std::runtime_error("could not truncate table SURF_DB_META: " + std::string(sqlite3_errstr(rc)));
-	if ((rc = sqlite3_exec(db, "INSERT INTO SURF_DB_META (VERSION) VALUES (1)", nullptr, nullptr, nullptr)) != SQLITE_OK)
+	if ((rc = sqlite3_exec(db, ("INSERT INTO SURF_DB_META (VERSION) VALUES (" + std::to_string(SURF_DB_VERSION) + ")").c_str(), nullptr, nullptr, nullptr)) != SQLITE_OK)
 		throw std::runtime_error("could not fill table SURF_DB_META: " + std::string(sqlite3_errstr(rc)));
 
 	if ((rc = sqlite3_exec(db,
@@ -81,7 +106,9 @@ void mediadb::init_db(sqlite3* db)
 		"DISC MEDIUMINT,"
 		"ARTISTSTR TEXT,"
 		"ALBUM TEXT NOT NULL REFERENCES ALBUMS(UUID),"
-		"LOCATION TEXT UNIQUE NOT NULL)", nullptr, nullptr, nullptr)) != SQLITE_OK)
+		"LOCATION TEXT UNIQUE NOT NULL,"
+		"MTIME BIGINT,"
+		"SIZE BIGINT)", nullptr, nullptr, nullptr)) != SQLITE_OK)
 		throw std::runtime_error("could not create tracks table: " + std::string(sqlite3_errstr(rc)));
 	if ((rc = sqlite3_exec(db,
 	"CREATE TABLE IF NOT EXISTS TRACKARTISTS ("
@@ -109,6 +136,39 @@ void mediadb::init_db(sqlite3* db)
 		"TRACK TEXT NOT NULL REFERENCES TRACKS(UUID),"
 		"UNIQUE(PLAYLIST, RANK))", nullptr, nullptr, nullptr)) != SQLITE_OK)
 		throw std::runtime_error("could not create playlist-tracks table: " + std::string(sqlite3_errstr(rc)));
+	init_plays_table(db);
+}
+
+void mediadb::init_plays_table(sqlite3* db)
+{
+	int rc;
+	if ((rc = sqlite3_exec(db,
+	"CREATE TABLE IF NOT EXISTS PLAYS ("
+		"TRACK TEXT PRIMARY KEY NOT NULL REFERENCES TRACKS(UUID),"
+		"COUNT UNSIGNED INT NOT NULL,"
+		"LAST BIGINT NOT NULL)", nullptr, nullptr, nullptr)) != SQLITE_OK)
+		throw std::runtime_error("could not create plays table: " + std::string(sqlite3_errstr(rc)));
+}
+
+void mediadb::upgrade_db(sqlite3* db, int from_version)
+{
+	int rc;
+	if (from_version < 2) {
+		// Tracks scanned before version 2 have no MTIME or SIZE and get probed once more.
+		if ((rc = sqlite3_exec(db, "ALTER TABLE TRACKS ADD COLUMN MTIME BIGINT", nullptr, nullptr, nullptr)) != SQLITE_OK ||
+			(rc = sqlite3_exec(db, "ALTER TABLE TRACKS ADD COLUMN SIZE BIGINT", nullptr, nullptr, nullptr)) != SQLITE_OK)
+			throw std::runtime_error("could not add file columns to tracks table: " + std::string(sqlite3_errstr(rc)));
+	}
+	if (from_version < 3)
+		init_plays_table(db);
+	if (from_version < 4) {
+		// Formats used to be decoder names; the float MPEG audio decoders are the ones that differ.
+		if ((rc = sqlite3_exec(db, "UPDATE TRACKS SET FORMAT = REPLACE(FORMAT, 'float', '') WHERE FORMAT IN ('mp1float', 'mp2float', 'mp3float')", nullptr, nullptr, nullptr)) != SQLITE_OK)
+			throw std::runtime_error("could not rename track formats: " + std::string(sqlite3_errstr(rc)));
+	}
+
+	if ((rc = sqlite3_exec(db, ("UPDATE SURF_DB_META SET VERSION = " + std::to_string(SURF_DB_VERSION)).c_str(), nullptr, nullptr, nullptr)) != SQLITE_OK)
+		throw std::runtime_error("could not update table SURF_DB_META: " + std::string(sqlite3_errstr(rc)));
 }
 
 void mediadb::init_prepped_inserts(sqlite3* db, sqlite3_stmt** stmt)
@@ -127,11 +187,11 @@ void mediadb::init_prepped_inserts(sqlite3* db, sqlite3_stmt** stmt)
 		throw std::runtime_error("could not prepare INSERT_ALBUMS SQL");
 	if ((rc = sqlite3_prepare_v3(db,
 		"INSERT INTO TRACKS "
-		"(UUID, FORMAT, BITRATE, DURATION, TITLE, TRACK, DISC, ARTISTSTR, ALBUM, LOCATION) "
-		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10) "
+		"(UUID, FORMAT, BITRATE, DURATION, TITLE, TRACK, DISC, ARTISTSTR, ALBUM, LOCATION, MTIME, SIZE) "
+		"VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12) "
 		"ON CONFLICT(UUID) DO UPDATE SET "
 			"FORMAT = ?2, BITRATE = ?3, DURATION = ?4, TITLE = ?5, TRACK = ?6,"
-			"DISC = ?7, ARTISTSTR = ?8, ALBUM = ?9, LOCATION = ?10 "
+			"DISC = ?7, ARTISTSTR = ?8, ALBUM = ?9, LOCATION = ?10, MTIME = ?11, SIZE = ?12 "
 		"WHERE UUID = ?1",
 		-1, SQLITE_PREPARE_PERSISTENT, stmt + INSERT_TRACKS, nullptr)) != SQLITE_OK)
 		throw std::runtime_error("could not prepare INSERT_TRACKS SQL");
@@ -145,69 +205,380 @@ void mediadb::init_prepped_inserts(sqlite3* db, sqlite3_stmt** stmt)
 		throw std::runtime_error("could not prepare INSERT_ALBUMARTISTS SQL");
 }
 
-void mediadb::scan_path(const fs::path& _path)
+static void commit_transaction(const db_connection& dbc, scan_stats& stats)
 {
-	db_connection dbc = dbconn();
-	fs::path root = fs::canonical(_path);
-	sqlite3_stmt* prep_stmt[PREP_STMT_MAX];
+	auto start = std::chrono::steady_clock::now();
+	while (sqlite3_exec(dbc.handle(), "END TRANSACTION", nullptr, nullptr, nullptr) == SQLITE_BUSY)
+		std::this_thread::yield();
+	stats.sqlite_time += std::chrono::steady_clock::now() - start;
+}
 
-	mod_times[root] = std::chrono::system_clock::now();
-	init_prepped_inserts(dbc.handle(), prep_stmt);
+void mediadb::load_known_files(const db_connection& dbc, const fs::path& root, scan_session& ss)
+{
+	sqlite3_stmt *stmt = nullptr;
+	std::string prefix = root.string();
+	int rc;
+
+	if ((rc = sqlite3_prepare_v2(dbc.handle(),
+		"SELECT LOCATION, MTIME, SIZE FROM TRACKS WHERE MTIME IS NOT NULL AND SUBSTR(CAST(LOCATION AS BLOB), 1, ?2) = ?1",
+		-1, &stmt, nullptr)) != SQLITE_OK)
+		throw std::runtime_error("could not prepare known file SQL");
+	sqlite3_bind_blob(stmt, 1, prefix.data(), prefix.length(), SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 2, prefix.length());
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW || rc == SQLITE_BUSY) {
+		if (rc == SQLITE_BUSY)
+			continue;
+		ss.known_files.emplace(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+			std::make_pair(sqlite3_column_int64(stmt, 1), sqlite3_column_int64(stmt, 2)));
+	}
+	sqlite3_finalize(stmt);
+}
+
+void mediadb::scan_root(const db_connection& dbc, const fs::path& path, scan_session& ss)
+{
+	fs::path root = fs::canonical(path);
+	size_t uncommitted = 0;
+
+	ss.stats.root = root.string();
+	publish_progress(ss);
+
+	touch_mod_time(root);
+	load_known_files(dbc, root, ss);
+	init_prepped_inserts(dbc.handle(), ss.stmt);
 	sqlite3_exec(dbc.handle(), "BEGIN TRANSACTION", nullptr, nullptr, nullptr);
 	if (fs::is_directory(root)) {
-		fs::directory_options walk_opts = fs::directory_options::follow_directory_symlink | fs::directory_options::skip_permission_denied;
-		for (auto& p : fs::recursive_directory_iterator(root, walk_opts)) {
-			if (p.is_regular_file()) {
-				std::string fname = p.path().filename().string();
-				if (fname.length() > 0 && fname[0] != '.' && fname != APP_NAME ".db")
-					scan_file(dbc, p.path(), prep_stmt);
+		// Walkers stat whole directories in parallel; probing and SQLite stay on this thread.
+		dir_walker walker(root, SCAN_WALK_THREADS, SCAN_WALK_QUEUE);
+		walk_entry entry;
+		while (walker.next(entry)) {
+			std::string fname = entry.path.filename().string();
+			if (fname.length() > 0 && fname[0] != '.' && fname != APP_NAME ".db") {
+				ss.stats.files_discovered++;
+				scan_file(dbc, entry, ss);
+				publish_progress(ss);
+			}
+
+			// Commit in batches so the server can read the library while it is being scanned.
+			if (ss.stats.files_probed - uncommitted >= SCAN_COMMIT_INTERVAL) {
+				commit_transaction(dbc, ss.stats);
+				sqlite3_exec(dbc.handle(), "BEGIN TRANSACTION", nullptr, nullptr, nullptr);
+				uncommitted = ss.stats.files_probed;
+				touch_mod_time(root);
 			}
 		}
 	} else {
-		scan_file(dbc, root, prep_stmt);
+		walk_entry entry;
+		if (stat_entry(root, entry)) {
+			ss.stats.files_discovered++;
+			scan_file(dbc, entry, ss);
+		}
+	}
+
+	commit_transaction(dbc, ss.stats);
+	touch_mod_time(root);
+}
+
+/* Never throws: a scan that fails keeps the batches it committed, reports why in scan_stats::error
+ * and, like one that finishes, stops running, so the next can start. */
+scan_stats mediadb::scan_path(const fs::path& path)
+{
+	scan_session ss;
+	ss.stats.running = true;
+	ss.stats.root = path.string();
+	{
+		std::lock_guard<std::mutex> lck(scan_mtx);
+		scan_started = std::chrono::steady_clock::now();
 	}
+	publish_progress(ss);
 
-	sqlite3_exec(dbc.handle(), "END TRANSACTION", nullptr, nullptr, nullptr);
-	for (int i = 0; i < PREP_STMT_MAX; i++)
-		sqlite3_finalize(prep_stmt[i]);
+	try {
+		db_connection dbc = dbconn();
+		try {
+			scan_root(dbc, path, ss);
+		} catch (...) {
+			sqlite3_exec(dbc.handle(), "ROLLBACK TRANSACTION", nullptr, nullptr, nullptr);
+			for (int i = 0; i < PREP_STMT_MAX; i++)
+				sqlite3_finalize(ss.stmt[i]);
+			throw;
+		}
+		for (int i = 0; i < PREP_STMT_MAX; i++)
+			sqlite3_finalize(ss.stmt[i]);
+	} catch (const std::exception& e) {
+		std::cerr << "scan fail " << ss.stats.root << " : " << e.what() << std::endl;
+		ss.stats.error = e.what();
+	}
+
+	ss.stats.running = false;
+	publish_progress(ss);
+	return scan_status();
+}
+
+bool mediadb::start_scan(const fs::path& path)
+{
+	std::lock_guard<std::mutex> lck(scan_mtx);
+	if (progress.running)
+		return false;
+
+	// Claim the scanner before the thread starts, so a second caller sees it busy.
+	progress.running = true;
+	if (scan_thread.joinable())
+		scan_thread.join();
+	scan_thread = std::thread(&mediadb::scan_path, this, path);
+	return true;
+}
+
+void mediadb::publish_progress(const scan_session& ss)
+{
+	std::lock_guard<std::mutex> lck(scan_mtx);
+	progress = ss.stats;
+	progress.elapsed = std::chrono::steady_clock::now() - scan_started;
+}
+
+scan_stats mediadb::scan_status() const
+{
+	std::lock_guard<std::mutex> lck(scan_mtx);
+	scan_stats st = progress;
+	if (st.running)
+		st.elapsed = std::chrono::steady_clock::now() - scan_started;
+	return st;
+}
+
+void mediadb::touch_mod_time(const fs::path& root)
+{
+	std::lock_guard<std::mutex> lck(mod_mtx);
+	mod_times[root] = std::chrono::system_clock::now();
 }
 
-std::optional<std::string> mediadb::get_track_path(const std::string& track_uuid)
+std::optional<track_source> mediadb::get_track(const std::string& track_uuid)
 {
 	db_connection dbc = dbconn();
 	sqlite3_stmt *stmt = nullptr;
-	std::optional<std::string> track_path;
+	std::optional<track_source> track;
 	int rc;
 
-	if ((rc = sqlite3_prepare_v2(dbc.handle(), "SELECT LOCATION FROM TRACKS WHERE UUID = ? LIMIT 1", -1, &stmt, nullptr)) != SQLITE_OK)
+	if ((rc = sqlite3_prepare_v2(dbc.handle(), "SELECT LOCATION, FORMAT, BITRATE, DURATION FROM TRACKS WHERE UUID = ? LIMIT 1", -1, &stmt, nullptr)) != SQLITE_OK)
 		throw std::runtime_error("could not prepare track retrieval SQL");
 	sqlite3_bind_text(stmt, 1, track_uuid.c_str(), -1, SQLITE_STATIC);
 	do { rc = sqlite3_step(stmt); } while (rc == SQLITE_BUSY);
 	if (rc == SQLITE_MISUSE)
 		throw std::runtime_error("sqlite misuse at " __FILE__ "@" + std::to_string(__LINE__) + ".");
 	else if (rc == SQLITE_DONE)
-		track_path = std::nullopt;
+		track = std::nullopt;
 	else if (rc == SQLITE_ROW)
-		track_path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+		track = track_source{
+			reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+			sqlite3_column_type(stmt, 1) == SQLITE_NULL ? "" : reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+			sqlite3_column_int64(stmt, 2),
+			sqlite3_column_int64(stmt, 3)
+		};
 	else
 		throw std::runtime_error("could not step through track retrieval SQL: " + std::string(sqlite3_errmsg(dbc.handle())));
 	sqlite3_finalize(stmt);
-	return track_path;
+	return track;
 }
 
-std::pair<std::string, bool> mediadb::get_cached_transcode(const std::string& track_uuid, int quality)
+/* The tracks that follow one, in playlist order if plist is set and otherwise in album order:
+ * by disc and track number, with untagged numbers first. */
+std::vector<std::string> mediadb::next_tracks(const std::string& track_uuid, const std::string& plist_uuid, size_t n)
 {
-	std::stringstream ss;
-	ss << track_uuid << '.' << quality << ".mp3";
-	fs::path cache_loc = fs::absolute(cache_path / ss.str());
-	bool is_ok = fs::exists(cache_loc) && fs::file_size(cache_loc) > 0;
+	static const char *album_sql =
+		"SELECT T.UUID FROM TRACKS T, TRACKS C WHERE C.UUID = ?1 AND T.ALBUM = C.ALBUM "
+		"AND (IFNULL(T.DISC, 0), IFNULL(T.TRACK, 0), T.UUID) > (IFNULL(C.DISC, 0), IFNULL(C.TRACK, 0), C.UUID) "
+		"ORDER BY IFNULL(T.DISC, 0), IFNULL(T.TRACK, 0), T.UUID LIMIT ?3";
+	static const char *plist_sql =
+		"SELECT TRACK FROM PLAYLISTTRACKS WHERE PLAYLIST = ?2 "
+		"AND RANK > (SELECT MIN(RANK) FROM PLAYLISTTRACKS WHERE PLAYLIST = ?2 AND TRACK = ?1) "
+		"ORDER BY RANK LIMIT ?3";
+	db_connection dbc = dbconn();
+	sqlite3_stmt *stmt = nullptr;
+	std::vector<std::string> next;
+	int rc;
+
+	if ((rc = sqlite3_prepare_v2(dbc.handle(), plist_uuid.empty() ? album_sql : plist_sql, -1, &stmt, nullptr)) != SQLITE_OK)
+		throw std::runtime_error("could not prepare next track SQL");
+	sqlite3_bind_text(stmt, 1, track_uuid.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, plist_uuid.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 3, n);
+	while ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+		if (rc == SQLITE_BUSY) {
+			continue;
+		} else if (rc == SQLITE_MISUSE) {
+			throw std::runtime_error("sqlite misuse at " __FILE__ "@" + std::to_string(__LINE__) + ".");
+		} else if (rc != SQLITE_ROW) {
+			throw std::runtime_error("could not step through next track SQL: " + std::string(sqlite3_errmsg(dbc.handle())));
+		}
+		next.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+	}
+	sqlite3_finalize(stmt);
+	return next;
+}
+
+// Counts a track being started from the top.
+// Only counted here; play_thread writes the count out, so starting a stream never waits on SQLite.
+void mediadb::record_play(const std::string& track_uuid)
+{
+	const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	std::lock_guard<std::mutex> lck(play_mtx);
+	auto& play = pending_plays[track_uuid];
+	play.first++;
+	play.second = now;
+}
+
+// Flushes every PLAY_FLUSH_INTERVAL, and once more on the way out.
+void mediadb::play_run()
+{
+	std::unique_lock<std::mutex> lck(play_mtx);
+	while (!play_stop) {
+		play_cv.wait_for(lck, PLAY_FLUSH_INTERVAL, [this] { return play_stop; });
+		lck.unlock();
+		try {
+			flush_plays();
+		} catch (const std::exception& e) {
+			std::cerr << "plays fail_flush " << e.what() << std::endl;
+		}
+		lck.lock();
+	}
+}
+
+/* Writes the plays counted so far in one transaction. If the database stays busy past the
+ * connection's timeout, as it may while a scan holds a batch open, they wait for the next flush. */
+bool mediadb::flush_plays()
+{
+	decltype(pending_plays) plays;
+	{
+		std::lock_guard<std::mutex> lck(play_mtx);
+		plays.swap(pending_plays);
+	}
+	if (plays.empty())
+		return true;
+
+	db_connection dbc = dbconn();
+	sqlite3_stmt *stmt = nullptr;
+	int rc;
+	if ((rc = sqlite3_exec(dbc.handle(), "BEGIN IMMEDIATE TRANSACTION", nullptr, nullptr, nullptr)) == SQLITE_OK &&
+		(rc = sqlite3_prepare_v2(dbc.handle(),
+		"INSERT INTO PLAYS (TRACK, COUNT, LAST) VALUES (?1, ?2, ?3) "
+		"ON CONFLICT(TRACK) DO UPDATE SET COUNT = COUNT + ?2, LAST = MAX(LAST, ?3)",
+		-1, &stmt, nullptr)) == SQLITE_OK) {
+		for (const auto& [uuid, play] : plays) {
+			sqlite3_bind_text(stmt, 1, uuid.c_str(), -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 2, play.first);
+			sqlite3_bind_int64(stmt, 3, play.second);
+			if ((rc = sqlite3_step(stmt)) != SQLITE_DONE)
+				break;
+			sqlite3_reset(stmt);
+		}
+		if (rc == SQLITE_DONE)
+			rc = sqlite3_exec(dbc.handle(), "COMMIT TRANSACTION", nullptr, nullptr, nullptr);
+	}
+	sqlite3_finalize(stmt);
+	if (rc == SQLITE_OK)
+		return true;
 
-	cache.put(cache_loc);
+	sqlite3_exec(dbc.handle(), "ROLLBACK TRANSACTION", nullptr, nullptr, nullptr);
+	if (rc != SQLITE_BUSY) {
+		std::cerr << "plays fail_flush " << sqlite3_errstr(rc) << std::endl;
+		return false;
+	}
+	std::lock_guard<std::mutex> lck(play_mtx);
+	for (const auto& [uuid, play] : plays) {
+		auto& pending = pending_plays[uuid];
+		pending.first += play.first;
+		pending.second = std::max(pending.second, play.second);
+	}
+	return false;
+}
+
+/* What to transcode ahead of time, most wanted first and without repeats: the most played tracks,
+ * then the albums whose files are newest, then the playlists with these names in their order. */
+std::vector<std::string> mediadb::warmup_tracks(size_t most_played, size_t newest_albums, const std::vector<std::string>& playlists)
+{
+	// Whatever is still queued counts too; if the database is busy, the plan goes without it.
+	flush_plays();
+	db_connection dbc = dbconn();
+	std::vector<std::string> tracks;
+	std::unordered_set<std::string> seen;
+
+	auto collect = [&](const char *sql, const std::function<void(sqlite3_stmt*)>& bind) {
+		sqlite3_stmt *stmt = nullptr;
+		int rc;
+		if ((rc = sqlite3_prepare_v2(dbc.handle(), sql, -1, &stmt, nullptr)) != SQLITE_OK)
+			throw std::runtime_error("could not prepare warm-up SQL");
+		bind(stmt);
+		while ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+			if (rc == SQLITE_BUSY) {
+				continue;
+			} else if (rc == SQLITE_MISUSE) {
+				throw std::runtime_error("sqlite misuse at " __FILE__ "@" + std::to_string(__LINE__) + ".");
+			} else if (rc != SQLITE_ROW) {
+				throw std::runtime_error("could not step through warm-up SQL: " + std::string(sqlite3_errmsg(dbc.handle())));
+			}
+			std::string uuid = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+			if (seen.insert(uuid).second)
+				tracks.push_back(std::move(uuid));
+		}
+		sqlite3_finalize(stmt);
+	};
+
+	collect("SELECT P.TRACK FROM PLAYS P JOIN TRACKS T ON T.UUID = P.TRACK ORDER BY P.COUNT DESC, P.LAST DESC LIMIT ?", [&](sqlite3_stmt *stmt) {
+		sqlite3_bind_int64(stmt, 1, most_played);
+	});
+	collect("SELECT T.UUID FROM TRACKS T JOIN "
+		"(SELECT ALBUM, MAX(IFNULL(MTIME, 0)) AS NEWEST FROM TRACKS GROUP BY ALBUM ORDER BY NEWEST DESC LIMIT ?) A ON T.ALBUM = A.ALBUM "
+		"ORDER BY A.NEWEST DESC, T.ALBUM, IFNULL(T.DISC, 0), IFNULL(T.TRACK, 0), T.UUID", [&](sqlite3_stmt *stmt) {
+		sqlite3_bind_int64(stmt, 1, newest_albums);
+	});
+	for (const auto& name : playlists) {
+		collect("SELECT PT.TRACK FROM PLAYLISTTRACKS PT JOIN PLAYLISTS P ON P.UUID = PT.PLAYLIST WHERE P.NAME = ? ORDER BY PT.PLAYLIST, PT.RANK", [&](sqlite3_stmt *stmt) {
+			sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
+		});
+	}
+	return tracks;
+}
+
+std::pair<std::string, bool> mediadb::get_cached_transcode(const std::string& key)
+{
+	fs::path cache_loc = fs::absolute(cache_path / key);
+	std::error_code ec;
+	uintmax_t sz = fs::file_size(cache_loc, ec);
+	bool is_ok = !ec && sz > 0;
+
+	if (is_ok) {
+		if (!cache.touch(cache_loc))
+			cache.put(cache_loc, sz);
+		// The modification time doubles as the last use, so recency survives a restart.
+		fs::last_write_time(cache_loc, fs::file_time_type::clock::now(), ec);
+	} else {
+		cache.miss(cache_loc);
+	}
 	return { cache_loc.string(), is_ok };
 }
 
+// Unlike get_cached_transcode, this is not a use as far as the cache policy is concerned.
+bool mediadb::has_cached_transcode(const std::string& key)
+{
+	std::error_code ec;
+	uintmax_t sz = fs::file_size(cache_path / key, ec);
+	return !ec && sz > 0;
+}
+
+// Where the transcode is or will be cached, for the server's own use; not a use either.
+std::string mediadb::cached_transcode_path(const std::string& key)
+{
+	return fs::absolute(cache_path / key).string();
+}
+
+void mediadb::add_cached_transcode(const std::string& path, uint64_t bytes)
+{
+	cache.put(fs::absolute(path), bytes);
+}
+
 std::chrono::system_clock::time_point mediadb::latest_mod_time() const
 {
+	std::lock_guard<std::mutex> lck(mod_mtx);
+	if (mod_times.empty())
+		return std::chrono::system_clock::now();
+
 	auto it = mod_times.begin();
 	std::chrono::system_clock::time_point m = it->second;
 	++it;
@@ -0,0 +1,126 @@
+#include "mediaio.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+constexpr size_t MIN_READ_AHEAD = 64 << 10;
+
+static std::atomic<size_t> read_ahead{MEDIA_READ_AHEAD_DEFAULT};
+
+struct media_file {
+	int fd;
+	size_t window;
+	int64_t pos = 0;
+	int64_t advised = 0; // how far the kernel has been asked to read ahead
+};
+
+void set_media_read_ahead(size_t bytes)
+{
+	read_ahead = std::max(bytes, MIN_READ_AHEAD);
+}
+
+// Keeps the kernel reading one to two windows past pos in the background.
+static void advise(media_file *f)
+{
+#ifdef POSIX_FADV_WILLNEED
+	const int64_t window = f->window;
+	if (f->pos + window <= f->advised)
+		return;
+	const int64_t from = std::max(f->pos, f->advised);
+	posix_fadvise(f->fd, from, f->pos + 2 * window - from, POSIX_FADV_WILLNEED);
+	f->advised = f->pos + 2 * window;
+#endif
+}
+
+static int mio_read(void *opaque, uint8_t *buf, int buf_size)
+{
+	media_file *f = static_cast<media_file*>(opaque);
+	ssize_t r;
+	while ((r = ::read(f->fd, buf, buf_size)) < 0 && errno == EINTR);
+	if (r < 0)
+		return AVERROR(errno);
+	if (r == 0)
+		return AVERROR_EOF;
+	f->pos += r;
+	advise(f);
+	return r;
+}
+
+static int64_t mio_seek(void *opaque, int64_t offset, int whence)
+{
+	media_file *f = static_cast<media_file*>(opaque);
+	if (whence & AVSEEK_SIZE) {
+		struct stat st;
+		return fstat(f->fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+	}
+
+	off_t r = lseek(f->fd, offset, whence & ~AVSEEK_FORCE);
+	if (r < 0)
+		return AVERROR(errno);
+	// Whatever was read ahead elsewhere in the file is of no use now.
+	if (r < f->pos || r > f->advised)
+		f->advised = r;
+	f->pos = r;
+	return r;
+}
+
+// The I/O a custom context was given, which avformat_close_input leaves alone.
+static void free_io(AVIOContext **pb)
+{
+	if (*pb == nullptr)
+		return;
+	media_file *f = static_cast<media_file*>((*pb)->opaque);
+	close(f->fd);
+	delete f;
+	av_freep(&(*pb)->buffer);
+	avio_context_free(pb);
+}
+
+int open_media_input(AVFormatContext **ctx, const char *path)
+{
+	const size_t buf_size = read_ahead;
+	AVIOContext *pb = nullptr;
+	unsigned char *iobuf = nullptr;
+	media_file *f;
+	int err, fd;
+
+	if ((fd = ::open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return AVERROR(errno);
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	f = new media_file{fd, buf_size};
+	advise(f);
+
+	if ((iobuf = (unsigned char *) av_malloc(buf_size)) == nullptr || (pb = avio_alloc_context(iobuf, buf_size, 0, f, mio_read, nullptr, mio_seek)) == nullptr) {
+		av_free(iobuf);
+		close(fd);
+		delete f;
+		return AVERROR(ENOMEM);
+	}
+	if ((*ctx = avformat_alloc_context()) == nullptr) {
+		free_io(&pb);
+		return AVERROR(ENOMEM);
+	}
+	(*ctx)->pb = pb;
+	(*ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	// On failure this frees the context, but not pb.
+	if ((err = avformat_open_input(ctx, path, nullptr, nullptr)) < 0) {
+		*ctx = nullptr;
+		free_io(&pb);
+		return err;
+	}
+	return 0;
+}
+
+void close_media_input(AVFormatContext **ctx)
+{
+	if (*ctx == nullptr)
+		return;
+	AVIOContext *pb = (*ctx)->pb;
+	avformat_close_input(ctx);
+	free_io(&pb);
+}
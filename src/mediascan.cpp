@@ -1,6 +1,8 @@
 #include "config.h"
 #include "ffmpeg.h"
 #include "mediadb.h"
+#include "mediaio.h"
+#include "tagread.h"
 #include <algorithm>
 #include <cstdarg>
 #include <cstring>
@@ -93,36 +95,52 @@ static bool av_dict_multiget(AVDictionary *dict, std::initializer_list<std::stri
 int audio_tag::populate(const fs::path& p)
 {
 	AVFormatContext* ctx = nullptr;
-	AVDictionary* dict = nullptr;
+	AVDictionary* dict = nullptr, *native_dict = nullptr;
 	AVDictionaryEntry* ent = nullptr;
 	AVCodec *codec;
+	native_stream_info ninfo;
 	std::string raw_artist_names, tagval;
+	int64_t bit_rate, duration_ms;
 	int err = 0;
 
-	if ((err = avformat_open_input(&ctx, p.c_str(), nullptr, nullptr)) < 0)
-		return err;
-	if ((err = avformat_find_stream_info(ctx, nullptr)) < 0)
-		return err;
+	if (read_native_tags(p, &native_dict, &ninfo) == 0) {
+		// Header-only read of FLAC, MP3 and MP4 files; no packets are decoded.
+		if ((codec = avcodec_find_decoder(ninfo.codec_id)) == nullptr) {
+			err = AVERROR_DECODER_NOT_FOUND;
+			goto cleanup;
+		}
+		dict = native_dict;
+		bit_rate = ninfo.bit_rate;
+		duration_ms = ninfo.duration_ms;
+	} else {
+		if ((err = open_media_input(&ctx, p.c_str())) < 0)
+			return err;
+		if ((err = avformat_find_stream_info(ctx, nullptr)) < 0)
+			goto cleanup;
 
-	int first_audio_stream = -1;
-	for (size_t i = 0; i < ctx->nb_streams && first_audio_stream == -1; i++) {
-		if (ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-			first_audio_stream = i;
-	}
-	if (first_audio_stream == -1) {
-		err = AVERROR_STREAM_NOT_FOUND;
-		goto cleanup;
-	}
-	if ((codec = avcodec_find_decoder(ctx->streams[first_audio_stream]->codecpar->codec_id)) == nullptr) {
-		err = AVERROR_DECODER_NOT_FOUND;
-		goto cleanup;
-	}
+		int first_audio_stream = -1;
+		for (size_t i = 0; i < ctx->nb_streams && first_audio_stream == -1; i++) {
+			if (ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+				first_audio_stream = i;
+		}
+		if (first_audio_stream == -1) {
+			err = AVERROR_STREAM_NOT_FOUND;
+			goto cleanup;
+		}
+		if ((codec = avcodec_find_decoder(ctx->streams[first_audio_stream]->codecpar->codec_id)) == nullptr) {
+			err = AVERROR_DECODER_NOT_FOUND;
+			goto cleanup;
+		}
 
-	if (av_dict_count(ctx->metadata) == 0)
-		// Tags are present in the stream metadata.
-		dict = ctx->streams[first_audio_stream]->metadata;
-	else
-		dict = ctx->metadata;
+		if (av_dict_count(ctx->metadata) == 0)
+			// Tags are present in the stream metadata.
+			dict = ctx->streams[first_audio_stream]->metadata;
+		else
+			dict = ctx->metadata;
+		// The audio's own rate where the demuxer knows it, so tags and cover art do not count.
+		bit_rate = ctx->streams[first_audio_stream]->codecpar->bit_rate > 0 ? ctx->streams[first_audio_stream]->codecpar->bit_rate : ctx->bit_rate;
+		duration_ms = 1000 * ctx->duration / AV_TIME_BASE;
+	}
 
 	if (av_dict_multiget(dict, {"TITLE"}, stag[sval::TITLE]) == false ||
 		av_dict_multiget(dict, {"ALBUM"}, stag[sval::ALBUM_TITLE]) == false ||
@@ -142,9 +160,11 @@ int audio_tag::populate(const fs::path& p)
 		highwayhash::HHResult128 res;
 		highwayhash::HHStateT<HH_TARGET> state(hashkey);
 
+		auto hash_start = std::chrono::steady_clock::now();
 		std::ifstream fin(p, std::ifstream::binary);
 		while (fin.read(buffer, 16384)) {
 			std::streamsize sz = fin.gcount();
+			bytes_hashed += sz;
 			const size_t remainder = sz & (sizeof(highwayhash::HHPacket) - 1),
 				truncated = sz & ~(sizeof(highwayhash::HHPacket) - 1);
 			for (size_t off = 0; off < truncated; off += sizeof(highwayhash::HHPacket)) {
@@ -156,6 +176,7 @@ int audio_tag::populate(const fs::path& p)
 		state.Finalize(&res);
 		snprintf(res_str, 33, "%016" PRIx64 "%016" PRIx64, res[1], res[0]);
 		stag[sval::TRACK_UUID] = res_str;
+		hash_time = std::chrono::steady_clock::now() - hash_start;
 	}
 
 	if (av_dict_multiget(dict, {"MUSICBRAINZ_RELEASEGROUPID",
@@ -242,21 +263,68 @@ int audio_tag::populate(const fs::path& p)
 	} else
 		stag[sval::TRACK_NUM] = "0";
 
-	stag[sval::FORMAT] = codec->name;
-	stag[sval::BITRATE] = std::to_string(ctx->bit_rate);
-	stag[sval::DURATION] = std::to_string(1000 * ctx->duration / AV_TIME_BASE);
+	// The codec's name rather than the decoder's, which for MP3 is mp3float.
+	stag[sval::FORMAT] = avcodec_get_name(codec->id);
+	stag[sval::BITRATE] = std::to_string(bit_rate);
+	stag[sval::DURATION] = std::to_string(duration_ms);
 
 cleanup:
-	avformat_close_input(&ctx);
+	av_dict_free(&native_dict);
+	close_media_input(&ctx);
 	return err;
 }
 
-void mediadb::scan_file(const db_connection& dbc, const fs::path& path, sqlite3_stmt** stmt)
+// UUIDs are 32 hex digits once dashes are stripped; anything else is hashed down to the same width.
+static uuid128 intern_key(const std::string& uuid)
+{
+	uuid128 key = {0, 0};
+	if (uuid.length() == 32 && std::all_of(uuid.begin(), uuid.end(), ::isxdigit)) {
+		key.hi = std::stoull(uuid.substr(0, 16), nullptr, 16);
+		key.lo = std::stoull(uuid.substr(16), nullptr, 16);
+	} else {
+		highwayhash::HHResult128 res;
+		highwayhash::HHStateT<HH_TARGET> state(hashkey);
+		highwayhash::HighwayHashT(&state, uuid.data(), uuid.length(), &res);
+		key.hi = res[1];
+		key.lo = res[0];
+	}
+	return key;
+}
+
+static int step_timed(sqlite3_stmt* stmt, scan_stats& stats)
+{
+	auto start = std::chrono::steady_clock::now();
+	int rc;
+	do { rc = sqlite3_step(stmt); } while (rc == SQLITE_BUSY);
+	stats.sqlite_time += std::chrono::steady_clock::now() - start;
+	return rc;
+}
+
+void mediadb::scan_file(const db_connection& dbc, const walk_entry& entry, scan_session& ss)
 {
 	int rc;
 	audio_tag atag;
-	if ((rc = atag.populate(path)) != 0) {
+	sqlite3_stmt** stmt = ss.stmt;
+	const fs::path& path = entry.path;
+
+	auto known = ss.known_files.find(path.string());
+	if (known != ss.known_files.end() && known->second == std::make_pair(entry.mtime, entry.size)) {
+		ss.stats.files_unchanged++;
+		return;
+	}
+
+	auto probe_start = std::chrono::steady_clock::now();
+	rc = atag.populate(path);
+	ss.stats.bytes_hashed += atag.bytes_hashed;
+	ss.stats.hash_time += atag.hash_time;
+	ss.stats.probe_time += std::chrono::steady_clock::now() - probe_start - atag.hash_time;
+	if (rc == AVERROR_INVALIDDATA || rc == AVERROR_STREAM_NOT_FOUND || rc == AVERROR_DECODER_NOT_FOUND) {
+		// Not something we can play: cover art, cue sheets, logs.
+		ss.stats.files_skipped++;
+		return;
+	} else if (rc != 0) {
 		std::cerr << "scan skip populate " << path << " : " << av_err2str(rc) << std::endl;
+		ss.stats.files_failed++;
 		return;
 	}
 
@@ -264,24 +332,31 @@ void mediadb::scan_file(const db_connection& dbc, const fs::path& path, sqlite3_
 		std::cerr << "scan skip artist_uuid_mismatch " << path << " : "
 			<< atag.ltag[audio_tag::lval::ARTIST_UUIDS].size() << " UUIDs, "
 			<< atag.ltag[audio_tag::lval::ARTIST_NAMES].size() << " names." << std::endl;
+		ss.stats.files_failed++;
 		return;
 	}
 	if (atag.ltag[audio_tag::lval::ALBUMARTIST_NAMES].size() != atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS].size()) {
 		std::cerr << "scan skip album_artist_uuid_mismatch " << path << " : "
-			<< atag.ltag[audio_tag::lval::ARTIST_UUIDS].size() << " UUIDs, "
-			<< atag.ltag[audio_tag::lval::ARTIST_NAMES].size() << " names." << std::endl;
+			<< atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS].size() << " UUIDs, "
+			<< atag.ltag[audio_tag::lval::ALBUMARTIST_NAMES].size() << " names." << std::endl;
+		ss.stats.files_failed++;
 		return;
 	}
+	ss.stats.files_probed++;
 
-	// Insert artists.
+	// Insert track artists and album artists, once per scan each.
 	for (int h = 0; h < 2; h++) {
-		for (auto i = 0; i < atag.ltag[audio_tag::lval::ARTIST_NAMES + h].size(); i++) {
-			sqlite3_bind_text(stmt[INSERT_ARTISTS], 1, atag.ltag[audio_tag::lval::ARTIST_UUIDS][i].c_str(), -1, SQLITE_STATIC);
-			sqlite3_bind_text(stmt[INSERT_ARTISTS], 2, atag.ltag[audio_tag::lval::ARTIST_NAMES][i].c_str(), -1, SQLITE_STATIC);
-			do { rc = sqlite3_step(stmt[INSERT_ARTISTS]); } while (rc == SQLITE_BUSY);
+		const auto& names = atag.ltag[audio_tag::lval::ARTIST_NAMES + 2 * h];
+		const auto& uuids = atag.ltag[audio_tag::lval::ARTIST_UUIDS + 2 * h];
+		for (size_t i = 0; i < uuids.size(); i++) {
+			if (ss.artists.insert(intern_key(uuids[i])).second == false)
+				continue;
+			sqlite3_bind_text(stmt[INSERT_ARTISTS], 1, uuids[i].c_str(), -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt[INSERT_ARTISTS], 2, names[i].c_str(), -1, SQLITE_STATIC);
+			rc = step_timed(stmt[INSERT_ARTISTS], ss.stats);
 			if (rc != SQLITE_DONE) {
-				std::cerr << "scan fail INSERT_ARTISTS " << atag.ltag[audio_tag::lval::ARTIST_UUIDS][i]
-					<< " : \"" << atag.ltag[audio_tag::lval::ARTIST_NAMES][i] << "\" "
+				std::cerr << "scan fail INSERT_ARTISTS " << uuids[i]
+					<< " : \"" << names[i] << "\" "
 					<< sqlite3_errmsg(dbc.handle()) << std::endl;
 				abort();
 			}
@@ -289,28 +364,45 @@ void mediadb::scan_file(const db_connection& dbc, const fs::path& path, sqlite3_
 		}
 	}
 
-	// Insert album.
-	sqlite3_bind_text(stmt[INSERT_ALBUMS], 1, atag.stag[audio_tag::sval::ALBUM_UUID].c_str(), -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt[INSERT_ALBUMS], 2, atag.stag[audio_tag::sval::ALBUM_TITLE].c_str(), -1, SQLITE_STATIC);
-	sqlite3_bind_text(stmt[INSERT_ALBUMS], 3, atag.stag[audio_tag::sval::ALBUMARTISTSTR].c_str(), -1, SQLITE_STATIC);
-	sqlite3_bind_int(stmt[INSERT_ALBUMS], 5, atoi(atag.stag[audio_tag::sval::DATE_YEAR].c_str()));
-	sqlite3_bind_int(stmt[INSERT_ALBUMS], 6, atoi(atag.stag[audio_tag::sval::DATE_MONTH].c_str()));
-	sqlite3_bind_int(stmt[INSERT_ALBUMS], 7, atoi(atag.stag[audio_tag::sval::DATE_DAY].c_str()));
-
-	auto coverart = get_best_coverart(path);
-	if (coverart.has_value())
-		sqlite3_bind_text(stmt[INSERT_ALBUMS], 4, coverart->c_str(), -1, SQLITE_STATIC);
-	else
-		sqlite3_bind_null(stmt[INSERT_ALBUMS], 4);
+	// Insert album and album artists, the first time this scan sees the album.
+	if (ss.albums.insert(intern_key(atag.stag[audio_tag::sval::ALBUM_UUID])).second) {
+		sqlite3_bind_text(stmt[INSERT_ALBUMS], 1, atag.stag[audio_tag::sval::ALBUM_UUID].c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt[INSERT_ALBUMS], 2, atag.stag[audio_tag::sval::ALBUM_TITLE].c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt[INSERT_ALBUMS], 3, atag.stag[audio_tag::sval::ALBUMARTISTSTR].c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt[INSERT_ALBUMS], 5, atoi(atag.stag[audio_tag::sval::DATE_YEAR].c_str()));
+		sqlite3_bind_int(stmt[INSERT_ALBUMS], 6, atoi(atag.stag[audio_tag::sval::DATE_MONTH].c_str()));
+		sqlite3_bind_int(stmt[INSERT_ALBUMS], 7, atoi(atag.stag[audio_tag::sval::DATE_DAY].c_str()));
 
-	do { rc = sqlite3_step(stmt[INSERT_ALBUMS]); } while (rc == SQLITE_BUSY);
-	if (rc != SQLITE_DONE) {
-		std::cerr << "scan fail INSERT_ALBUMS " << atag.stag[audio_tag::sval::ALBUM_UUID]
-			<< " : \"" << atag.stag[audio_tag::sval::ALBUM_TITLE] << "\" "
-			<< sqlite3_errmsg(dbc.handle()) << std::endl;
-		abort();
+		auto coverart = get_best_coverart(path);
+		if (coverart.has_value())
+			sqlite3_bind_text(stmt[INSERT_ALBUMS], 4, coverart->c_str(), -1, SQLITE_STATIC);
+		else
+			sqlite3_bind_null(stmt[INSERT_ALBUMS], 4);
+
+		rc = step_timed(stmt[INSERT_ALBUMS], ss.stats);
+		if (rc != SQLITE_DONE) {
+			std::cerr << "scan fail INSERT_ALBUMS " << atag.stag[audio_tag::sval::ALBUM_UUID]
+				<< " : \"" << atag.stag[audio_tag::sval::ALBUM_TITLE] << "\" "
+				<< sqlite3_errmsg(dbc.handle()) << std::endl;
+			abort();
+		}
+		sqlite3_reset(stmt[INSERT_ALBUMS]);
+
+		for (size_t i = 0; i < atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS].size(); i++) {
+			sqlite3_bind_text(stmt[INSERT_ALBUMARTISTS], 1, atag.stag[audio_tag::sval::ALBUM_UUID].c_str(), -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt[INSERT_ALBUMARTISTS], 2, atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS][i].c_str(), -1, SQLITE_STATIC);
+			sqlite3_bind_int(stmt[INSERT_ALBUMARTISTS], 3, i + 1);
+			rc = step_timed(stmt[INSERT_ALBUMARTISTS], ss.stats);
+			if (rc != SQLITE_DONE) {
+				std::cerr << "scan fail INSERT_ALBUMARTISTS "
+					<< atag.stag[audio_tag::sval::ALBUM_UUID] << " " << atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS][i]
+					<< " : \"" << atag.stag[audio_tag::sval::ALBUM_TITLE] << "\" \"" << atag.ltag[audio_tag::lval::ALBUMARTIST_NAMES][i] << "\" "
+					<< sqlite3_errmsg(dbc.handle()) << std::endl;
+				abort();
+			}
+			sqlite3_reset(stmt[INSERT_ALBUMARTISTS]);
+		}
 	}
-	sqlite3_reset(stmt[INSERT_ALBUMS]);
 
 	// Insert track.
 	sqlite3_bind_text(stmt[INSERT_TRACKS], 1, atag.stag[audio_tag::sval::TRACK_UUID].c_str(), -1, SQLITE_STATIC);
@@ -323,7 +415,9 @@ void mediadb::scan_file(const db_connection& dbc, const fs::path& path, sqlite3_
 	sqlite3_bind_text(stmt[INSERT_TRACKS], 8, atag.stag[audio_tag::sval::ARTISTSTR].c_str(), -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt[INSERT_TRACKS], 9, atag.stag[audio_tag::sval::ALBUM_UUID].c_str(), -1, SQLITE_STATIC);
 	sqlite3_bind_text(stmt[INSERT_TRACKS], 10, path.c_str(), -1, SQLITE_STATIC);
-	do { rc = sqlite3_step(stmt[INSERT_TRACKS]); } while (rc == SQLITE_BUSY);
+	sqlite3_bind_int64(stmt[INSERT_TRACKS], 11, entry.mtime);
+	sqlite3_bind_int64(stmt[INSERT_TRACKS], 12, entry.size);
+	rc = step_timed(stmt[INSERT_TRACKS], ss.stats);
 	if (rc != SQLITE_DONE) {
 		std::cerr << "scan fail INSERT_TRACKS " << atag.stag[audio_tag::sval::TRACK_UUID]
 			<< " : \"" << atag.stag[audio_tag::sval::TITLE] << "\" "
@@ -332,27 +426,12 @@ void mediadb::scan_file(const db_connection& dbc, const fs::path& path, sqlite3_
 	}
 	sqlite3_reset(stmt[INSERT_TRACKS]);
 
-	// Insert album artists and track artists.
-	for (size_t i = 0; i < atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS].size(); i++) {
-		sqlite3_bind_text(stmt[INSERT_ALBUMARTISTS], 1, atag.stag[audio_tag::sval::ALBUM_UUID].c_str(), -1, SQLITE_STATIC);
-		sqlite3_bind_text(stmt[INSERT_ALBUMARTISTS], 2, atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS][i].c_str(), -1, SQLITE_STATIC);
-		sqlite3_bind_int(stmt[INSERT_ALBUMARTISTS], 3, i + 1);
-		do { rc = sqlite3_step(stmt[INSERT_ALBUMARTISTS]); } while (rc == SQLITE_BUSY);
-		if (rc != SQLITE_DONE) {
-			std::cerr << "scan fail INSERT_ALBUMARTISTS "
-				<< atag.stag[audio_tag::sval::ALBUM_UUID] << " " << atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS][i]
-				<< " : \"" << atag.stag[audio_tag::sval::TITLE] << "\" \"" << atag.ltag[audio_tag::lval::ALBUMARTIST_UUIDS][i] << "\" "
-				<< sqlite3_errmsg(dbc.handle()) << std::endl;
-			abort();
-		}
-		sqlite3_reset(stmt[INSERT_ALBUMARTISTS]);
-	}
-
+	// Insert track artists.
 	for (size_t i = 0; i < atag.ltag[audio_tag::lval::ARTIST_UUIDS].size(); i++) {
 		sqlite3_bind_text(stmt[INSERT_TRACKARTISTS], 1, atag.stag[audio_tag::sval::TRACK_UUID].c_str(), -1, SQLITE_STATIC);
 		sqlite3_bind_text(stmt[INSERT_TRACKARTISTS], 2, atag.ltag[audio_tag::lval::ARTIST_UUIDS][i].c_str(), -1, SQLITE_STATIC);
 		sqlite3_bind_int(stmt[INSERT_TRACKARTISTS], 3, i + 1);
-		do { rc = sqlite3_step(stmt[INSERT_TRACKARTISTS]); } while (rc == SQLITE_BUSY);
+		rc = step_timed(stmt[INSERT_TRACKARTISTS], ss.stats);
 		if (rc != SQLITE_DONE) {
 			std::cerr << "scan fail INSERT_TRACKARTISTS "
 				<< atag.stag[audio_tag::sval::TRACK_UUID] << " " << atag.ltag[audio_tag::lval::ARTIST_UUIDS][i]
@@ -275,7 +275,8 @@ void surf_server::api_v1_album(http_server::session* sn, const std::string& albu
 		sn->set_response_header("Cache-Control", "no-store");
 		sn->set_response_header("Content-type", "text/plain; charset=utf-8");
 		sn->set_response_header("Content-Length", "11");
-		return sn->write("Not Found\r\n", 11);
+		sn->write("Not Found\r\n", 11);
+		return;
 	}
 
 	std::string last_uuid = "";
@@ -429,7 +430,8 @@ void surf_server::api_v1_search(http_server::session* sn, const std::string& oq)
 	if (oq.length() < 2) {
 		sn->set_status_code(200);
 		sn->set_response_header("Content-type", "application/json");
-		return sn->write("[]", 2);
+		sn->write("[]", 2);
+		return;
 	}
 
 	db_connection dbc = mdb.dbconn();
@@ -0,0 +1,335 @@
+#include "sampleconv.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) || defined(_M_X64)
+#define SC_X86 1
+#include <immintrin.h>
+#endif
+#if defined(SC_X86) && defined(__GNUC__)
+#define SC_AVX2_TARGET __attribute__((target("avx2")))
+#define SC_HAVE_AVX2 1
+#endif
+
+/* The scalar kernels round and clip like libswresample does, and the vector ones match them. */
+
+static inline int16_t flt_to_s16(float v)
+{
+	return static_cast<int16_t>(lrintf(std::min(std::max(v * 32768.0f, -32768.0f), 32767.0f)));
+}
+
+static void s16_s16p_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int16_t *in = reinterpret_cast<const int16_t*>(src[0]);
+	int16_t *l = reinterpret_cast<int16_t*>(dst[0]), *r = reinterpret_cast<int16_t*>(dst[1]);
+	for (int i = 0; i < n; i++) {
+		l[i] = in[2 * i];
+		r[i] = in[2 * i + 1];
+	}
+}
+
+static void s32_s16p_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int32_t *in = reinterpret_cast<const int32_t*>(src[0]);
+	int16_t *l = reinterpret_cast<int16_t*>(dst[0]), *r = reinterpret_cast<int16_t*>(dst[1]);
+	for (int i = 0; i < n; i++) {
+		l[i] = in[2 * i] >> 16;
+		r[i] = in[2 * i + 1] >> 16;
+	}
+}
+
+static void fltp_s16p_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	for (int c = 0; c < 2; c++) {
+		const float *in = reinterpret_cast<const float*>(src[c]);
+		int16_t *out = reinterpret_cast<int16_t*>(dst[c]);
+		for (int i = 0; i < n; i++)
+			out[i] = flt_to_s16(in[i]);
+	}
+}
+
+static void s16_fltp_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int16_t *in = reinterpret_cast<const int16_t*>(src[0]);
+	float *l = reinterpret_cast<float*>(dst[0]), *r = reinterpret_cast<float*>(dst[1]);
+	for (int i = 0; i < n; i++) {
+		l[i] = in[2 * i] * (1.0f / 32768);
+		r[i] = in[2 * i + 1] * (1.0f / 32768);
+	}
+}
+
+static void s32_fltp_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int32_t *in = reinterpret_cast<const int32_t*>(src[0]);
+	float *l = reinterpret_cast<float*>(dst[0]), *r = reinterpret_cast<float*>(dst[1]);
+	for (int i = 0; i < n; i++) {
+		l[i] = in[2 * i] * (1.0f / 2147483648.0f);
+		r[i] = in[2 * i + 1] * (1.0f / 2147483648.0f);
+	}
+}
+
+static void fltp_s16_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const float *l = reinterpret_cast<const float*>(src[0]), *r = reinterpret_cast<const float*>(src[1]);
+	int16_t *out = reinterpret_cast<int16_t*>(dst[0]);
+	for (int i = 0; i < n; i++) {
+		out[2 * i] = flt_to_s16(l[i]);
+		out[2 * i + 1] = flt_to_s16(r[i]);
+	}
+}
+
+static void copy_packed32_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	memcpy(dst[0], src[0], n * 4);
+}
+
+static void copy_planar32_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	memcpy(dst[0], src[0], n * 4);
+	memcpy(dst[1], src[1], n * 4);
+}
+
+static void copy_planar16_c(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	memcpy(dst[0], src[0], n * 2);
+	memcpy(dst[1], src[1], n * 2);
+}
+
+// Runs the scalar kernel on what the vector loop left over, from sample i on.
+static inline void tail(sampleconv_fn c, uint8_t *const *dst, const uint8_t *const *src, int i, int n, int in_size, bool in_packed, int out_size, bool out_packed)
+{
+	if (i >= n)
+		return;
+	const int in_off = i * in_size * (in_packed ? 2 : 1), out_off = i * out_size * (out_packed ? 2 : 1);
+	const uint8_t *s[2] = {src[0] + in_off, in_packed ? nullptr : src[1] + in_off};
+	uint8_t *d[2] = {dst[0] + out_off, out_packed ? nullptr : dst[1] + out_off};
+	c(d, s, n - i);
+}
+
+#ifdef SC_X86
+static inline __m128i flt_to_s32_sse2(__m128 v)
+{
+	const __m128 lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f), scale = _mm_set1_ps(32768.0f);
+	return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(v, scale), lo), hi));
+}
+
+// Splits 16 interleaved s16 samples into 8 left and 8 right.
+static inline void deinterleave_s16_sse2(__m128i a, __m128i b, int16_t *l, int16_t *r)
+{
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(l), _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16)));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(r), _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+}
+
+static void s16_s16p_sse2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int16_t *in = reinterpret_cast<const int16_t*>(src[0]);
+	int16_t *l = reinterpret_cast<int16_t*>(dst[0]), *r = reinterpret_cast<int16_t*>(dst[1]);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i + 8));
+		deinterleave_s16_sse2(a, b, l + i, r + i);
+	}
+	tail(s16_s16p_c, dst, src, i, n, 2, true, 2, false);
+}
+
+static void s32_s16p_sse2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int32_t *in = reinterpret_cast<const int32_t*>(src[0]);
+	int16_t *l = reinterpret_cast<int16_t*>(dst[0]), *r = reinterpret_cast<int16_t*>(dst[1]);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		const __m128i *p = reinterpret_cast<const __m128i*>(in + 2 * i);
+		__m128i a = _mm_packs_epi32(_mm_srai_epi32(_mm_loadu_si128(p), 16), _mm_srai_epi32(_mm_loadu_si128(p + 1), 16));
+		__m128i b = _mm_packs_epi32(_mm_srai_epi32(_mm_loadu_si128(p + 2), 16), _mm_srai_epi32(_mm_loadu_si128(p + 3), 16));
+		deinterleave_s16_sse2(a, b, l + i, r + i);
+	}
+	tail(s32_s16p_c, dst, src, i, n, 4, true, 2, false);
+}
+
+static void fltp_s16p_sse2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	int i = 0;
+	for (int c = 0; c < 2; c++) {
+		const float *in = reinterpret_cast<const float*>(src[c]);
+		int16_t *out = reinterpret_cast<int16_t*>(dst[c]);
+		for (i = 0; i + 8 <= n; i += 8) {
+			__m128i a = flt_to_s32_sse2(_mm_loadu_ps(in + i)), b = flt_to_s32_sse2(_mm_loadu_ps(in + i + 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(a, b));
+		}
+	}
+	tail(fltp_s16p_c, dst, src, i, n, 4, false, 2, false);
+}
+
+static void s16_fltp_sse2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int16_t *in = reinterpret_cast<const int16_t*>(src[0]);
+	float *l = reinterpret_cast<float*>(dst[0]), *r = reinterpret_cast<float*>(dst[1]);
+	const __m128 scale = _mm_set1_ps(1.0f / 32768);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 2 * i));
+		_mm_storeu_ps(l + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16)), scale));
+		_mm_storeu_ps(r + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(a, 16)), scale));
+	}
+	tail(s16_fltp_c, dst, src, i, n, 2, true, 4, false);
+}
+
+static void s32_fltp_sse2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int32_t *in = reinterpret_cast<const int32_t*>(src[0]);
+	float *l = reinterpret_cast<float*>(dst[0]), *r = reinterpret_cast<float*>(dst[1]);
+	const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		const __m128i *p = reinterpret_cast<const __m128i*>(in + 2 * i);
+		__m128 a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(p)), scale);
+		__m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(p + 1)), scale);
+		_mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	tail(s32_fltp_c, dst, src, i, n, 4, true, 4, false);
+}
+
+static void fltp_s16_sse2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const float *l = reinterpret_cast<const float*>(src[0]), *r = reinterpret_cast<const float*>(src[1]);
+	int16_t *out = reinterpret_cast<int16_t*>(dst[0]);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128i l16 = _mm_packs_epi32(flt_to_s32_sse2(_mm_loadu_ps(l + i)), flt_to_s32_sse2(_mm_loadu_ps(l + i + 4)));
+		__m128i r16 = _mm_packs_epi32(flt_to_s32_sse2(_mm_loadu_ps(r + i)), flt_to_s32_sse2(_mm_loadu_ps(r + i + 4)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), _mm_unpacklo_epi16(l16, r16));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 8), _mm_unpackhi_epi16(l16, r16));
+	}
+	tail(fltp_s16_c, dst, src, i, n, 4, false, 2, true);
+}
+#endif // SC_X86
+
+#ifdef SC_HAVE_AVX2
+// packs works within each 128-bit lane; this puts the four 64-bit quarters back in order.
+#define SC_UNLANE(v) _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 1, 2, 0))
+
+SC_AVX2_TARGET static inline __m256i flt_to_s32_avx2(__m256 v)
+{
+	const __m256 lo = _mm256_set1_ps(-32768.0f), hi = _mm256_set1_ps(32767.0f), scale = _mm256_set1_ps(32768.0f);
+	return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v, scale), lo), hi));
+}
+
+// Splits 32 interleaved s16 samples into 16 left and 16 right.
+SC_AVX2_TARGET static inline void deinterleave_s16_avx2(__m256i a, __m256i b, int16_t *l, int16_t *r)
+{
+	__m256i lv = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16), _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+	__m256i rv = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(l), SC_UNLANE(lv));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(r), SC_UNLANE(rv));
+}
+
+SC_AVX2_TARGET static void s16_s16p_avx2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int16_t *in = reinterpret_cast<const int16_t*>(src[0]);
+	int16_t *l = reinterpret_cast<int16_t*>(dst[0]), *r = reinterpret_cast<int16_t*>(dst[1]);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + 2 * i + 16));
+		deinterleave_s16_avx2(a, b, l + i, r + i);
+	}
+	tail(s16_s16p_c, dst, src, i, n, 2, true, 2, false);
+}
+
+SC_AVX2_TARGET static void s32_s16p_avx2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	const int32_t *in = reinterpret_cast<const int32_t*>(src[0]);
+	int16_t *l = reinterpret_cast<int16_t*>(dst[0]), *r = reinterpret_cast<int16_t*>(dst[1]);
+	int i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m256i *p = reinterpret_cast<const __m256i*>(in + 2 * i);
+		__m256i a = SC_UNLANE(_mm256_packs_epi32(_mm256_srai_epi32(_mm256_loadu_si256(p), 16), _mm256_srai_epi32(_mm256_loadu_si256(p + 1), 16)));
+		__m256i b = SC_UNLANE(_mm256_packs_epi32(_mm256_srai_epi32(_mm256_loadu_si256(p + 2), 16), _mm256_srai_epi32(_mm256_loadu_si256(p + 3), 16)));
+		deinterleave_s16_avx2(a, b, l + i, r + i);
+	}
+	tail(s32_s16p_c, dst, src, i, n, 4, true, 2, false);
+}
+
+SC_AVX2_TARGET static void fltp_s16p_avx2(uint8_t *const *dst, const uint8_t *const *src, int n)
+{
+	int i = 0;
+	for (int c = 0; c < 2; c++) {
+		const float *in = reinterpret_cast<const float*>(src[c]);
+		int16_t *out = reinterpret_cast<int16_t*>(dst[c]);
+		for (i = 0; i + 16 <= n; i += 16) {
+			__m256i a = flt_to_s32_avx2(_mm256_loadu_ps(in + i)), b = flt_to_s32_avx2(_mm256_loadu_ps(in + i + 8));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), SC_UNLANE(_mm256_packs_epi32(a, b)));
+		}
+	}
+	tail(fltp_s16p_c, dst, src, i, n, 4, false, 2, false);
+}
+#endif // SC_HAVE_AVX2
+
+struct sampleconv_kernel {
+	AVSampleFormat in, out;
+	sampleconv_fn fn[3]; // by sampleconv_isa; nullptr where there is no such version
+};
+
+#ifdef SC_X86
+#define SC_SSE2_FN(f) f
+#else
+#define SC_SSE2_FN(f) nullptr
+#endif
+#ifdef SC_HAVE_AVX2
+#define SC_AVX2_FN(f) f
+#else
+#define SC_AVX2_FN(f) nullptr
+#endif
+
+static const sampleconv_kernel kernels[] = {
+	{AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16P, {s16_s16p_c, SC_SSE2_FN(s16_s16p_sse2), SC_AVX2_FN(s16_s16p_avx2)}},
+	{AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S16P, {s32_s16p_c, SC_SSE2_FN(s32_s16p_sse2), SC_AVX2_FN(s32_s16p_avx2)}},
+	{AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16P, {fltp_s16p_c, SC_SSE2_FN(fltp_s16p_sse2), SC_AVX2_FN(fltp_s16p_avx2)}},
+	{AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP, {s16_fltp_c, SC_SSE2_FN(s16_fltp_sse2), nullptr}},
+	{AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_FLTP, {s32_fltp_c, SC_SSE2_FN(s32_fltp_sse2), nullptr}},
+	{AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, {fltp_s16_c, SC_SSE2_FN(fltp_s16_sse2), nullptr}},
+	{AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S16, {copy_packed32_c, nullptr, nullptr}},
+	{AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLTP, {copy_planar32_c, nullptr, nullptr}},
+	{AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16P, {copy_planar16_c, nullptr, nullptr}},
+};
+
+static bool cpu_supports(sampleconv_isa isa)
+{
+	switch (isa) {
+	case SC_SCALAR:
+		return true;
+#ifdef SC_X86
+	case SC_SSE2:
+		return true; // part of x86-64
+#endif
+#ifdef SC_HAVE_AVX2
+	case SC_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+sampleconv_fn find_sampleconv(AVSampleFormat in, AVSampleFormat out, sampleconv_isa isa)
+{
+	for (const auto& k : kernels) {
+		if (k.in != in || k.out != out)
+			continue;
+		if (isa != SC_BEST)
+			return cpu_supports(isa) ? k.fn[isa] : nullptr;
+		for (int i = SC_AVX2; i >= SC_SCALAR; i--) {
+			if (k.fn[i] != nullptr && cpu_supports(static_cast<sampleconv_isa>(i)))
+				return k.fn[i];
+		}
+	}
+	return nullptr;
+}
+
+const char *sampleconv_isa_name(sampleconv_isa isa)
+{
+	static const char *names[] = {"scalar", "sse2", "avx2", "best"};
+	return names[isa];
+}
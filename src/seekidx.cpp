@@ -0,0 +1,157 @@
+#include "seekidx.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+static const char INDEX_MAGIC[4] = {'S', 'I', 'D', 'X'};
+constexpr uint32_t INDEX_VERSION = 1;
+
+void seek_index::add(int64_t ms, int64_t offset)
+{
+	frames++;
+	ms = std::max<int64_t>(ms, 0);
+	if (offset > UINT32_MAX || (!points.empty() && ms < points.back().ms + SEEK_INDEX_INTERVAL_MS))
+		return;
+	points.push_back({static_cast<uint32_t>(ms), static_cast<uint32_t>(offset)});
+}
+
+const seek_point *seek_index::find(int64_t ms) const
+{
+	if (points.empty())
+		return nullptr;
+	auto it = std::upper_bound(points.begin(), points.end(), ms, [](int64_t t, const seek_point& p) { return t < p.ms; });
+	return it == points.begin() ? &points.front() : &*(it - 1);
+}
+
+// Written to a temp file that replaces the old one in one rename, so readers never see half of one.
+uint64_t write_seek_index(const std::string& path, const seek_index& idx)
+{
+	std::vector<char> tmpl(path.begin(), path.end());
+	const char suffix[] = ".part.XXXXXX";
+	tmpl.insert(tmpl.end(), suffix, suffix + sizeof(suffix));
+	int fd = mkstemp(tmpl.data());
+	if (fd < 0) {
+		perror("tc fail_index_open");
+		return 0;
+	}
+
+	const uint32_t header[] = {INDEX_VERSION, static_cast<uint32_t>(idx.points.size()), idx.frames};
+	std::vector<char> buf(sizeof(INDEX_MAGIC) + sizeof(header) + idx.points.size() * sizeof(seek_point));
+	memcpy(buf.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	memcpy(buf.data() + sizeof(INDEX_MAGIC), header, sizeof(header));
+	memcpy(buf.data() + sizeof(INDEX_MAGIC) + sizeof(header), idx.points.data(), idx.points.size() * sizeof(seek_point));
+
+	bool ok = true;
+	for (size_t off = 0; ok && off < buf.size(); ) {
+		ssize_t r = ::write(fd, buf.data() + off, buf.size() - off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		ok = r > 0;
+		off += ok ? r : 0;
+	}
+	close(fd);
+	if (!ok || rename(tmpl.data(), path.c_str()) != 0) {
+		perror("tc fail_index_write");
+		unlink(tmpl.data());
+		return 0;
+	}
+	return buf.size();
+}
+
+bool read_seek_index(const std::string& path, seek_index& idx)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr)
+		return false;
+
+	char magic[4];
+	uint32_t header[3];
+	bool ok = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0 &&
+		fread(header, sizeof(header), 1, f) == 1 && header[0] == INDEX_VERSION;
+	if (ok) {
+		idx.points.resize(header[1]);
+		idx.frames = header[2];
+		ok = fread(idx.points.data(), sizeof(seek_point), idx.points.size(), f) == idx.points.size();
+	}
+	fclose(f);
+	return ok;
+}
+
+// MPEG audio layer III: which version a sample rate belongs to, and its index in the header.
+static bool mp3_rate(int sample_rate, bool *mpeg1, int *index)
+{
+	static const int rates[2][3] = {{44100, 48000, 32000}, {22050, 24000, 16000}};
+	for (int v = 0; v < 2; v++) {
+		for (int i = 0; i < 3; i++) {
+			if (rates[v][i] == sample_rate) {
+				*mpeg1 = v == 0;
+				*index = i;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static size_t xing_tag_offset(bool mpeg1, int channels)
+{
+	// After the frame header and the side information.
+	return 4 + (mpeg1 ? (channels == 1 ? 17 : 32) : (channels == 1 ? 9 : 17));
+}
+
+std::vector<uint8_t> mp3_xing_frame(int sample_rate, int channels)
+{
+	static const int kbps[2][15] = {
+		{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}};
+	bool mpeg1;
+	int rate_index;
+	if (!mp3_rate(sample_rate, &mpeg1, &rate_index))
+		return {};
+
+	// The tag: "Xing", flags, frame count, byte count and a 100-entry table of contents.
+	const size_t tag = xing_tag_offset(mpeg1, channels), needed = tag + 4 + 4 + 4 + 4 + 100;
+	for (int b = 1; b < 15; b++) {
+		const size_t size = (mpeg1 ? 144000 : 72000) * kbps[!mpeg1][b] / sample_rate;
+		if (size < needed)
+			continue;
+
+		std::vector<uint8_t> frame(size, 0);
+		frame[0] = 0xff;
+		frame[1] = mpeg1 ? 0xfb : 0xf3; // layer III, no CRC
+		frame[2] = (b << 4) | (rate_index << 2);
+		frame[3] = channels == 1 ? 0xc0 : 0x40; // mono or joint stereo
+		memcpy(&frame[tag], "Xing", 4);
+		frame[tag + 7] = 0x07; // frames, bytes and table of contents present
+		return frame;
+	}
+	return {};
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void mp3_fill_xing(std::vector<uint8_t>& frame, const seek_index& idx, int sample_rate, uint32_t first, uint32_t bytes)
+{
+	bool mpeg1;
+	int rate_index;
+	if (frame.empty() || bytes == 0 || !mp3_rate(sample_rate, &mpeg1, &rate_index))
+		return;
+
+	const size_t tag = xing_tag_offset(mpeg1, (frame[3] & 0xc0) == 0xc0 ? 1 : 2);
+	const uint64_t duration_ms = static_cast<uint64_t>(idx.frames) * (mpeg1 ? 1152 : 576) * 1000 / sample_rate;
+	put_be32(&frame[tag + 8], idx.frames);
+	put_be32(&frame[tag + 12], bytes);
+	for (int i = 0; i < 100; i++) {
+		// Entry i is where i% of the way through starts, in 256ths of the file.
+		const seek_point *p = idx.find(duration_ms * i / 100);
+		const uint64_t off = p != nullptr && p->offset > first ? p->offset - first : 0;
+		frame[tag + 16 + i] = std::min<uint64_t>(255, off * 256 / bytes);
+	}
+}
@@ -4,22 +4,44 @@
 #include <regex>
 #include <sstream>
 
-surf_server::surf_server(mediadb& mdb, unsigned short port) :
-	http_server(port), mdb(mdb), stop(false)
+surf_server::surf_server(mediadb& mdb, unsigned short port, const server_options& opts) :
+	http_server(port), mdb(mdb), stop(false),
+	tcp(opts.tc_workers, opts.tc_queue, [this](std::shared_ptr<tc_job> job) { api_v1_transcode(job); }),
+	prefetch_tracks(opts.prefetch_tracks),
+	prefetch_jobs(opts.prefetch_jobs),
+	overload_queue(opts.overload_queue),
+	overload_load(opts.overload_load),
+	tc_pipeline(opts.tc_pipeline),
+	cache_fsync(opts.cache_fsync),
+	chunk_bytes(std::max<size_t>(1, opts.chunk_bytes)),
+	chunk_delay(opts.chunk_delay_ms),
+	warmup_opts(opts.warmup),
+	warmup_fmt(opts.warmup.qualities.empty() ? nullptr : find_tc_format(opts.warmup.format)),
+	// Background jobs may take half the queue, so this allows one per thread.
+	warmup_pool(opts.warmup.jobs, 2 * std::max(1U, opts.warmup.jobs), [this](std::shared_ptr<tc_job> job) { warmup_transcode(job); }),
+	warmup_requested(false)
 {
 	const int num_threads = std::thread::hardware_concurrency() * 8 / 5;
 	threads.reserve(num_threads);
 	for (int i = 0; i < num_threads; i++) {
 		threads.emplace_back(&surf_server::accept, this);
 	}
+	if (warmup_fmt != nullptr)
+		warmup_thread = std::thread(&surf_server::warmup_run, this);
 }
 
 surf_server::~surf_server()
 {
-	stop = true;
+	{
+		std::lock_guard<std::mutex> lck(warmup_mtx);
+		stop = true;
+	}
+	warmup_cv.notify_all();
 	cond.notify_all();
 	for (std::thread& th : threads)
 		th.join();
+	if (warmup_thread.joinable())
+		warmup_thread.join();
 }
 
 void surf_server::accept()
@@ -102,9 +124,25 @@ void surf_server::pick_route(http_server::session* sn)
 				sn->serve_error(404, "Not Found\r\n");
 		} else
 			sn->serve_error(405, "Not Allowed\r\n");
+	} else if (sn->request_path() == "/api/v1/scan") {
+		if (sn->request_method() == "GET" || sn->request_method() == "POST")
+			api_v1_scan(sn);
+		else
+			sn->serve_error(405, "Not Allowed\r\n");
+	} else if (sn->request_path() == "/api/v1/warmup") {
+		if (sn->request_method() == "GET" || sn->request_method() == "POST")
+			api_v1_warmup(sn);
+		else
+			sn->serve_error(405, "Not Allowed\r\n");
 	} else if (std::regex_match(sn->request_path(), sm, std::regex("/api/v1/stream/([^/]*)"))) {
 		if (check_mdb_modified_date(sn) == false)
 			api_v1_stream(sn, sm[1]);
+	} else if (std::regex_match(sn->request_path(), sm, std::regex("/api/v1/hls/([^/]*)/index\\.m3u8"))) {
+		if (check_mdb_modified_date(sn) == false)
+			api_v1_hls_playlist(sn, sm[1]);
+	} else if (std::regex_match(sn->request_path(), sm, std::regex("/api/v1/hls/([^/]*)/(\\d{1,6})\\.ts"))) {
+		if (check_mdb_modified_date(sn) == false)
+			api_v1_hls_segment(sn, sm[1], std::stoi(sm[2]));
 	} else {
 		sn->serve_error(404, "Not Found\r\n");
 	}
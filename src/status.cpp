@@ -0,0 +1,89 @@
+#include "http.h"
+
+static int64_t to_ms(std::chrono::nanoseconds d)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+}
+
+void surf_server::api_v1_scan(http_server::session* sn)
+{
+	int status = 200;
+	if (sn->request_method() == "POST")
+		status = mdb.start_scan(mdb.library_path()) ? 202 : 409;
+
+	scan_stats st = mdb.scan_status();
+	const double elapsed = std::chrono::duration<double>(st.elapsed).count();
+	json resp = {
+		{"running", st.running},
+		{"root", st.root},
+		{"error", st.error},
+		{"elapsed_ms", to_ms(st.elapsed)},
+		{"files", {
+			{"discovered", st.files_discovered},
+			{"unchanged", st.files_unchanged},
+			{"probed", st.files_probed},
+			{"skipped", st.files_skipped},
+			{"failed", st.files_failed},
+		}},
+		{"bytes_hashed", st.bytes_hashed},
+		{"time_ms", {
+			{"probe", to_ms(st.probe_time)},
+			{"hash", to_ms(st.hash_time)},
+			{"sqlite", to_ms(st.sqlite_time)},
+		}},
+		{"files_per_sec", elapsed > 0 ? st.files_discovered / elapsed : 0.0},
+	};
+
+	std::string s = resp.dump();
+	sn->set_status_code(status);
+	sn->set_response_header("Cache-Control", "no-store");
+	sn->set_response_header("Content-type", "application/json");
+	sn->set_response_header("Content-length", std::to_string(s.length()));
+	sn->write(s.c_str(), s.length());
+}
+
+void surf_server::api_v1_warmup(http_server::session* sn)
+{
+	int status = 200;
+	warmup_stats st;
+	{
+		std::lock_guard<std::mutex> lck(warmup_mtx);
+		if (sn->request_method() == "POST") {
+			status = warmup_fmt != nullptr && !warmup_progress.running ? 202 : 409;
+			warmup_requested = warmup_requested || status == 202;
+		}
+		st = warmup_progress;
+	}
+	if (status == 202)
+		warmup_cv.notify_all();
+
+	json resp = {
+		{"enabled", warmup_fmt != nullptr},
+		{"running", st.running},
+		{"waiting_for_idle", st.waiting},
+		{"started", st.started ? format_time(st.started) : ""},
+		{"finished", st.finished ? format_time(st.finished) : ""},
+		{"format", warmup_fmt != nullptr ? warmup_fmt->name : ""},
+		{"qualities", warmup_opts.qualities},
+		{"tracks", st.tracks},
+		{"outputs", {
+			{"planned", st.planned},
+			{"cached", st.cached},
+			{"done", st.done},
+			{"failed", st.failed},
+			{"skipped", st.skipped},
+			{"in_flight", st.in_flight},
+		}},
+		{"bytes_transcoded", st.bytes},
+		{"cache_bytes", mdb.cache_usage().second},
+		{"budget_bytes", warmup_opts.budget},
+		{"budget_reached", st.budget_reached},
+	};
+
+	std::string s = resp.dump();
+	sn->set_status_code(status);
+	sn->set_response_header("Cache-Control", "no-store");
+	sn->set_response_header("Content-type", "application/json");
+	sn->set_response_header("Content-length", std::to_string(s.length()));
+	sn->write(s.c_str(), s.length());
+}
@@ -1,20 +1,133 @@
 #include "ffmpeg.h"
 #include "http.h"
-#include <fstream>
+#include "tcpipe.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iomanip>
+#include <netinet/in.h>
 #include <regex>
-#include <thread>
-constexpr int OUTPUT_SAMPLE_RATE = 44100;
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+constexpr int TC_RETRY_AFTER = 2;
+constexpr int64_t HLS_SEGMENT_MS = 6000;
+constexpr int HLS_AHEAD = 2; // segments encoded ahead of the one being played
+constexpr size_t TC_MAX_BRANCHES = 4;
+
+// For MP3 the ladder is just the typical bitrates of LAME's -V0 to -V9 presets. Opus sounds as good
+// at roughly 60% of those, AAC at roughly 75%.
+static const tc_format tc_formats[] = {
+	{"mp3", "mp3", "mp3", "audio/mpeg", AV_CODEC_ID_MP3, "libmp3lame", 44100,
+		{245, 225, 190, 175, 165, 130, 115, 100, 85, 65}, nullptr},
+	{"opus", "ogg", "opus", "audio/ogg", AV_CODEC_ID_OPUS, "libopus", 48000,
+		{144, 128, 112, 104, 96, 80, 64, 56, 48, 40}, nullptr},
+	{"webm", "webm", "webm", "audio/webm", AV_CODEC_ID_OPUS, "libopus", 48000,
+		{144, 128, 112, 104, 96, 80, 64, 56, 48, 40}, nullptr},
+	{"aac", "adts", "aac", "audio/aac", AV_CODEC_ID_AAC, "aac", 44100,
+		{192, 176, 144, 128, 128, 112, 96, 80, 64, 48}, nullptr},
+	{"m4a", "mp4", "m4a", "audio/mp4", AV_CODEC_ID_AAC, "aac", 44100,
+		{192, 176, 144, 128, 128, 112, 96, 80, 64, 48}, "movflags=empty_moov+default_base_moof:frag_duration=1000000"},
+};
+
+// HLS segments are MPEG-TS, which players take MP3 or AAC in.
+static const tc_format hls_formats[] = {
+	{"mp3", "mpegts", "mp3.ts", "video/mp2t", AV_CODEC_ID_MP3, "libmp3lame", 44100,
+		{245, 225, 190, 175, 165, 130, 115, 100, 85, 65}, nullptr},
+	{"aac", "mpegts", "aac.ts", "video/mp2t", AV_CODEC_ID_AAC, "aac", 44100,
+		{192, 176, 144, 128, 128, 112, 96, 80, 64, 48}, nullptr},
+};
+
+const tc_format *find_tc_format(const std::string& name)
+{
+	for (const auto& f : tc_formats) {
+		if (name == f.name)
+			return &f;
+	}
+	if (name == "ogg")
+		return &tc_formats[1];
+	if (name == "fmp4" || name == "mp4")
+		return &tc_formats[4];
+	return nullptr;
+}
+
+// Formats that are just a sequence of frames, so a player can pick them up from any byte.
+static bool is_headerless(const tc_format *fmt)
+{
+	return strcmp(fmt->muxer, "mp3") == 0 || strcmp(fmt->muxer, "adts") == 0;
+}
 
-typedef struct {
-	http_server::session* sn;
-	std::FILE* cache_fp;
-} tc_out_mux_t;
+static void serve_busy(http_server::session* sn)
+{
+	static const std::string msg = "Too many transcodes waiting, try again later\r\n";
+	sn->set_status_code(503);
+	sn->set_response_header("Cache-Control", "no-store");
+	sn->set_response_header("Retry-After", std::to_string(TC_RETRY_AFTER));
+	sn->set_response_header("Content-type", "text/plain");
+	sn->set_response_header("Content-length", std::to_string(msg.length()));
+	sn->write(msg.c_str(), msg.length());
+}
+
+static const tc_format *find_hls_format(const std::string& name)
+{
+	for (const auto& f : hls_formats) {
+		if (name == f.name)
+			return &f;
+	}
+	return nullptr;
+}
+
+// Re-encoding an MP3 that is already no better than what was asked for only loses quality.
+bool surf_server::is_passthrough(const track_source& track, int quality, const tc_format *fmt)
+{
+	return fmt->codec_id == AV_CODEC_ID_MP3 && track.format == "mp3" && track.bitrate > 0 && track.bitrate <= fmt->kbps[quality] * 1000;
+}
+
+// Who is listening, as far as guessing what they play next goes: the address without the port.
+static std::string peer_name(http_server::session* sn)
+{
+	sockaddr_storage sa;
+	socklen_t len = sizeof(sa);
+	char buf[INET6_ADDRSTRLEN] = "";
+	if (getpeername(sn->socket().handle(), reinterpret_cast<sockaddr*>(&sa), &len) == 0) {
+		if (sa.ss_family == AF_INET)
+			inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(&sa)->sin_addr, buf, sizeof(buf));
+		else if (sa.ss_family == AF_INET6)
+			inet_ntop(AF_INET6, &reinterpret_cast<sockaddr_in6*>(&sa)->sin6_addr, buf, sizeof(buf));
+	}
+	return buf;
+}
+
+static std::string passthrough_type(const std::string& path)
+{
+	std::string ext = path.substr(path.find_last_of('.') + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	if (ext == "mp3")
+		return "audio/mpeg";
+	else if (ext == "flac")
+		return "audio/flac";
+	else if (ext == "m4a" || ext == "mp4" || ext == "aac")
+		return "audio/mp4";
+	else if (ext == "ogg" || ext == "oga" || ext == "opus")
+		return "audio/ogg";
+	else if (ext == "wav")
+		return "audio/wav";
+	else
+		return "application/octet-stream";
+}
 
 void surf_server::api_v1_stream(http_server::session* sn, const std::string& track_uuid)
 {
 	int quality = 6;
 	auto qs = sn->request_param("q");
-	if (qs.has_value()) {
+	if (qs.has_value() && qs.value() == "orig") {
+		auto track = mdb.get_track(track_uuid);
+		if (!track)
+			return sn->serve_error(404, "Not Found\r\n");
+		return api_v1_stream_file(sn, track->path, passthrough_type(track->path), "orig");
+	} else if (qs.has_value()) {
 		try {
 			quality = std::stoul(qs.value());
 		} catch (...) {
@@ -23,560 +136,683 @@ void surf_server::api_v1_stream(http_server::session* sn, const std::string& tra
 	}
 
 	if (quality < 0 || quality > 9)
-		return sn->serve_error(400, "Unexpected value for parameter 'q' (should be an integer from 0-9)\r\n");
+		return sn->serve_error(400, "Unexpected value for parameter 'q' (should be an integer from 0-9, or orig)\r\n");
 
-	auto cached = mdb.get_cached_transcode(track_uuid, quality);
-	if (cached.second)
-		return api_v1_stream_cached(sn, cached.first);
+	const tc_format *fmt = find_tc_format(sn->request_param("fmt").value_or("mp3"));
+	if (fmt == nullptr)
+		return sn->serve_error(400, "Unexpected value for parameter 'fmt' (should be one of mp3, opus, webm, aac, m4a)\r\n");
+	const std::string key = tc_job::key(track_uuid, quality, fmt);
 
-	auto track_path = mdb.get_track_path(track_uuid);
-	if (track_path)
-		std::thread(&surf_server::api_v1_transcode, this, sn, track_uuid, track_path.value(), quality).detach();
-	else
-		sn->serve_error(404, "Not Found\r\n");
-}
-
-void surf_server::api_v1_stream_cached(http_server::session* sn, const std::string& path_to_tc)
-{
-	// Handle a range request, if we got one.
-	auto range_hdr = sn->request_header("range");
-	std::optional<std::pair<int, int>> range = std::nullopt;
-	if (range_hdr) {
-		std::smatch rsm;
-		if (std::regex_match(range_hdr.value(), rsm, std::regex(R"(bytes=(\d*)-(\d*))"))) {
-			range.emplace(strtoul(rsm[1].str().c_str(), nullptr, 10), strtoul(rsm[2].str().c_str(), nullptr, 10));
-		} else {
-			return sn->serve_error(400, "malformed range request\r\n");
+	int tolerance = 0;
+	if (auto qtol = sn->request_param("qtol"); qtol.has_value()) {
+		try {
+			tolerance = std::stoul(qtol.value());
+		} catch (...) {
+			tolerance = -1;
 		}
+		if (tolerance < 0 || tolerance > 9)
+			return sn->serve_error(400, "Unexpected value for parameter 'qtol' (should be an integer from 0-9)\r\n");
 	}
+	sn->set_response_header("X-Surf-Quality", std::to_string(quality));
 
-	std::ifstream tcf(path_to_tc, std::ios_base::in | std::ios_base::ate | std::ios_base::binary);
-	if (!tcf) {
-		sn->set_status_code(500);
-		sn->set_response_header("Cache-Control", "no-store");
-		sn->set_response_header("Content-type", "text/plain");
-		sn->set_response_header("Content-length", "26");
-		return sn->write("Failed to open transcode\r\n", 26);
-	}
+	int64_t start_ms = 0;
+	if (auto ts = sn->request_param("t"); ts.has_value()) {
+		try {
+			start_ms = std::stoll(ts.value());
+		} catch (...) {
+			start_ms = -1;
+		}
+		if (start_ms < 0)
+			return sn->serve_error(400, "Unexpected value for parameter 't' (should be a time in ms)\r\n");
+	}
+
+	// Attach to a transcode already in flight; it stays registered until its output is cached.
+	std::shared_ptr<tc_job> job;
+	if (start_ms == 0) {
+		{
+			std::lock_guard<std::mutex> lck(tc_mtx);
+			auto it = tc_jobs.find(key);
+			if (it != tc_jobs.end() && it->second->attach()) {
+				job = it->second;
+				promote_job(job, TC_INTERACTIVE);
+			}
+		}
+		if (job) {
+			track_started(sn, track_uuid, quality, fmt);
+			return api_v1_stream_job(sn, job);
+		}
 
-	size_t tc_size = tcf.tellg();
-	tcf.clear();
-	if (range && (range->first >= tc_size || range->second >= tc_size)) {
-		sn->set_status_code(416);
-		sn->set_response_header("Cache-Control", "no-store");
-		sn->set_response_header("Content-length", "0");
-		sn->set_response_header("Content-range", "bytes */" + std::to_string(tc_size));
-		return sn->write_headers();
+		auto cached = mdb.get_cached_transcode(key);
+		if (cached.second) {
+			track_started(sn, track_uuid, quality, fmt);
+			return api_v1_stream_cached(sn, cached.first, fmt);
+		}
+	} else if (is_headerless(fmt)) {
+		// A cached transcode with an index can start at any frame without transcoding anything.
+		auto cached = mdb.get_cached_transcode(key);
+		seek_index idx;
+		if (cached.second && read_seek_index(cached.first + SEEK_INDEX_SUFFIX, idx) && !idx.points.empty())
+			return api_v1_stream_cached(sn, cached.first, fmt, idx.find(start_ms));
 	}
 
-	std::vector<char> tcbuf(16384);
-	sn->set_response_header("Content-type", "audio/mpeg");
-	if (range) {
-		std::stringstream ss;
-		int remaining = range->second - range->first + 1;
-		ss << "bytes " << range->first << '-' << range->second << '/' << tc_size;
+	auto track = mdb.get_track(track_uuid);
+	if (!track)
+		return sn->serve_error(404, "Not Found\r\n");
 
-		tcf.seekg(range->first);
-		sn->set_status_code(206);
-		sn->set_response_header("Content-range", ss.str());
-		while (!tcf.eof()) {
-			tcf.read(tcbuf.data(), tcbuf.size());
-			sn->write(tcbuf.data(), std::min(static_cast<int>(tcf.gcount()), remaining));
-		}
-	} else {
-		tcf.seekg(0);
-		sn->set_status_code(200);
-		sn->set_response_header("Content-length", std::to_string(tc_size));
-		while (!tcf.eof()) {
-			tcf.read(tcbuf.data(), tcbuf.size());
-			sn->write(tcbuf.data(), tcf.gcount());
+	if (start_ms == 0 && is_passthrough(*track, quality, fmt)) {
+		track_started(sn, track_uuid, quality, fmt);
+		return api_v1_stream_file(sn, track->path, "audio/mpeg", "orig");
+	}
+	if (start_ms == 0 && tolerance > 0 && overloaded() && stream_neighbour(sn, track_uuid, *track, quality, tolerance, fmt))
+		return;
+
+	/* A range of a transcode that does not exist yet can only be guessed at: assume the ladder's
+	 * bitrate throughout, and start encoding at the matching time. Only formats without a header
+	 * can be joined mid-stream like that. The bytes sent are not the bytes of that range, so the
+	 * answer is a 200 with X-Surf-Start-Ms, as for ?t=, rather than a 206 with a made-up range. */
+	auto range_hdr = sn->request_header("range");
+	if (start_ms == 0 && range_hdr && is_headerless(fmt) && track->duration_ms > 0) {
+		std::smatch rsm;
+		const uint64_t est_size = track->duration_ms * fmt->kbps[quality] / 8;
+		if (std::regex_match(range_hdr.value(), rsm, std::regex(R"(bytes=(\d+)-\d*)"))) {
+			const uint64_t first = strtoull(rsm[1].str().c_str(), nullptr, 10);
+			if (first >= est_size) {
+				sn->set_status_code(416);
+				sn->set_response_header("Cache-Control", "no-store");
+				sn->set_response_header("Content-length", "0");
+				sn->set_response_header("Content-range", "bytes */" + std::to_string(est_size));
+				sn->write_headers();
+				return;
+			} else if (first > 0) {
+				start_ms = first * track->duration_ms / est_size;
+			}
 		}
 	}
-}
 
-static int iom_write(void* opaque, uint8_t* buf, int buf_size)
-{
-	tc_out_mux_t* out = static_cast<tc_out_mux_t*>(opaque);
-	std::fwrite(buf, 1, buf_size, out->cache_fp);
-
-	// chunk-encode the stream for HTTP
-	char cel[16];
-	int celln = snprintf(cel, 16, "%X\r\n", buf_size);
-	out->sn->write(cel, celln);
-	out->sn->write(reinterpret_cast<const char*>(buf), buf_size);
-	out->sn->write("\r\n", 2);
-	return buf_size;
+	// Seeks get a transcode of their own, which nobody else attaches to.
+	if (start_ms > 0) {
+		job = std::make_shared<tc_job>(track_uuid, track->path, quality, fmt, TC_INTERACTIVE);
+		job->start_ms = start_ms;
+		job->attach();
+		if (!tcp.submit(job))
+			return serve_busy(sn);
+		return api_v1_stream_job(sn, job);
+	}
+
+	if (!(job = attach_or_submit(std::make_shared<tc_job>(track_uuid, track->path, quality, fmt, TC_INTERACTIVE), true)))
+		return serve_busy(sn);
+	track_started(sn, track_uuid, quality, fmt);
+	api_v1_stream_job(sn, job);
 }
 
-static int open_input_file(const std::string& path, AVFormatContext** in_fmt_ctx, AVCodecContext** in_codec_ctx)
+/* Someone started a track from the top: count the play, and get what they will want next ready
+ * unless told not to or the server is overloaded, when it would only add to the queue. */
+void surf_server::track_started(http_server::session* sn, const std::string& track_uuid, int quality, const tc_format *fmt, bool prefetch)
 {
-	AVCodecContext* avctx = nullptr;
-	AVCodec* input_codec;
-	int err, asid = -1;
-	AVStream *audio_stream;
-
-	if ((err = avformat_open_input(in_fmt_ctx, path.c_str(), nullptr, nullptr)) < 0) {
-		std::cerr << "tc fail_open " << path << " : " << av_err2str(err) << std::endl;
-		*in_fmt_ctx = nullptr;
-		return err;
-	}
-	if ((err = avformat_find_stream_info(*in_fmt_ctx, nullptr)) < 0) {
-		std::cerr << "tc fail_stream_inf " << path << " : " << av_err2str(err) << std::endl;
-		avformat_close_input(in_fmt_ctx);
-		*in_fmt_ctx = nullptr;
-		return err;
-	}
-
-	for (size_t i = 0; i < (*in_fmt_ctx)->nb_streams && asid == -1; i++) {
-		if ((*in_fmt_ctx)->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-			asid = i;
-	}
-	if (asid == -1) {
-		std::cerr << "tc no_audio_stream " << path << std::endl;
-		avformat_close_input(in_fmt_ctx);
-		*in_fmt_ctx = nullptr;
-		return err;
-	}
-
-	audio_stream = (*in_fmt_ctx)->streams[asid];
-	if ((input_codec = avcodec_find_decoder(audio_stream->codecpar->codec_id)) == nullptr) {
-		std::cerr << "tc no_audio_dec " << path << std::endl;
-		avformat_close_input(in_fmt_ctx);
-		*in_fmt_ctx = nullptr;
-		return AVERROR_DECODER_NOT_FOUND;
-	}
-	if ((avctx = avcodec_alloc_context3(input_codec)) == nullptr) {
-		avformat_close_input(in_fmt_ctx);
-		*in_fmt_ctx = nullptr;
-		return AVERROR(ENOMEM);
-	}
-	if ((err = avcodec_parameters_to_context(avctx, audio_stream->codecpar)) < 0) {
-		std::cerr << "tc par2ctx " << path << " : " << av_err2str(err) << std::endl;
-		avformat_close_input(in_fmt_ctx);
-		avcodec_free_context(&avctx);
-		*in_fmt_ctx = nullptr;
-		return err;
-	}
-	if ((err = avcodec_open2(avctx, input_codec, nullptr)) < 0) {
-		std::cerr << "tc open_input_codec " << path << " : " << av_err2str(err) << std::endl;
-		avformat_close_input(in_fmt_ctx);
-		avcodec_free_context(&avctx);
-		*in_fmt_ctx = nullptr;
-		return err;
-	}
-
-	*in_codec_ctx = avctx;
-	return 0;
+	// A range past the start is the same play carrying on.
+	auto range_hdr = sn->request_header("range");
+	if (range_hdr && range_hdr.value().compare(0, 8, "bytes=0-") != 0)
+		return;
+	mdb.record_play(track_uuid);
+	if (prefetch && prefetch_tracks > 0 && !overloaded())
+		prefetch_next(sn, track_uuid, quality, fmt);
 }
 
-static int open_output(AVFormatContext **out_fmt_ctx, AVCodecContext **out_codec_ctx, tc_out_mux_t* out, int quality)
+/* They are likely to want the next track on the album, or in the playlist given as plist, a few
+ * minutes from now: transcode it into the cache while there is time. What was prefetched for the
+ * track they were on before is dropped unless it is this one or is still coming up, since they
+ * skipped elsewhere. Called once this track's own transcode is queued, so it never waits behind
+ * a prefetch. */
+void surf_server::prefetch_next(http_server::session* sn, const std::string& track_uuid, int quality, const tc_format *fmt)
 {
-	AVCodecContext *avctx = nullptr;
-	AVIOContext *out_io_ctx = nullptr;
-	AVStream *stream = nullptr;
-	AVCodec *out_codec = nullptr;
-	unsigned char *iobuf = nullptr;
-	int err;
-
-	if ((iobuf = (unsigned char *) av_malloc(16384)) == nullptr)
-		return AVERROR(ENOMEM);
-
-	if ((out_io_ctx = avio_alloc_context(iobuf, 16384, 1, reinterpret_cast<void*>(out), nullptr, iom_write, nullptr)) == nullptr) {
-		av_free(iobuf);
-		return AVERROR_EXIT;
-	}
-
-	if ((*out_fmt_ctx = avformat_alloc_context()) == nullptr)
-		return AVERROR(ENOMEM);
-	(*out_fmt_ctx)->pb = out_io_ctx;
 
-	if (((*out_fmt_ctx)->oformat = av_guess_format("mp3", nullptr, nullptr)) == nullptr) {
-		std::cerr << "tc nomp3fmt" << std::endl;
-		goto cleanup;
+	const std::string peer = peer_name(sn);
+	const auto next = mdb.next_tracks(track_uuid, sn->request_param("plist").value_or(""), prefetch_tracks);
+	std::vector<std::shared_ptr<tc_job>> kept;
+	size_t in_flight = 0;
+	{
+		std::lock_guard<std::mutex> lck(tc_mtx);
+		for (auto it = prefetches.begin(); it != prefetches.end(); ) {
+			auto& jobs = it->second;
+			for (auto& j : jobs) {
+				if (it->first == peer && j->track_uuid != track_uuid && std::find(next.begin(), next.end(), j->track_uuid) == next.end())
+					j->abandon();
+			}
+			jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const auto& j) { return j->cancelled || j->done(); }), jobs.end());
+			if (it->first == peer)
+				kept.swap(jobs);
+			in_flight += jobs.size();
+			it = jobs.empty() ? prefetches.erase(it) : std::next(it);
+		}
 	}
 
-	if ((out_codec = avcodec_find_encoder(AV_CODEC_ID_MP3)) == nullptr) {
-		std::cerr << "tc nomp3enc" << std::endl;
-		goto cleanup;
-	}
-	if ((stream = avformat_new_stream(*out_fmt_ctx, nullptr)) == nullptr) {
-		err = AVERROR(ENOMEM);
-		goto cleanup;
+	std::vector<std::shared_ptr<tc_job>> jobs;
+	for (const auto& uuid : next) {
+		if (in_flight + jobs.size() >= prefetch_jobs)
+			break;
+		const std::string key = tc_job::key(uuid, quality, fmt);
+		auto dup = std::find_if(kept.begin(), kept.end(), [&](const auto& j) { return j->key() == key; });
+		if (dup != kept.end()) {
+			jobs.push_back(*dup);
+			continue;
+		}
+		if (mdb.has_cached_transcode(key))
+			continue;
+		auto track = mdb.get_track(uuid);
+		if (!track || is_passthrough(*track, quality, fmt))
+			continue;
+		auto job = attach_or_submit(std::make_shared<tc_job>(uuid, track->path, quality, fmt, TC_PREFETCH), false);
+		if (!job)
+			break;
+		jobs.push_back(job);
 	}
 
-	if ((avctx = avcodec_alloc_context3(out_codec)) == nullptr) {
-		err = AVERROR(ENOMEM);
-		goto cleanup;
+	if (!jobs.empty()) {
+		std::lock_guard<std::mutex> lck(tc_mtx);
+		auto& mine = prefetches[peer];
+		mine.insert(mine.end(), jobs.begin(), jobs.end());
 	}
+}
 
-	avctx->flags |= AV_CODEC_FLAG_QSCALE;
-	avctx->channels = 2;
-	avctx->cutoff = 0;
-	avctx->channel_layout = av_get_default_channel_layout(2);
-	avctx->sample_rate = OUTPUT_SAMPLE_RATE;
-	avctx->sample_fmt = AV_SAMPLE_FMT_S16P;
-	avctx->global_quality = quality * FF_QP2LAMBDA;
-	stream->time_base.den = OUTPUT_SAMPLE_RATE;
-	stream->time_base.num = 1;
-
-	if ((*out_fmt_ctx)->oformat->flags & AVFMT_GLOBALHEADER)
-		avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+// Whether a transcode started now would have to wait, or the machine is too busy to take one on.
+bool surf_server::overloaded()
+{
+	if (tcp.saturated(overload_queue))
+		return true;
+	double load;
+	return overload_load > 0 && getloadavg(&load, 1) == 1 && load >= overload_load * std::max(1U, std::thread::hardware_concurrency());
+}
 
-	if ((err = avcodec_open2(avctx, out_codec, nullptr)) < 0) {
-		std::cerr << "tc fail_open_out : " << av_err2str(err) << std::endl;
-		goto cleanup;
-	}
-	if ((err = avcodec_parameters_from_context(stream->codecpar, avctx)) < 0) {
-		std::cerr << "tc par4ctx" << std::endl;
-		goto cleanup;
+/* Serves a variant of the track within tolerance of the quality asked for that can start at once:
+ * cached or sent as the original file, or else one already being transcoded. The nearest comes
+ * first, and the better of two as near. Returns false if there is none. */
+bool surf_server::stream_neighbour(http_server::session* sn, const std::string& track_uuid, const track_source& track, int quality, int tolerance, const tc_format *fmt)
+{
+	std::vector<int> near;
+	for (int d = 1; d <= tolerance; d++) {
+		if (quality - d >= 0)
+			near.push_back(quality - d);
+		if (quality + d <= 9)
+			near.push_back(quality + d);
+	}
+
+	for (int q : near) {
+		if (is_passthrough(track, q, fmt)) {
+			track_started(sn, track_uuid, quality, fmt, false);
+			api_v1_stream_file(sn, track.path, "audio/mpeg", "orig");
+			return true;
+		}
+		// Only the variant served counts as a cache hit.
+		if (!mdb.has_cached_transcode(tc_job::key(track_uuid, q, fmt)))
+			continue;
+		auto cached = mdb.get_cached_transcode(tc_job::key(track_uuid, q, fmt));
+		if (cached.second) {
+			sn->set_response_header("X-Surf-Quality", std::to_string(q));
+			track_started(sn, track_uuid, quality, fmt, false);
+			api_v1_stream_cached(sn, cached.first, fmt);
+			return true;
+		}
 	}
 
-	*out_codec_ctx = avctx;
-	return 0;
-
-cleanup:
-	avcodec_free_context(&avctx);
-	av_free((*out_fmt_ctx)->pb->buffer);
-	avio_context_free(&(*out_fmt_ctx)->pb);
-	avformat_free_context(*out_fmt_ctx);
-	*out_fmt_ctx = nullptr;
-	return err < 0 ? err : AVERROR_EXIT;
+	for (int q : near) {
+		std::shared_ptr<tc_job> job;
+		{
+			std::lock_guard<std::mutex> lck(tc_mtx);
+			auto it = tc_jobs.find(tc_job::key(track_uuid, q, fmt));
+			if (it != tc_jobs.end() && it->second->attach()) {
+				job = it->second;
+				promote_job(job, TC_INTERACTIVE);
+			}
+		}
+		if (job) {
+			sn->set_response_header("X-Surf-Quality", std::to_string(q));
+			track_started(sn, track_uuid, quality, fmt, false);
+			api_v1_stream_job(sn, job);
+			return true;
+		}
+	}
+	return false;
 }
 
-static int init_resampler(AVCodecContext *in_codec_ctx, AVCodecContext *out_codec_ctx, SwrContext **resample_ctx)
+/* Someone wants job, or the job it branches off, sooner. A warm-up job still waiting moves over to
+ * the main pool, and one already running gets its thread's nice level back. Called with tc_mtx held. */
+void surf_server::promote_job(std::shared_ptr<tc_job> job, tc_priority priority)
 {
-	int err;
-	*resample_ctx = swr_alloc_set_opts(nullptr,
-					   av_get_default_channel_layout(out_codec_ctx->channels),
-					   out_codec_ctx->sample_fmt, // AV_SAMPLE_FMT_S16P
-					   out_codec_ctx->sample_rate,
-					   av_get_default_channel_layout(in_codec_ctx->channels),
-					   in_codec_ctx->sample_fmt,
-					   in_codec_ctx->sample_rate,
-					   0, nullptr);
-	if (*resample_ctx == nullptr)
-		return AVERROR(ENOMEM);
-	if ((err = swr_init(*resample_ctx)) < 0) {
-		std::cerr << "tc resample_init : " << av_err2str(err) << std::endl;
-		swr_free(resample_ctx);
-		return err;
-	}
-	return 0;
+	if (auto host = job->host.lock())
+		job = host;
+	if (priority >= job->priority)
+		return;
+	if (job->priority != TC_WARMUP || !warmup_pool.withdraw(job)) {
+		if (!warmup_renice(job.get()))
+			tcp.promote(job, priority);
+		return;
+	}
+
+	job->priority = priority;
+	if (!tcp.submit(job)) {
+		// The main pool is full; leave it where it was. The slot it left is still free under tc_mtx.
+		job->priority = TC_WARMUP;
+		warmup_pool.submit(job);
+	}
 }
 
-static int init_fifo(AVAudioFifo **fifo, AVCodecContext *out_codec_ctx)
+/* Returns the job registered for the same output, or registers this one: as a branch of a job
+ * for another output of the same track that has not started yet, or else in the pool. A listener
+ * is attached to whichever it is if listen is set. Returns nullptr if the pool is full. */
+std::shared_ptr<tc_job> surf_server::attach_or_submit(std::shared_ptr<tc_job> job, bool listen)
 {
-	if ((*fifo = av_audio_fifo_alloc(out_codec_ctx->sample_fmt, out_codec_ctx->channels, 1)) == nullptr)
-		return AVERROR(ENOMEM);
-	else
-		return 0;
+	const std::string key = job->key();
+	std::lock_guard<std::mutex> lck(tc_mtx);
+	auto it = tc_jobs.find(key);
+	if (it != tc_jobs.end() && (!listen || it->second->attach())) {
+		if (listen)
+			promote_job(it->second, job->priority);
+		return it->second;
+	}
+
+	if (listen)
+		job->attach();
+	if (job->full_length() && job->branches.empty()) {
+		const std::string prefix = job->track_uuid + ".";
+		for (auto h = tc_jobs.lower_bound(prefix); h != tc_jobs.end() && h->first.compare(0, prefix.size(), prefix) == 0; ++h) {
+			auto& host = h->second;
+			if (host->full_length() && host->host.expired() && !host->started && !host->cancelled && host->branches.size() < TC_MAX_BRANCHES) {
+				job->host = host;
+				host->branches.push_back(job);
+				promote_job(host, job->priority);
+				tc_jobs[key] = job;
+				return job;
+			}
+		}
+	}
+
+	// A job may come with branches of its own; leave out any that are already being made.
+	job->branches.erase(std::remove_if(job->branches.begin(), job->branches.end(), [this](const auto& b) {
+		return tc_jobs.find(b->key()) != tc_jobs.end();
+	}), job->branches.end());
+	if (!tcp.submit(job))
+		return nullptr;
+	tc_jobs[key] = job;
+	for (auto& b : job->branches) {
+		b->host = job;
+		tc_jobs[b->key()] = b;
+	}
+	return job;
 }
 
-static int decode_audio_frame(AVFrame *frame, AVFormatContext *in_fmt_ctx, AVCodecContext *in_codec_ctx, int *data_present, bool *finished)
+static bool hls_params(http_server::session* sn, int& quality, const tc_format*& fmt)
 {
-	AVPacket in_pkt;
-	int error;
-	av_init_packet(&in_pkt);
-	in_pkt.data = NULL;
-	in_pkt.size = 0;
-
-	if ((error = av_read_frame(in_fmt_ctx, &in_pkt)) < 0) {
-		if (error == AVERROR_EOF)
-			*finished = true;
-		else {
-			std::cerr << "tc read_frame : " << av_err2str(error) << std::endl;
-			return error;
+	quality = 6;
+	if (auto qs = sn->request_param("q"); qs.has_value()) {
+		try {
+			quality = std::stoul(qs.value());
+		} catch (...) {
+			quality = -1;
 		}
 	}
-	if ((error = avcodec_send_packet(in_codec_ctx, &in_pkt)) < 0) {
-		std::cerr << "tc send_packet_decode : " << av_err2str(error) << std::endl;
-		return error;
+	if (quality < 0 || quality > 9) {
+		sn->serve_error(400, "Unexpected value for parameter 'q' (should be an integer from 0-9)\r\n");
+		return false;
 	}
-
-	error = avcodec_receive_frame(in_codec_ctx, frame);
-	if (error == AVERROR(EAGAIN)) { // no data is present.
-		error = 0;
-	} else if (error == AVERROR_EOF) { // we're done
-		*finished = 1;
-		error = 0;
-	} else if (error < 0) { // something bad happened
-		std::cerr << "tc fail_decode : " << av_err2str(error) << std::endl;
-	} else { // nothing bad happened, data is present
-		*data_present = 1;
+	if ((fmt = find_hls_format(sn->request_param("fmt").value_or("mp3"))) == nullptr) {
+		sn->serve_error(400, "Unexpected value for parameter 'fmt' (should be mp3 or aac)\r\n");
+		return false;
 	}
-	av_packet_unref(&in_pkt);
-	return error;
+	return true;
 }
 
-static int init_converted_samples(uint8_t ***conv_in_samples, AVCodecContext *out_codec_ctx, int in_samples)
+static int hls_segments(const track_source& track)
 {
-	int err;
-	if ((*conv_in_samples = (uint8_t **) calloc(out_codec_ctx->channels, sizeof(**conv_in_samples))) == nullptr)
-		return AVERROR(ENOMEM);
-
-	if ((err = av_samples_alloc(*conv_in_samples, nullptr, out_codec_ctx->channels, in_samples, out_codec_ctx->sample_fmt, 0)) < 0) {
-		av_freep(&(*conv_in_samples)[0]);
-		free(*conv_in_samples);
-		return err;
-	}
-	return 0;
+	return (track.duration_ms + HLS_SEGMENT_MS - 1) / HLS_SEGMENT_MS;
 }
 
-static int convert_samples(const uint8_t **in_data, uint8_t **conv_data, const int in_samples, const int out_samples, SwrContext *resample_ctx)
+static std::shared_ptr<tc_job> segment_job(const std::string& track_uuid, const track_source& track, int quality, const tc_format *fmt, int segment, tc_priority priority)
 {
-	int rc;
-	if ((rc = swr_convert(resample_ctx, conv_data, out_samples, in_data, in_samples)) < 0)
-		std::cerr << "tc fail_conv_input : " << av_err2str(rc) << std::endl;
-
-	return rc;
+	auto job = std::make_shared<tc_job>(track_uuid, track.path, quality, fmt, priority);
+	job->segment = segment;
+	job->start_ms = segment * HLS_SEGMENT_MS;
+	// The last segment runs to the end, however long the scan thought the track was.
+	if (segment < hls_segments(track) - 1)
+		job->end_ms = (segment + 1) * HLS_SEGMENT_MS;
+	return job;
 }
 
-static int add_samples_to_fifo(AVAudioFifo *fifo, uint8_t **conv_samples, const int frame_size)
+void surf_server::prefetch_segment(const std::string& track_uuid, const track_source& track, int quality, const tc_format *fmt, int segment)
 {
-	int err;
-	if ((err = av_audio_fifo_realloc(fifo, av_audio_fifo_size(fifo) + frame_size)) < 0)
-		return err;
-
-	if (av_audio_fifo_write(fifo, (void **) conv_samples, frame_size) < frame_size) {
-		std::cerr << "tc write_fifo : " << std::endl;
-		return AVERROR_EXIT;
-	}
-	return 0;
+	if (!mdb.has_cached_transcode(tc_job::key(track_uuid, quality, fmt, segment)))
+		attach_or_submit(segment_job(track_uuid, track, quality, fmt, segment, TC_PREFETCH), false);
 }
 
-static int read_decode_convert_store(AVAudioFifo *fifo, AVFormatContext *in_fmt_ctx, AVCodecContext *in_codec_ctx, AVCodecContext *out_codec_ctx, SwrContext *resample_ctx, bool *finished)
+/* A track split into segments that are encoded independently, so a seek only waits for the
+ * segment it lands in, and the segments after the one playing are encoded in parallel. */
+void surf_server::api_v1_hls_playlist(http_server::session* sn, const std::string& track_uuid)
 {
-	AVFrame *in_frame = nullptr;
-	uint8_t **conv_in_samples = nullptr;
-	int data_present = 0, ret = AVERROR_EXIT;
-
-	if ((in_frame = av_frame_alloc()) == nullptr) {
-		ret = AVERROR(ENOMEM);
-		goto cleanup;
-	}
-	if (decode_audio_frame(in_frame, in_fmt_ctx, in_codec_ctx, &data_present, finished) != 0)
-		goto cleanup;
-
-	if (*finished) {
-		ret = 0;
-		goto cleanup;
-	}
-
-	if (data_present) {
-		int max_out_samples = av_rescale_rnd(swr_get_delay(resample_ctx, in_codec_ctx->sample_rate) + in_frame->nb_samples, out_codec_ctx->sample_rate, in_codec_ctx->sample_rate, AV_ROUND_UP);
-		int real_out_samples;
-		if (init_converted_samples(&conv_in_samples, out_codec_ctx, max_out_samples) != 0)
-			goto cleanup;
-		if ((real_out_samples = convert_samples((const uint8_t **) in_frame->extended_data, conv_in_samples, in_frame->nb_samples, max_out_samples, resample_ctx)) < 0)
-			goto cleanup;
-		if (add_samples_to_fifo(fifo, conv_in_samples, real_out_samples))
-			goto cleanup;
-		ret = 0;
-	}
-	ret = 0;
-
-cleanup:
-	if (conv_in_samples != nullptr) {
-		av_freep(&conv_in_samples[0]);
-		free(conv_in_samples);
-	}
-	av_frame_free(&in_frame);
-	return ret;
+	int quality;
+	const tc_format *fmt;
+	if (!hls_params(sn, quality, fmt))
+		return;
+
+	auto track = mdb.get_track(track_uuid);
+	if (!track || track->duration_ms <= 0)
+		return sn->serve_error(404, "Not Found\r\n");
+
+	const int segments = hls_segments(*track);
+	std::stringstream ss;
+	ss << "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-MEDIA-SEQUENCE:0\n"
+		<< "#EXT-X-TARGETDURATION:" << (HLS_SEGMENT_MS + 999) / 1000 << "\n";
+	for (int i = 0; i < segments; i++) {
+		const int64_t len = std::min(HLS_SEGMENT_MS, track->duration_ms - i * HLS_SEGMENT_MS);
+		ss << "#EXTINF:" << std::fixed << std::setprecision(3) << len / 1000.0 << ",\n"
+			<< i << ".ts?q=" << quality << "&fmt=" << fmt->name << "\n";
+	}
+	ss << "#EXT-X-ENDLIST\n";
+
+	// The player asks for these next.
+	for (int i = 0; i < std::min(HLS_AHEAD, segments); i++)
+		prefetch_segment(track_uuid, *track, quality, fmt, i);
+
+	std::string s = ss.str();
+	sn->set_status_code(200);
+	sn->set_response_header("Cache-Control", "public; max-age=86400");
+	sn->set_response_header("Content-type", "application/vnd.apple.mpegurl");
+	sn->set_response_header("Content-length", std::to_string(s.length()));
+	sn->write(s.c_str(), s.length());
 }
 
-static int init_output_frame(AVFrame **frame, AVCodecContext *out_codec_ctx, int frame_size)
+void surf_server::api_v1_hls_segment(http_server::session* sn, const std::string& track_uuid, int segment)
 {
-	int error;
-	if ((*frame = av_frame_alloc()) == nullptr)
-		return AVERROR(ENOMEM);
+	int quality;
+	const tc_format *fmt;
+	if (!hls_params(sn, quality, fmt))
+		return;
 
-	(*frame)->nb_samples = frame_size;
-	(*frame)->channel_layout = out_codec_ctx->channel_layout;
-	(*frame)->format = out_codec_ctx->sample_fmt;
-	(*frame)->sample_rate = out_codec_ctx->sample_rate;
+	auto track = mdb.get_track(track_uuid);
+	if (!track || segment >= hls_segments(*track))
+		return sn->serve_error(404, "Not Found\r\n");
 
-	if ((error = av_frame_get_buffer(*frame, 0)) < 0) {
-		av_frame_free(frame);
-		return error;
-	}
-	return 0;
+	std::shared_ptr<tc_job> job;
+	auto cached = mdb.get_cached_transcode(tc_job::key(track_uuid, quality, fmt, segment));
+	if (!cached.second && !(job = attach_or_submit(segment_job(track_uuid, *track, quality, fmt, segment, TC_INTERACTIVE), true)))
+		return serve_busy(sn);
+
+	for (int i = segment + 1; i <= segment + HLS_AHEAD && i < hls_segments(*track); i++)
+		prefetch_segment(track_uuid, *track, quality, fmt, i);
+
+	if (job)
+		api_v1_stream_job(sn, job);
+	else
+		api_v1_stream_cached(sn, cached.first, fmt);
 }
 
-static int encode_audio_frame(AVFrame *frame, AVFormatContext *out_fmt_ctx, AVCodecContext *out_codec_ctx, uint64_t *pts, int *data_present)
+void surf_server::api_v1_stream_job(http_server::session* sn, std::shared_ptr<tc_job> job)
 {
-	AVPacket out_pkt;
-	int err;
-	av_init_packet(&out_pkt);
-	out_pkt.data = NULL;
-	out_pkt.size = 0;
-
-	if (frame) {
-		frame->pts = *pts;
-		*pts += frame->nb_samples;
-	}
-
-	err = avcodec_send_frame(out_codec_ctx, frame);
-	if (err == AVERROR_EOF) {
-		err = 0;
-		goto cleanup;
-	} else if (err < 0) {
-		std::cerr << "tc send_pkt_encode : " << av_err2str(err) << std::endl;
-		return err;
-	}
-
-	err = avcodec_receive_packet(out_codec_ctx, &out_pkt);
-	if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) { // needs more data, OR done (no data to return)
-		err = 0;
-		goto cleanup;
-	} else if (err < 0) {
-		std::cerr << "tc encode_frame : " << av_err2str(err) << std::endl;
-		goto cleanup;
-	} else {
-		*data_present = 1;
-	}
+	std::vector<char> buf;
+	size_t offset = 0;
+	bool connected = true;
+
+	while (connected && job->read(offset, buf, chunk_bytes, std::chrono::steady_clock::now() + chunk_delay)) {
+		if (offset == 0) {
+			sn->set_status_code(200);
+			sn->set_response_header("Accept-Ranges", "bytes");
+			sn->set_response_header("Content-type", job->fmt->mime);
+			sn->set_response_header("Transfer-Encoding", "chunked");
+			if (job->start_ms > 0 && job->segment < 0) {
+				// Where a seek lands depends on the source's frames; never cache it as the whole track.
+				sn->set_response_header("Cache-Control", "no-store");
+				sn->set_response_header("X-Surf-Start-Ms", std::to_string(job->start_ms));
+			} else {
+				sn->set_response_header("Cache-Control", "public; max-age=31536000");
+			}
+		}
 
-	if (*data_present && (err = av_write_frame(out_fmt_ctx, &out_pkt)) < 0) {
-		std::cerr << "tc write_frame : " << av_err2str(err) << std::endl;
-		goto cleanup;
+		connected = sn->write_chunk(buf.data(), buf.size());
+		offset += buf.size();
 	}
+	job->detach();
 
-cleanup:
-	av_packet_unref(&out_pkt);
-	return err;
+	if (!connected) {
+		sn->socket().shutdown();
+	} else if (job->error == 0) {
+		sn->write_chunk(nullptr, 0);
+	} else if (offset == 0) {
+		sn->serve_error(500, job->error_msg);
+	} else {
+		// Too late for an error status; cut the stream short instead of terminating it.
+		sn->socket().shutdown();
+	}
 }
 
-static int load_encode_write(AVAudioFifo *fifo, AVFormatContext *out_fmt_ctx, AVCodecContext *out_codec_ctx, uint64_t *pts)
+// The whole file, or from a frame to the end. The frame is where the time asked for starts, or
+// the nearest before it that the index has.
+void surf_server::api_v1_stream_cached(http_server::session* sn, const std::string& path_to_tc, const tc_format *fmt, const seek_point *from)
 {
-	AVFrame *out_frame;
-	const int frame_size = FFMIN(av_audio_fifo_size(fifo), out_codec_ctx->frame_size);
-	int err, data_written;
-	if ((err = init_output_frame(&out_frame, out_codec_ctx, frame_size)) != 0)
-		return err;
+	if (from == nullptr)
+		return api_v1_stream_file(sn, path_to_tc, fmt->mime, "");
 
-	if (av_audio_fifo_read(fifo, (void **) out_frame->data, frame_size) < frame_size) {
-		std::cerr << "tc read_fifo" << std::endl;
-		av_frame_free(&out_frame);
-		return AVERROR_EXIT;
+	int fd = open(path_to_tc.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) <= from->offset) {
+		if (fd >= 0)
+			close(fd);
+		return sn->serve_error(500, "Failed to open file\r\n");
 	}
 
-	err = encode_audio_frame(out_frame, out_fmt_ctx, out_codec_ctx, pts, &data_written);
-	av_frame_free(&out_frame);
-	return err != 0 ? AVERROR_EXIT : 0;
+	const size_t length = st.st_size - from->offset;
+	sn->set_status_code(200);
+	sn->set_response_header("Content-type", fmt->mime);
+	sn->set_response_header("Content-length", std::to_string(length));
+	sn->set_response_header("Cache-Control", "no-store");
+	sn->set_response_header("X-Surf-Start-Ms", std::to_string(from->ms));
+	sn->send_file(fd, from->offset, length);
+	close(fd);
 }
 
-static void cache_transcode(const std::string& tc_path, FILE* tc_src)
+void surf_server::api_v1_stream_file(http_server::session* sn, const std::string& path, const std::string& content_type, const std::string& quality)
 {
-	std::vector<char> cbuf(16384);
-	std::ofstream cs(tc_path, std::ios::out | std::ios::binary);
-	std::rewind(tc_src);
-
-	while (std::feof(tc_src) == false) {
-		size_t res = std::fread(cbuf.data(), 1, cbuf.size(), tc_src);
-		if (res < cbuf.size() && std::ferror(tc_src)) {
-			perror("could not copy data from tempfile to cachefile");
-			abort();
-		}
-		cs.write(cbuf.data(), res);
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close(fd);
+		static const std::string msg = "Failed to open file\r\n";
+		sn->set_status_code(500);
+		sn->set_response_header("Cache-Control", "no-store");
+		sn->set_response_header("Content-type", "text/plain");
+		sn->set_response_header("Content-length", std::to_string(msg.length()));
+		sn->write(msg.c_str(), msg.length());
+		return;
 	}
-	std::fclose(tc_src);
-	cs.close();
-}
+	const size_t size = st.st_size;
 
-void surf_server::api_v1_transcode(http_server::session* sn, const std::string& track_uuid, const std::string& track_path, int quality)
-{
-	AVFormatContext *in_fmt_ctx = nullptr, *out_fmt_ctx = nullptr;
-	AVCodecContext *in_codec_ctx = nullptr, *out_codec_ctx = nullptr;
-	AVAudioFifo *fifo = nullptr;
-	SwrContext *resample_ctx = nullptr;
-	uint64_t pts = 0;
-	int ret = AVERROR_EXIT;
-	tc_out_mux_t out;
-	out.sn = sn;
-	out.cache_fp = std::tmpfile();
+	// Handle a range request, if we got one: "a-b", "a-" or the last n bytes as "-n".
+	auto range_hdr = sn->request_header("range");
+	size_t first = 0, last = size - 1;
+	bool ranged = false, satisfiable = size > 0;
+	if (range_hdr) {
+		std::smatch rsm;
+		if (!std::regex_match(range_hdr.value(), rsm, std::regex(R"(bytes=(\d*)-(\d*))")) || (rsm[1].length() == 0 && rsm[2].length() == 0)) {
+			close(fd);
+			return sn->serve_error(400, "malformed range request\r\n");
+		}
 
-	if ((ret = open_input_file(track_path, &in_fmt_ctx, &in_codec_ctx)) != 0) {
-		sn->serve_error(500, "failed to open file for transcoding\r\n");
-		goto end;
-	}
-	if ((ret = open_output(&out_fmt_ctx, &out_codec_ctx, &out, quality)) != 0) {
-		sn->serve_error(500, "failed to open output\r\n");
-		goto end;
-	}
-	if ((ret = init_resampler(in_codec_ctx, out_codec_ctx, &resample_ctx)) != 0) {
-		sn->serve_error(500, "failed to open resampler\r\n");
-		goto end;
+		ranged = true;
+		if (rsm[1].length() == 0) {
+			size_t n = strtoull(rsm[2].str().c_str(), nullptr, 10);
+			first = n < size ? size - n : 0;
+			satisfiable = satisfiable && n > 0;
+		} else {
+			first = strtoull(rsm[1].str().c_str(), nullptr, 10);
+			if (rsm[2].length() > 0)
+				last = std::min<size_t>(last, strtoull(rsm[2].str().c_str(), nullptr, 10));
+			satisfiable = satisfiable && first < size && first <= last;
+		}
 	}
-	if ((ret = init_fifo(&fifo, out_codec_ctx)) != 0) {
-		sn->serve_error(500, "failed to allocate buffer\r\n");
-		goto end;
+
+	if (ranged && !satisfiable) {
+		close(fd);
+		sn->set_status_code(416);
+		sn->set_response_header("Cache-Control", "no-store");
+		sn->set_response_header("Content-length", "0");
+		sn->set_response_header("Content-range", "bytes */" + std::to_string(size));
+		sn->write_headers();
+		return;
 	}
 
-	sn->set_status_code(200);
 	sn->set_response_header("Accept-Ranges", "bytes");
-	sn->set_response_header("Content-type", "audio/mpeg");
-	sn->set_response_header("Cache-Control", "public; max-age=31536000");
-	sn->set_response_header("Transfer-Encoding", "chunked");
-	if ((ret = avformat_write_header(out_fmt_ctx, nullptr)) < 0) {
-		sn->serve_error(500, "failed to write to output\r\n");
-		goto end;
-	}
-
-	while (true) {
-		const int out_frame_size = out_codec_ctx->frame_size;
-		bool finished = false;
-
-		// Accumulate enough samples for the encoder.
-		while (av_audio_fifo_size(fifo) < out_frame_size) {
-			if (read_decode_convert_store(fifo, in_fmt_ctx, in_codec_ctx, out_codec_ctx, resample_ctx, &finished) != 0) {
-				sn->serve_error(500, "failed to accumulate samples\r\n");
-				goto end;
-			}
-			if (finished)
-				break;
+	sn->set_response_header("Content-type", content_type);
+	if (!quality.empty())
+		sn->set_response_header("X-Surf-Quality", quality);
+	if (ranged) {
+		std::stringstream ss;
+		ss << "bytes " << first << '-' << last << '/' << size;
+		sn->set_status_code(206);
+		sn->set_response_header("Content-range", ss.str());
+		sn->set_response_header("Content-length", std::to_string(last - first + 1));
+		sn->send_file(fd, first, last - first + 1);
+	} else {
+		sn->set_status_code(200);
+		sn->set_response_header("Content-length", std::to_string(size));
+		sn->send_file(fd, 0, size);
+	}
+	close(fd);
+}
+
+static void open_cache_file(tc_job *job, const std::string& tc_path)
+{
+	std::vector<char> tmpl(tc_path.begin(), tc_path.end());
+	const char suffix[] = ".part.XXXXXX";
+	tmpl.insert(tmpl.end(), suffix, suffix + sizeof(suffix));
+	if ((job->cache_fd = mkstemp(tmpl.data())) < 0) {
+		perror("tc fail_cache_open");
+		return;
+	}
+	job->cache_tmp = tmpl.data();
+}
+
+// Readers only ever see complete files: the temp file becomes the cache entry in one rename.
+static bool close_cache_file(tc_job *job, const std::string& tc_path, bool publish, bool sync)
+{
+	if (job->cache_fd < 0)
+		return false;
+
+	if (publish && sync && fsync(job->cache_fd) != 0) {
+		perror("tc fail_cache_sync");
+		publish = false;
+	}
+	close(job->cache_fd);
+	job->cache_fd = -1;
+	if (publish && rename(job->cache_tmp.c_str(), tc_path.c_str()) != 0) {
+		perror("tc fail_cache_rename");
+		publish = false;
+	}
+	if (!publish)
+		unlink(job->cache_tmp.c_str());
+	return publish;
+}
+
+// One output of a transcode.
+struct tc_output {
+	std::shared_ptr<tc_job> job;
+	std::string tc_path;
+	tc_sink sink;
+
+	tc_output(std::shared_ptr<tc_job> job) : job(job) {};
+};
+
+void surf_server::api_v1_transcode(std::shared_ptr<tc_job> job)
+{
+	tc_source src;
+	std::vector<std::unique_ptr<tc_output>> outs;
+	std::vector<tc_sink*> sinks;
+	const bool partial = job->start_ms > 0 && job->segment < 0;
+	const char *fail = nullptr;
+	int ret = 0;
+
+	{
+		std::lock_guard<std::mutex> lck(tc_mtx);
+		job->started = true;
+		outs.push_back(std::make_unique<tc_output>(job));
+		for (auto& b : job->branches)
+			outs.push_back(std::make_unique<tc_output>(b));
+		job->branches.clear();
+	}
+
+	for (auto& o : outs) {
+		o->tc_path = mdb.cached_transcode_path(o->job->key());
+		if (!partial && !o->job->cancelled)
+			open_cache_file(o->job.get(), o->tc_path);
+	}
+	if ((ret = src.open(job->track_path)) != 0)
+		fail = "failed to open file for transcoding\r\n";
+	else if (job->start_ms > 0 && (ret = src.seek(job->start_ms)) != 0)
+		fail = "failed to seek\r\n";
+	for (auto& o : outs) {
+		if (fail != nullptr) {
+			o->sink.fail = fail;
+			o->sink.error = ret;
+		} else if (o->job->cancelled) {
+			o->sink.fail = "transcode cancelled\r\n";
+			o->sink.error = AVERROR_EXIT;
+		} else if ((o->sink.error = o->sink.open(o->job.get(), src.codec_ctx)) != 0) {
+			o->sink.fail = "failed to open output\r\n";
+		} else {
+			sinks.push_back(&o->sink);
 		}
+	}
 
-		// Encode samples.
-		while (av_audio_fifo_size(fifo) >= out_frame_size || (finished && av_audio_fifo_size(fifo) > 0)) {
-			if (load_encode_write(fifo, out_fmt_ctx, out_codec_ctx, &pts) != 0) {
-				sn->serve_error(500, "failed to encode samples\r\n");
-				goto end;
+	// Someone waiting on a job of its own gets a second core; background work and shared decodes
+	// leave it to other jobs.
+	if (outs.size() == 1 && sinks.size() == 1 && tc_pipeline && job->priority == TC_INTERACTIVE)
+		tc_run_pipelined(src, *sinks[0]);
+	else if (!sinks.empty())
+		tc_run(src, sinks);
+
+	for (auto& o : outs) {
+		const bool ok = o->sink.complete;
+		const std::string idx_path = o->tc_path + SEEK_INDEX_SUFFIX;
+		uint64_t idx_size = 0;
+		// The index goes first, so it is there by the time anyone can find the file it indexes.
+		if (ok && o->job->cache_fd >= 0 && !o->sink.index.points.empty())
+			idx_size = write_seek_index(idx_path, o->sink.index);
+		if (close_cache_file(o->job.get(), o->tc_path, ok, cache_fsync))
+			mdb.add_cached_transcode(o->tc_path, o->job->data.size() + o->sink.xing.size() + idx_size);
+		else if (idx_size > 0)
+			unlink(idx_path.c_str());
+
+		{
+			// A cancelled job may already have been replaced by a fresh one for the same track.
+			std::lock_guard<std::mutex> lck(tc_mtx);
+			auto it = tc_jobs.find(o->job->key());
+			if (it != tc_jobs.end() && it->second == o->job)
+				tc_jobs.erase(it);
+			// Once it is done, a guess at what comes next is in the cache or never will be.
+			for (auto p = prefetches.begin(); p != prefetches.end(); ) {
+				auto& jobs = p->second;
+				jobs.erase(std::remove(jobs.begin(), jobs.end(), o->job), jobs.end());
+				p = jobs.empty() ? prefetches.erase(p) : std::next(p);
 			}
 		}
+		o->job->finish(ok ? 0 : (o->sink.error < 0 ? o->sink.error : AVERROR_EXIT), ok ? "" : o->sink.fail);
+	}
 
-		if (finished) {
-			// Flush the encoder.
-			int data_written;
-			do {
-				data_written = 0;
-				if (encode_audio_frame(nullptr, out_fmt_ctx, out_codec_ctx, &pts, &data_written) != 0) {
-					sn->serve_error(500, "failed to flush encoder\r\n");
-					goto end;
-				}
-			} while (data_written);
-			break;
-		}
+	// Only once the seek got somewhere; one that failed is likely to fail for the whole track too.
+	if (partial && outs[0]->sink.codec_ctx != nullptr &&
+		av_rescale(outs[0]->sink.pts, 1000, outs[0]->sink.codec_ctx->sample_rate) > job->start_ms)
+		complete_after_seek(job);
+}
+
+/* A seek is never cached, so queue the whole track behind everything else for the next listener
+ * to find cached. */
+void surf_server::complete_after_seek(std::shared_ptr<tc_job> job)
+{
+	const std::string key = job->key();
+	if (mdb.has_cached_transcode(key))
+		return;
+
+	std::lock_guard<std::mutex> lck(tc_mtx);
+	if (tc_jobs.find(key) == tc_jobs.end()) {
+		auto full = std::make_shared<tc_job>(job->track_uuid, job->track_path, job->quality, job->fmt, TC_WARMUP);
+		if (tcp.submit(full))
+			tc_jobs[key] = full;
 	}
-	if ((ret = av_write_trailer(out_fmt_ctx)) < 0) {
-		sn->serve_error(500, "failed to write trailer\r\n");
-		goto end;
-	}
-	sn->write("0\r\n\r\n", 5); // Send a terminal chunk.
-
-	cache_transcode(mdb.get_cached_transcode(track_uuid, quality).first, out.cache_fp);
-
-end:
-	if (fifo != nullptr)
-		av_audio_fifo_free(fifo);
-	swr_free(&resample_ctx);
-	if (out_codec_ctx != nullptr)
-		avcodec_free_context(&out_codec_ctx);
-	if (out_fmt_ctx != nullptr) {
-		av_free(out_fmt_ctx->pb->buffer);
-		avio_context_free(&out_fmt_ctx->pb);
-		avformat_free_context(out_fmt_ctx);
-	}
-	if (in_codec_ctx != nullptr)
-		avcodec_free_context(&in_codec_ctx);
-	if (in_fmt_ctx != nullptr)
-		avformat_close_input(&in_fmt_ctx);
 }
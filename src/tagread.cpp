@@ -0,0 +1,834 @@
+#include "tagread.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+constexpr size_t MPEG_SYNC_WINDOW = 65536;
+constexpr uint64_t MAX_MOOV_SIZE = 64 << 20;
+
+static inline uint16_t be16(const uint8_t *b) { return (b[0] << 8) | b[1]; }
+static inline uint32_t be24(const uint8_t *b) { return (b[0] << 16) | (b[1] << 8) | b[2]; }
+static inline uint32_t be32(const uint8_t *b) { return (uint32_t(b[0]) << 24) | (b[1] << 16) | (b[2] << 8) | b[3]; }
+static inline uint64_t be64(const uint8_t *b) { return (uint64_t(be32(b)) << 32) | be32(b + 4); }
+static inline uint32_t le32(const uint8_t *b) { return (uint32_t(b[3]) << 24) | (b[2] << 16) | (b[1] << 8) | b[0]; }
+static inline uint32_t syncsafe32(const uint8_t *b) { return (b[0] & 0x7f) << 21 | (b[1] & 0x7f) << 14 | (b[2] & 0x7f) << 7 | (b[3] & 0x7f); }
+
+static constexpr uint32_t fourcc(const char (&s)[5])
+{
+	return (uint32_t(uint8_t(s[0])) << 24) | (uint32_t(uint8_t(s[1])) << 16) | (uint32_t(uint8_t(s[2])) << 8) | uint8_t(s[3]);
+}
+
+static bool read_exact(std::ifstream& fin, void *buf, size_t n)
+{
+	return static_cast<bool>(fin.read(reinterpret_cast<char *>(buf), n));
+}
+
+static void seek_to(std::ifstream& fin, uint64_t pos)
+{
+	fin.clear();
+	fin.seekg(pos, std::ios_base::beg);
+}
+
+// Repeated keys are joined with ';', the same way FFmpeg merges repeated vorbis comments.
+static void dict_add(AVDictionary **dict, const std::string& key, const std::string& value)
+{
+	if (key.empty() || value.empty())
+		return;
+	if (av_dict_get(*dict, key.c_str(), nullptr, 0) != nullptr)
+		av_dict_set(dict, key.c_str(), ";", AV_DICT_APPEND);
+	av_dict_set(dict, key.c_str(), value.c_str(), AV_DICT_APPEND);
+}
+
+static void append_utf8(std::string& out, uint32_t cp)
+{
+	if (cp < 0x80) {
+		out.push_back(cp);
+	} else if (cp < 0x800) {
+		out.push_back(0xc0 | (cp >> 6));
+		out.push_back(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		out.push_back(0xe0 | (cp >> 12));
+		out.push_back(0x80 | ((cp >> 6) & 0x3f));
+		out.push_back(0x80 | (cp & 0x3f));
+	} else {
+		out.push_back(0xf0 | (cp >> 18));
+		out.push_back(0x80 | ((cp >> 12) & 0x3f));
+		out.push_back(0x80 | ((cp >> 6) & 0x3f));
+		out.push_back(0x80 | (cp & 0x3f));
+	}
+}
+
+static std::string latin1_to_utf8(const uint8_t *b, size_t len)
+{
+	std::string out;
+	out.reserve(len);
+	for (size_t i = 0; i < len; i++)
+		append_utf8(out, b[i]);
+	return out;
+}
+
+static std::string utf16_to_utf8(const uint8_t *b, size_t len, bool big_endian)
+{
+	std::string out;
+	if (len >= 2 && ((b[0] == 0xff && b[1] == 0xfe) || (b[0] == 0xfe && b[1] == 0xff))) {
+		big_endian = b[0] == 0xfe;
+		b += 2;
+		len -= 2;
+	}
+	for (size_t i = 0; i + 1 < len; i += 2) {
+		uint32_t cu = big_endian ? (b[i] << 8 | b[i + 1]) : (b[i + 1] << 8 | b[i]);
+		if (cu >= 0xd800 && cu < 0xdc00 && i + 3 < len) {
+			uint32_t lo = big_endian ? (b[i + 2] << 8 | b[i + 3]) : (b[i + 3] << 8 | b[i + 2]);
+			if (lo >= 0xdc00 && lo < 0xe000) {
+				cu = 0x10000 + ((cu - 0xd800) << 10) + (lo - 0xdc00);
+				i += 2;
+			}
+		}
+		append_utf8(out, cu);
+	}
+	return out;
+}
+
+/******************************** FLAC ********************************/
+
+static void parse_vorbis_comment(const uint8_t *b, size_t len, AVDictionary **dict)
+{
+	static const std::map<std::string, std::string> conv = {
+		{"ALBUMARTIST", "album_artist"},
+		{"TRACKNUMBER", "track"},
+		{"DISCNUMBER", "disc"},
+		{"DESCRIPTION", "comment"},
+	};
+	const uint8_t *end = b + len;
+	if (end - b < 4)
+		return;
+	uint32_t vendor_len = le32(b);
+	if (vendor_len > static_cast<size_t>(end - b - 4))
+		return;
+	b += 4 + vendor_len;
+	if (end - b < 4)
+		return;
+	uint32_t count = le32(b);
+	b += 4;
+
+	for (uint32_t i = 0; i < count && end - b >= 4; i++) {
+		uint32_t clen = le32(b);
+		b += 4;
+		if (clen > static_cast<size_t>(end - b))
+			return;
+		std::string comment(reinterpret_cast<const char *>(b), clen);
+		b += clen;
+
+		size_t eq = comment.find('=');
+		if (eq == std::string::npos || eq == 0)
+			continue;
+		std::string key = comment.substr(0, eq);
+		std::transform(key.begin(), key.end(), key.begin(), ::toupper);
+		auto it = conv.find(key);
+		dict_add(dict, it == conv.end() ? key : it->second, comment.substr(eq + 1));
+	}
+}
+
+static int read_flac(std::ifstream& fin, AVDictionary **dict, native_stream_info *info)
+{
+	uint8_t hdr[4], si[34];
+	uint64_t total_samples = 0;
+	unsigned sample_rate = 0;
+	bool last = false;
+
+	while (!last) {
+		if (!read_exact(fin, hdr, 4))
+			return AVERROR_INVALIDDATA;
+		last = hdr[0] & 0x80;
+		uint32_t len = be24(hdr + 1);
+		switch (hdr[0] & 0x7f) {
+		case 0: // STREAMINFO
+			if (len < sizeof(si) || !read_exact(fin, si, sizeof(si)))
+				return AVERROR_INVALIDDATA;
+			sample_rate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+			total_samples = (uint64_t(si[13] & 0x0f) << 32) | be32(si + 14);
+			fin.seekg(len - sizeof(si), std::ios_base::cur);
+			break;
+		case 4: { // VORBIS_COMMENT
+			std::vector<uint8_t> vc(len);
+			if (!read_exact(fin, vc.data(), len))
+				return AVERROR_INVALIDDATA;
+			parse_vorbis_comment(vc.data(), len, dict);
+			break;
+		}
+		case 127:
+			return AVERROR_INVALIDDATA;
+		default: // PADDING, APPLICATION, SEEKTABLE, CUESHEET, PICTURE
+			fin.seekg(len, std::ios_base::cur);
+		}
+	}
+
+	if (sample_rate == 0 || total_samples == 0)
+		return AVERROR_INVALIDDATA;
+	info->codec_id = AV_CODEC_ID_FLAC;
+	info->duration_ms = total_samples * 1000 / sample_rate;
+	return 0;
+}
+
+/******************************** MP3 ********************************/
+
+static std::string id3v2_key(const std::string& frame_id)
+{
+	static const std::map<std::string, std::string> conv = {
+		{"TALB", "album"}, {"TAL", "album"},
+		{"TCOM", "composer"},
+		{"TCON", "genre"}, {"TCO", "genre"},
+		{"TCOP", "copyright"},
+		{"TENC", "encoded_by"}, {"TEN", "encoded_by"},
+		{"TIT1", "grouping"},
+		{"TIT2", "title"}, {"TT2", "title"},
+		{"TLAN", "language"},
+		{"TPE1", "artist"}, {"TP1", "artist"},
+		{"TPE2", "album_artist"}, {"TP2", "album_artist"},
+		{"TPE3", "performer"}, {"TP3", "performer"},
+		{"TPOS", "disc"}, {"TPA", "disc"},
+		{"TPUB", "publisher"},
+		{"TRCK", "track"}, {"TRK", "track"},
+		{"TSSE", "encoder"},
+		{"TSOA", "album-sort"},
+		{"TSOP", "artist-sort"},
+		{"TSOT", "title-sort"},
+		{"TDRC", "date"},
+		{"TDRL", "date"},
+		{"TDEN", "creation_time"},
+		{"TYER", "date"}, {"TYE", "date"},
+	};
+	auto it = conv.find(frame_id);
+	return it == conv.end() ? frame_id : it->second;
+}
+
+static std::vector<std::string> id3v2_text_values(const uint8_t *b, size_t len)
+{
+	std::vector<std::string> values;
+	if (len < 1)
+		return values;
+	const uint8_t enc = b[0];
+	const size_t unit = (enc == 1 || enc == 2) ? 2 : 1;
+	b++;
+	len--;
+
+	size_t start = 0;
+	for (size_t i = 0; i + unit <= len; i += unit) {
+		bool term = unit == 1 ? b[i] == 0 : (b[i] == 0 && b[i + 1] == 0);
+		if (term || i + unit == len) {
+			size_t slen = (term ? i : i + unit) - start;
+			if (enc == 0)
+				values.push_back(latin1_to_utf8(b + start, slen));
+			else if (enc == 3)
+				values.emplace_back(reinterpret_cast<const char *>(b + start), slen);
+			else
+				values.push_back(utf16_to_utf8(b + start, slen, enc == 2));
+			start = i + unit;
+		}
+	}
+	while (!values.empty() && values.back().empty())
+		values.pop_back();
+	return values;
+}
+
+// Parses the ID3v2 tag at the current position, if there is one, and leaves the stream just past it.
+static int read_id3v2(std::ifstream& fin, AVDictionary **dict, uint64_t *tag_end)
+{
+	uint8_t hdr[10];
+	uint64_t start = fin.tellg();
+	*tag_end = start;
+	if (!read_exact(fin, hdr, 10) || memcmp(hdr, "ID3", 3) != 0) {
+		seek_to(fin, start);
+		return 0;
+	}
+
+	const int major = hdr[3], flags = hdr[5];
+	const uint64_t body_end = start + 10 + syncsafe32(hdr + 6);
+	*tag_end = body_end + ((flags & 0x10) ? 10 : 0);
+	if (major < 2 || major > 4) {
+		seek_to(fin, *tag_end);
+		return 0;
+	}
+	if (major < 4 && (flags & 0x80))
+		return AVERROR_PATCHWELCOME; // whole-tag unsynchronisation is rare; let FFmpeg deal with it
+	if (major > 2 && (flags & 0x40)) {
+		uint8_t ext[4];
+		if (!read_exact(fin, ext, 4))
+			return AVERROR_INVALIDDATA;
+		fin.seekg(major == 4 ? syncsafe32(ext) - 4 : be32(ext), std::ios_base::cur);
+	}
+
+	const size_t id_len = major == 2 ? 3 : 4, hdr_len = major == 2 ? 6 : 10;
+	std::string tyer, tdat;
+	std::vector<uint8_t> body;
+	while (true) {
+		uint64_t pos = fin.tellg();
+		if (!fin || pos + hdr_len > body_end || !read_exact(fin, hdr, hdr_len) || hdr[0] == 0)
+			break;
+
+		std::string id(reinterpret_cast<const char *>(hdr), id_len);
+		uint32_t size = major == 2 ? be24(hdr + 3) : major == 3 ? be32(hdr + 4) : syncsafe32(hdr + 4);
+		uint16_t fflags = major == 2 ? 0 : be16(hdr + 8);
+		if (pos + hdr_len + size > body_end)
+			break;
+
+		bool skip = id[0] != 'T';
+		if (major == 3 && (fflags & 0x00c0))
+			skip = true; // compressed or encrypted
+		if (major == 4 && (fflags & 0x000c))
+			skip = true;
+		if (skip) {
+			fin.seekg(size, std::ios_base::cur);
+			continue;
+		}
+
+		body.resize(size);
+		if (!read_exact(fin, body.data(), size))
+			return AVERROR_INVALIDDATA;
+		size_t off = 0;
+		if ((major == 3 && (fflags & 0x0020)) || (major == 4 && (fflags & 0x0040)))
+			off += 1; // grouping identity
+		if (major == 4 && (fflags & 0x0001))
+			off += 4; // data length indicator
+		if (major == 4 && (fflags & 0x0002)) {
+			auto out = body.begin() + off;
+			for (auto in = body.begin() + off; in != body.end(); ++in) {
+				*out++ = *in;
+				if (*in == 0xff && in + 1 != body.end() && in[1] == 0x00)
+					++in;
+			}
+			body.erase(out, body.end());
+		}
+		if (off >= body.size())
+			continue;
+
+		auto values = id3v2_text_values(body.data() + off, body.size() - off);
+		if (values.empty())
+			continue;
+		std::string key, value;
+		auto first = values.begin();
+		if (id == "TXXX" || id == "TXX") {
+			key = *first++;
+		} else {
+			key = id3v2_key(id);
+		}
+		for (auto it = first; it != values.end(); ++it)
+			value += (it == first ? "" : ";") + *it;
+
+		if (id == "TYER" || id == "TYE")
+			tyer = value;
+		else if (id == "TDAT" || id == "TDA")
+			tdat = value;
+		else
+			dict_add(dict, key, value);
+	}
+
+	if (!tyer.empty()) {
+		if (tdat.length() == 4)
+			tyer += "-" + tdat.substr(2, 2) + "-" + tdat.substr(0, 2);
+		dict_add(dict, "date", tyer);
+	}
+	seek_to(fin, *tag_end);
+	return 0;
+}
+
+static void read_id3v1(std::ifstream& fin, uint64_t file_size, AVDictionary **dict)
+{
+	static const char *keys[] = {"title", "artist", "album", "date", "comment"};
+	static const int lens[] = {30, 30, 30, 4, 30};
+	uint8_t tag[128];
+	if (file_size < 128)
+		return;
+	seek_to(fin, file_size - 128);
+	if (!read_exact(fin, tag, 128) || memcmp(tag, "TAG", 3) != 0)
+		return;
+
+	const uint8_t *b = tag + 3;
+	for (int i = 0; i < 5; i++) {
+		int len = lens[i];
+		while (len > 0 && (b[len - 1] == 0 || b[len - 1] == ' '))
+			len--;
+		dict_add(dict, keys[i], latin1_to_utf8(b, len));
+		b += lens[i];
+	}
+	if (tag[125] == 0 && tag[126] != 0)
+		dict_add(dict, "track", std::to_string(tag[126]));
+}
+
+struct mpeg_header {
+	int version; // 1 = MPEG-1, 2 = MPEG-2, 3 = MPEG-2.5
+	int bitrate, sample_rate, samples_per_frame, frame_length;
+	bool mono;
+};
+
+static bool parse_mpeg_header(const uint8_t *b, mpeg_header& h)
+{
+	static const int bitrates[2][15] = {
+		{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+	};
+	static const int sample_rates[3][3] = {
+		{44100, 48000, 32000},
+		{22050, 24000, 16000},
+		{11025, 12000, 8000},
+	};
+	if (b[0] != 0xff || (b[1] & 0xe0) != 0xe0)
+		return false;
+	const int ver_bits = (b[1] >> 3) & 3, layer_bits = (b[1] >> 1) & 3;
+	const int br_idx = b[2] >> 4, sr_idx = (b[2] >> 2) & 3, padding = (b[2] >> 1) & 1;
+	if (ver_bits == 1 || layer_bits != 1 || br_idx == 0 || br_idx == 15 || sr_idx == 3)
+		return false; // Layer III only; free-format streams are left to FFmpeg
+
+	h.version = ver_bits == 3 ? 1 : ver_bits == 2 ? 2 : 3;
+	h.bitrate = bitrates[h.version == 1 ? 0 : 1][br_idx];
+	h.sample_rate = sample_rates[h.version - 1][sr_idx];
+	h.samples_per_frame = h.version == 1 ? 1152 : 576;
+	h.frame_length = (h.samples_per_frame / 8) * h.bitrate * 1000 / h.sample_rate + padding;
+	h.mono = (b[3] >> 6) == 3;
+	return true;
+}
+
+static int read_mp3(std::ifstream& fin, uint64_t file_size, AVDictionary **dict, native_stream_info *info)
+{
+	uint64_t audio_start;
+	int err;
+	if ((err = read_id3v2(fin, dict, &audio_start)) != 0)
+		return err;
+
+	std::vector<uint8_t> buf(MPEG_SYNC_WINDOW);
+	fin.read(reinterpret_cast<char *>(buf.data()), buf.size());
+	buf.resize(fin.gcount());
+	if (buf.size() >= 4 && memcmp(buf.data(), "fLaC", 4) == 0)
+		return AVERROR_PATCHWELCOME; // FLAC behind an ID3 tag
+
+	// Find the first frame whose successor also carries a valid header.
+	mpeg_header h, next;
+	size_t off = 0;
+	for (; off + 4 <= buf.size(); off++) {
+		if (parse_mpeg_header(buf.data() + off, h) &&
+			(off + h.frame_length + 4 > buf.size() || parse_mpeg_header(buf.data() + off + h.frame_length, next)))
+			break;
+	}
+	if (off + 4 > buf.size())
+		return AVERROR_INVALIDDATA;
+	audio_start += off;
+
+	// A Xing/Info or VBRI header in the first frame gives the exact frame count.
+	const uint8_t *frame = buf.data() + off;
+	const size_t avail = buf.size() - off;
+	const size_t xing_off = 4 + (h.version == 1 ? (h.mono ? 17 : 32) : (h.mono ? 9 : 17));
+	uint64_t frames = 0, xing_bytes = 0;
+	int64_t skip_samples = 0;
+	if (avail >= xing_off + 8 && (memcmp(frame + xing_off, "Xing", 4) == 0 || memcmp(frame + xing_off, "Info", 4) == 0)) {
+		const uint32_t xflags = be32(frame + xing_off + 4);
+		size_t p = xing_off + 8;
+		if ((xflags & 1) && avail >= p + 4) {
+			frames = be32(frame + p);
+			p += 4;
+		}
+		if ((xflags & 2) && avail >= p + 4) {
+			xing_bytes = be32(frame + p);
+			p += 4;
+		}
+		p += (xflags & 4 ? 100 : 0) + (xflags & 8 ? 4 : 0);
+		if (avail >= p + 24 && memcmp(frame + p, "LAME", 4) == 0) {
+			const uint32_t pad = be24(frame + p + 21);
+			skip_samples = (pad >> 12) + (pad & 0xfff);
+		}
+	} else if (avail >= 36 + 18 && memcmp(frame + 36, "VBRI", 4) == 0) {
+		frames = be32(frame + 36 + 14);
+	}
+
+	if (av_dict_count(*dict) == 0)
+		read_id3v1(fin, file_size, dict);
+
+	uint8_t tag[3];
+	uint64_t audio_end = file_size;
+	if (file_size >= 128) {
+		seek_to(fin, file_size - 128);
+		if (read_exact(fin, tag, 3) && memcmp(tag, "TAG", 3) == 0)
+			audio_end -= 128;
+	}
+	const uint64_t audio_bytes = audio_end > audio_start ? audio_end - audio_start : 0;
+	if (frames > 0) {
+		int64_t samples = frames * h.samples_per_frame - skip_samples;
+		info->duration_ms = std::max<int64_t>(samples, 0) * 1000 / h.sample_rate;
+	} else {
+		info->duration_ms = audio_bytes * 8 / h.bitrate;
+	}
+	if (info->duration_ms <= 0)
+		return AVERROR_INVALIDDATA;
+
+	// Like FFmpeg, the bit rate of the audio alone: the Xing byte count if there is one.
+	info->codec_id = AV_CODEC_ID_MP3;
+	info->bit_rate = (xing_bytes > 0 ? xing_bytes : audio_bytes) * 8 * 1000 / info->duration_ms;
+	return 0;
+}
+
+/******************************** MP4 ********************************/
+
+struct mp4_atom {
+	uint32_t type;
+	const uint8_t *data;
+	size_t size;
+};
+
+static bool next_atom(const uint8_t *&p, const uint8_t *end, mp4_atom& a)
+{
+	if (end - p < 8)
+		return false;
+	uint64_t size = be32(p), hl = 8;
+	a.type = be32(p + 4);
+	if (size == 1) {
+		if (end - p < 16)
+			return false;
+		size = be64(p + 8);
+		hl = 16;
+	} else if (size == 0) {
+		size = end - p;
+	}
+	if (size < hl || size > static_cast<uint64_t>(end - p))
+		return false;
+	a.data = p + hl;
+	a.size = size - hl;
+	p += size;
+	return true;
+}
+
+static bool find_atom(const uint8_t *p, size_t len, uint32_t type, mp4_atom& out)
+{
+	const uint8_t *end = p + len;
+	while (next_atom(p, end, out)) {
+		if (out.type == type)
+			return true;
+	}
+	return false;
+}
+
+static bool find_path(const mp4_atom& parent, std::initializer_list<uint32_t> path, mp4_atom& out)
+{
+	out = parent;
+	for (uint32_t type : path) {
+		if (!find_atom(out.data, out.size, type, out))
+			return false;
+	}
+	return true;
+}
+
+// mvhd and mdhd share the same layout up to the duration.
+static bool read_timescale_duration(const mp4_atom& hd, uint32_t& timescale, uint64_t& duration)
+{
+	if (hd.size < 20)
+		return false;
+	if (hd.data[0] == 1) {
+		if (hd.size < 32)
+			return false;
+		timescale = be32(hd.data + 20);
+		duration = be64(hd.data + 24);
+	} else {
+		timescale = be32(hd.data + 12);
+		duration = be32(hd.data + 16);
+	}
+	return timescale != 0;
+}
+
+// The total size of a track's samples, from the sizes in its stsz.
+static uint64_t sample_bytes(const mp4_atom& stsz)
+{
+	if (stsz.size < 12)
+		return 0;
+	const uint32_t size = be32(stsz.data + 4), count = be32(stsz.data + 8);
+	if (size != 0)
+		return uint64_t(size) * count;
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < count && 12 + 4 * (i + 1) <= stsz.size; i++)
+		total += be32(stsz.data + 12 + 4 * i);
+	return total;
+}
+
+static uint32_t read_descriptor_length(const uint8_t *&p, const uint8_t *end)
+{
+	uint32_t len = 0;
+	for (int i = 0; i < 4 && p < end; i++) {
+		uint8_t c = *p++;
+		len = (len << 7) | (c & 0x7f);
+		if (!(c & 0x80))
+			break;
+	}
+	return len;
+}
+
+static AVCodecID esds_codec(const mp4_atom& esds)
+{
+	const uint8_t *p = esds.data + 4, *end = esds.data + esds.size;
+	if (p >= end || *p++ != 0x03)
+		return AV_CODEC_ID_NONE;
+	read_descriptor_length(p, end);
+	if (end - p < 3)
+		return AV_CODEC_ID_NONE;
+	uint8_t es_flags = p[2];
+	p += 3;
+	if (es_flags & 0x80)
+		p += 2;
+	if ((es_flags & 0x40) && p < end)
+		p += 1 + *p;
+	if (es_flags & 0x20)
+		p += 2;
+	if (end - p < 3 || *p++ != 0x04)
+		return AV_CODEC_ID_NONE;
+	read_descriptor_length(p, end);
+
+	switch (*p) {
+	case 0x40: case 0x66: case 0x67: case 0x68:
+		return AV_CODEC_ID_AAC;
+	case 0x69: case 0x6b:
+		return AV_CODEC_ID_MP3;
+	default:
+		return AV_CODEC_ID_NONE;
+	}
+}
+
+static AVCodecID sample_entry_codec(const mp4_atom& entry)
+{
+	switch (entry.type) {
+	case fourcc("alac"):
+		return AV_CODEC_ID_ALAC;
+	case fourcc("fLaC"):
+		return AV_CODEC_ID_FLAC;
+	case fourcc("Opus"):
+		return AV_CODEC_ID_OPUS;
+	case fourcc(".mp3"):
+		return AV_CODEC_ID_MP3;
+	case fourcc("mp4a"): {
+		// Audio sample entry: 28 bytes of fixed fields, plus the QuickTime v1/v2 extensions.
+		if (entry.size < 28)
+			return AV_CODEC_ID_NONE;
+		const uint16_t version = be16(entry.data + 8);
+		const size_t children = 28 + (version == 1 ? 16 : version == 2 ? 36 : 0);
+		mp4_atom esds;
+		if (entry.size < children || !find_atom(entry.data + children, entry.size - children, fourcc("esds"), esds))
+			return AV_CODEC_ID_NONE;
+		return esds_codec(esds);
+	}
+	default:
+		return AV_CODEC_ID_NONE;
+	}
+}
+
+static void read_ilst_item(const mp4_atom& item, AVDictionary **dict)
+{
+	static const std::map<uint32_t, std::string> conv = {
+		{fourcc("\xa9nam"), "title"},
+		{fourcc("\xa9" "ART"), "artist"},
+		{fourcc("aART"), "album_artist"},
+		{fourcc("\xa9" "alb"), "album"},
+		{fourcc("\xa9" "day"), "date"},
+		{fourcc("\xa9gen"), "genre"},
+		{fourcc("\xa9wrt"), "composer"},
+		{fourcc("\xa9" "cmt"), "comment"},
+		{fourcc("\xa9too"), "encoder"},
+		{fourcc("\xa9grp"), "grouping"},
+		{fourcc("cprt"), "copyright"},
+		{fourcc("desc"), "description"},
+		{fourcc("soal"), "sort_album"},
+		{fourcc("soar"), "sort_artist"},
+		{fourcc("soaa"), "sort_album_artist"},
+		{fourcc("sonm"), "sort_name"},
+		{fourcc("trkn"), "track"},
+		{fourcc("disk"), "disc"},
+	};
+
+	std::string key;
+	auto it = conv.find(item.type);
+	if (it != conv.end())
+		key = it->second;
+	else if (item.type != fourcc("----"))
+		return;
+
+	const uint8_t *p = item.data, *end = item.data + item.size;
+	mp4_atom child;
+	while (next_atom(p, end, child)) {
+		if (child.type == fourcc("name") && child.size > 4) {
+			key.assign(reinterpret_cast<const char *>(child.data + 4), child.size - 4);
+		} else if (child.type == fourcc("data") && child.size >= 8 && !key.empty()) {
+			const uint32_t data_type = be32(child.data) & 0xffffff;
+			const uint8_t *v = child.data + 8;
+			const size_t vlen = child.size - 8;
+			if (item.type == fourcc("trkn") || item.type == fourcc("disk")) {
+				if (vlen < 6)
+					continue;
+				std::string n = std::to_string(be16(v + 2));
+				if (be16(v + 4) != 0)
+					n += "/" + std::to_string(be16(v + 4));
+				dict_add(dict, key, n);
+			} else if (data_type == 1) {
+				dict_add(dict, key, std::string(reinterpret_cast<const char *>(v), vlen));
+			} else if (data_type == 2) {
+				dict_add(dict, key, utf16_to_utf8(v, vlen, true));
+			}
+		}
+	}
+}
+
+/* Reads the header of the top-level atom at pos: its type, and the sizes of its header and of the
+ * whole atom. Returns false if there is none there, or if it is shorter than its header or runs
+ * past the end of the file, as in a corrupt or truncated file. */
+static bool read_top_atom(std::ifstream& fin, uint64_t file_size, uint64_t pos, uint32_t& type, uint64_t& hl, uint64_t& size)
+{
+	uint8_t hdr[16];
+	seek_to(fin, pos);
+	if (!read_exact(fin, hdr, 8))
+		return false;
+	type = be32(hdr + 4);
+	size = be32(hdr);
+	hl = 8;
+	if (size == 1) {
+		if (!read_exact(fin, hdr + 8, 8))
+			return false;
+		size = be64(hdr + 8);
+		hl = 16;
+	} else if (size == 0) {
+		size = file_size - pos;
+	}
+	return size >= hl && size <= file_size - pos;
+}
+
+/* Fragmented files keep their sample sizes in each fragment rather than in moov. Short of reading
+ * every fragment, they are taken to be all that follows moov, less the mfra index that some files
+ * end with; its mfro trailer gives its size. */
+static uint64_t fragment_bytes(std::ifstream& fin, uint64_t file_size, uint64_t moov_end)
+{
+	uint8_t mfro[16];
+	uint64_t end = file_size;
+	if (file_size - moov_end >= 16) {
+		seek_to(fin, file_size - 16);
+		if (read_exact(fin, mfro, 16) && be32(mfro) == 16 && be32(mfro + 4) == fourcc("mfro")) {
+			const uint64_t mfra_size = be32(mfro + 12);
+			uint64_t hl, size;
+			uint32_t type;
+			if (mfra_size >= 16 && mfra_size <= file_size - moov_end &&
+				read_top_atom(fin, file_size, file_size - mfra_size, type, hl, size) && type == fourcc("mfra") && size == mfra_size)
+				end -= mfra_size;
+		}
+	}
+	return end - moov_end;
+}
+
+static int read_mp4(std::ifstream& fin, uint64_t file_size, AVDictionary **dict, native_stream_info *info)
+{
+	std::vector<uint8_t> moov_buf;
+	uint64_t pos = 0;
+
+	// Walk the top-level atoms, seeking over mdat, until moov turns up.
+	while (moov_buf.empty() && pos + 8 <= file_size) {
+		uint64_t hl, size;
+		uint32_t type;
+		if (!read_top_atom(fin, file_size, pos, type, hl, size))
+			return AVERROR_INVALIDDATA;
+
+		if (type == fourcc("moov")) {
+			if (size - hl > MAX_MOOV_SIZE)
+				return AVERROR_PATCHWELCOME;
+			moov_buf.resize(size - hl);
+			if (!read_exact(fin, moov_buf.data(), moov_buf.size()))
+				return AVERROR_INVALIDDATA;
+		}
+		pos += size;
+	}
+	if (moov_buf.empty())
+		return AVERROR_INVALIDDATA;
+
+	const mp4_atom moov = {fourcc("moov"), moov_buf.data(), moov_buf.size()};
+	AVCodecID codec_id = AV_CODEC_ID_NONE;
+	uint32_t timescale = 0;
+	uint64_t duration = 0, audio_bytes = 0;
+
+	const uint8_t *p = moov.data, *end = moov.data + moov.size;
+	mp4_atom trak;
+	while (codec_id == AV_CODEC_ID_NONE && next_atom(p, end, trak)) {
+		mp4_atom hdlr, mdhd, stsd;
+		if (trak.type != fourcc("trak") ||
+			!find_path(trak, {fourcc("mdia"), fourcc("hdlr")}, hdlr) || hdlr.size < 12 ||
+			be32(hdlr.data + 8) != fourcc("soun"))
+			continue;
+		if (!find_path(trak, {fourcc("mdia"), fourcc("mdhd")}, mdhd) || !read_timescale_duration(mdhd, timescale, duration))
+			continue;
+		if (!find_path(trak, {fourcc("mdia"), fourcc("minf"), fourcc("stbl"), fourcc("stsd")}, stsd) || stsd.size < 8)
+			continue;
+
+		const uint8_t *ep = stsd.data + 8;
+		mp4_atom entry, stsz;
+		if (next_atom(ep, stsd.data + stsd.size, entry))
+			codec_id = sample_entry_codec(entry);
+		if (codec_id != AV_CODEC_ID_NONE && find_path(trak, {fourcc("mdia"), fourcc("minf"), fourcc("stbl"), fourcc("stsz")}, stsz))
+			audio_bytes = sample_bytes(stsz);
+	}
+	if (codec_id == AV_CODEC_ID_NONE)
+		return AVERROR_PATCHWELCOME;
+	if (duration == 0) {
+		// Fragmented files leave the track duration empty; the movie header may still have it.
+		mp4_atom mvhd;
+		if (!find_atom(moov.data, moov.size, fourcc("mvhd"), mvhd) || !read_timescale_duration(mvhd, timescale, duration) || duration == 0)
+			return AVERROR_PATCHWELCOME;
+	}
+
+	mp4_atom meta, ilst;
+	if (find_path(moov, {fourcc("udta"), fourcc("meta")}, meta) && meta.size > 12) {
+		// iTunes writes meta as a full box; QuickTime does not.
+		size_t skip = memcmp(meta.data + 4, "hdlr", 4) == 0 ? 0 : 4;
+		if (find_atom(meta.data + skip, meta.size - skip, fourcc("ilst"), ilst)) {
+			const uint8_t *ip = ilst.data, *iend = ilst.data + ilst.size;
+			mp4_atom item;
+			while (next_atom(ip, iend, item))
+				read_ilst_item(item, dict);
+		}
+	}
+
+	info->codec_id = codec_id;
+	info->duration_ms = duration * 1000 / timescale;
+	// FFmpeg reads the sample sizes of fragmented files from each fragment; pos is where moov ended.
+	if (audio_bytes == 0)
+		audio_bytes = fragment_bytes(fin, file_size, pos);
+	if (audio_bytes > 0 && info->duration_ms > 0)
+		info->bit_rate = audio_bytes * 8 * 1000 / info->duration_ms;
+	return 0;
+}
+
+int read_native_tags(const fs::path& p, AVDictionary **dict, native_stream_info *info)
+{
+	std::error_code ec;
+	uint8_t magic[12];
+	uint64_t file_size = fs::file_size(p, ec);
+	if (ec)
+		return AVERROR(ENOENT);
+
+	std::ifstream fin(p, std::ifstream::binary);
+	if (!fin || !read_exact(fin, magic, sizeof(magic)))
+		return AVERROR_PATCHWELCOME;
+
+	int err;
+	info->bit_rate = 0;
+	if (memcmp(magic, "fLaC", 4) == 0) {
+		seek_to(fin, 4);
+		err = read_flac(fin, dict, info);
+	} else if (memcmp(magic + 4, "ftyp", 4) == 0) {
+		err = read_mp4(fin, file_size, dict, info);
+	} else if (memcmp(magic, "ID3", 3) == 0 || (magic[0] == 0xff && (magic[1] & 0xe0) == 0xe0)) {
+		seek_to(fin, 0);
+		err = read_mp3(fin, file_size, dict, info);
+	} else {
+		err = AVERROR_PATCHWELCOME;
+	}
+
+	if (err == 0 && info->duration_ms > 0) {
+		// Where the format has no better figure (FLAC), the estimate FFmpeg makes from the file size.
+		if (info->bit_rate <= 0)
+			info->bit_rate = file_size * 8 * 1000 / info->duration_ms;
+	} else {
+		av_dict_free(dict);
+		err = err == 0 ? AVERROR_INVALIDDATA : err;
+	}
+	return err;
+}
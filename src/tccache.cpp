@@ -0,0 +1,122 @@
+#include "tccache.h"
+#include "seekidx.h"
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+constexpr size_t TCCACHE_SHARDS = 16;
+
+tccache::tccache(const std::string& policy, size_t max_entries, uint64_t max_bytes)
+{
+	// Round up, so that a small limit still leaves room for something in every shard.
+	const size_t shard_entries = (max_entries + TCCACHE_SHARDS - 1) / TCCACHE_SHARDS;
+	const uint64_t shard_bytes = (max_bytes + TCCACHE_SHARDS - 1) / TCCACHE_SHARDS;
+	if (policy != "lru" && policy != "tinylfu")
+		throw std::invalid_argument("unknown cache policy " + policy);
+
+	shards.reserve(TCCACHE_SHARDS);
+	for (size_t i = 0; i < TCCACHE_SHARDS; i++) {
+		auto s = std::make_unique<shard>();
+		if (policy == "tinylfu")
+			s->policy = std::make_unique<collecting<tinylfu<fs::path, path_hash>>>(s->evicted, shard_entries, shard_bytes);
+		else
+			s->policy = std::make_unique<collecting<lru<fs::path>>>(s->evicted, shard_entries, shard_bytes);
+		shards.push_back(std::move(s));
+	}
+}
+
+tccache::shard& tccache::shard_for(const fs::path& p)
+{
+	return *shards[std::hash<std::string>()(p.filename().string()) % shards.size()];
+}
+
+void tccache::remove_evicted(std::vector<fs::path>& evicted)
+{
+	std::error_code ec;
+	for (auto& p : evicted) {
+		fs::remove(p, ec);
+		fs::remove(p.string() + SEEK_INDEX_SUFFIX, ec);
+	}
+}
+
+void tccache::put(const fs::path& p, uint64_t bytes)
+{
+	std::vector<fs::path> evicted;
+	shard& s = shard_for(p);
+	{
+		std::lock_guard<std::mutex> lck(s.mtx);
+		s.policy->put(p, bytes);
+		evicted.swap(s.evicted);
+	}
+	remove_evicted(evicted);
+}
+
+bool tccache::touch(const fs::path& p)
+{
+	shard& s = shard_for(p);
+	std::lock_guard<std::mutex> lck(s.mtx);
+	return s.policy->touch(p);
+}
+
+void tccache::miss(const fs::path& p)
+{
+	shard& s = shard_for(p);
+	std::lock_guard<std::mutex> lck(s.mtx);
+	s.policy->erase(p);
+	s.policy->miss(p);
+}
+
+void tccache::erase(const fs::path& p)
+{
+	shard& s = shard_for(p);
+	std::lock_guard<std::mutex> lck(s.mtx);
+	s.policy->erase(p);
+}
+
+/* Picks up what an earlier run left behind, oldest first so the newest files are the last to go.
+ * Seek indexes are counted with the file they index, and dropped if it is gone. */
+void tccache::rebuild(const fs::path& dir)
+{
+	std::vector<std::pair<fs::file_time_type, fs::directory_entry>> found;
+	std::unordered_map<std::string, uint64_t> indexes;
+	std::error_code ec;
+
+	for (auto& e : fs::directory_iterator(dir, ec)) {
+		if (!e.is_regular_file(ec))
+			continue;
+		const std::string name = e.path().filename().string();
+		if (name.find(".part.") != std::string::npos) {
+			// A transcode that never finished.
+			fs::remove(e.path(), ec);
+			continue;
+		}
+		if (fs::path(name).extension() == SEEK_INDEX_SUFFIX) {
+			indexes[fs::absolute(e.path()).replace_extension().string()] = e.file_size(ec);
+			continue;
+		}
+		found.emplace_back(e.last_write_time(ec), e);
+	}
+
+	std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+	for (auto& f : found) {
+		const fs::path p = fs::absolute(f.second.path());
+		uint64_t bytes = f.second.file_size(ec);
+		if (auto it = indexes.find(p.string()); it != indexes.end()) {
+			bytes += it->second;
+			indexes.erase(it);
+		}
+		put(p, bytes);
+	}
+	for (auto& i : indexes)
+		fs::remove(i.first + SEEK_INDEX_SUFFIX, ec);
+}
+
+std::pair<size_t, uint64_t> tccache::usage()
+{
+	std::pair<size_t, uint64_t> u{0, 0};
+	for (auto& s : shards) {
+		std::lock_guard<std::mutex> lck(s->mtx);
+		u.first += s->policy->size();
+		u.second += s->policy->weight();
+	}
+	return u;
+}
@@ -0,0 +1,623 @@
+#include "mediaio.h"
+#include "tcpipe.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+constexpr int OUTPUT_IO_SIZE = 16384;
+constexpr int MIN_INPUT_FRAME = 4608; // the largest frame of the usual CD-audio FLAC and MP3
+constexpr size_t PIPE_BLOCKS = 32;    // about a second of audio between the two stages
+
+// Waits for the other side of a ring: spin briefly, then give up the CPU for longer and longer.
+static void backoff(int& spins)
+{
+	if (++spins < 64)
+		return;
+	else if (spins < 128)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(spins < 1024 ? 50 : 500));
+}
+
+// (Re)allocates a sample buffer for at least this many samples, if it has fewer.
+static int grow_samples(uint8_t ***data, int *capacity, int samples, const AVCodecContext *c)
+{
+	if (samples <= *capacity)
+		return 0;
+	if (*data != nullptr) {
+		av_freep(&(*data)[0]);
+		av_freep(data);
+	}
+	*capacity = 0;
+
+	int err;
+	if ((err = av_samples_alloc_array_and_samples(data, nullptr, c->channels, samples, c->sample_fmt, 0)) < 0)
+		return err;
+	*capacity = samples;
+	return 0;
+}
+
+static void cache_write(tc_job *job, const uint8_t *buf, size_t buf_size)
+{
+	for (size_t off = 0; job->cache_fd >= 0 && off < buf_size; ) {
+		ssize_t r = ::write(job->cache_fd, buf + off, buf_size - off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			// Listeners come first: drop the cache file, keep streaming.
+			perror("tc fail_cache_write");
+			close(job->cache_fd);
+			unlink(job->cache_tmp.c_str());
+			job->cache_fd = -1;
+			break;
+		}
+		off += r;
+	}
+}
+
+static int iom_write(void* opaque, uint8_t* buf, int buf_size)
+{
+	tc_job* job = static_cast<tc_job*>(opaque);
+	if (job->cancelled)
+		return AVERROR_EXIT;
+
+	job->append(buf, buf_size);
+	cache_write(job, buf, buf_size);
+	return buf_size;
+}
+
+tc_source::~tc_source()
+{
+	av_frame_free(&frame);
+	av_packet_free(&pkt);
+	if (codec_ctx != nullptr)
+		avcodec_free_context(&codec_ctx);
+	close_media_input(&fmt_ctx);
+}
+
+int tc_source::open(const std::string& path)
+{
+	AVCodec* input_codec;
+	AVStream *audio_stream;
+	int err;
+
+	if ((err = open_media_input(&fmt_ctx, path.c_str())) < 0) {
+		std::cerr << "tc fail_open " << path << " : " << av_err2str(err) << std::endl;
+		return err;
+	}
+	if ((err = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+		std::cerr << "tc fail_stream_inf " << path << " : " << av_err2str(err) << std::endl;
+		return err;
+	}
+
+	for (size_t i = 0; i < fmt_ctx->nb_streams && stream == -1; i++) {
+		if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+			stream = i;
+	}
+	if (stream == -1) {
+		std::cerr << "tc no_audio_stream " << path << std::endl;
+		return AVERROR_STREAM_NOT_FOUND;
+	}
+
+	audio_stream = fmt_ctx->streams[stream];
+	if ((input_codec = avcodec_find_decoder(audio_stream->codecpar->codec_id)) == nullptr) {
+		std::cerr << "tc no_audio_dec " << path << std::endl;
+		return AVERROR_DECODER_NOT_FOUND;
+	}
+	if ((codec_ctx = avcodec_alloc_context3(input_codec)) == nullptr)
+		return AVERROR(ENOMEM);
+	if ((err = avcodec_parameters_to_context(codec_ctx, audio_stream->codecpar)) < 0) {
+		std::cerr << "tc par2ctx " << path << " : " << av_err2str(err) << std::endl;
+		return err;
+	}
+	codec_ctx->pkt_timebase = audio_stream->time_base;
+	if ((err = avcodec_open2(codec_ctx, input_codec, nullptr)) < 0) {
+		std::cerr << "tc open_input_codec " << path << " : " << av_err2str(err) << std::endl;
+		return err;
+	}
+
+	if ((pkt = av_packet_alloc()) == nullptr || (frame = av_frame_alloc()) == nullptr)
+		return AVERROR(ENOMEM);
+	return 0;
+}
+
+int tc_source::seek(int64_t ms)
+{
+	int err;
+	if ((err = av_seek_frame(fmt_ctx, -1, av_rescale(ms, AV_TIME_BASE, 1000), AVSEEK_FLAG_BACKWARD)) < 0) {
+		std::cerr << "tc seek : " << av_err2str(err) << std::endl;
+		return err;
+	}
+	avcodec_flush_buffers(codec_ctx);
+	return 0;
+}
+
+int tc_source::decode(bool *finished)
+{
+	int err;
+	while (true) {
+		if ((err = avcodec_receive_frame(codec_ctx, frame)) == 0)
+			return 0;
+		if (err == AVERROR_EOF) {
+			*finished = true;
+			return 0;
+		} else if (err != AVERROR(EAGAIN)) {
+			std::cerr << "tc fail_decode : " << av_err2str(err) << std::endl;
+			return err;
+		}
+
+		if ((err = av_read_frame(fmt_ctx, pkt)) < 0) {
+			if (err != AVERROR_EOF) {
+				std::cerr << "tc read_frame : " << av_err2str(err) << std::endl;
+				return err;
+			}
+			// Let the decoder drain what it is still holding.
+			if ((err = avcodec_send_packet(codec_ctx, nullptr)) < 0 && err != AVERROR_EOF) {
+				std::cerr << "tc send_packet_decode : " << av_err2str(err) << std::endl;
+				return err;
+			}
+			continue;
+		}
+
+		// Cover art and the like are not for the audio decoder.
+		if (pkt->stream_index == stream)
+			err = avcodec_send_packet(codec_ctx, pkt);
+		av_packet_unref(pkt);
+		if (err < 0) {
+			std::cerr << "tc send_packet_decode : " << av_err2str(err) << std::endl;
+			return err;
+		}
+	}
+}
+
+tc_sink::~tc_sink()
+{
+	if (conv != nullptr) {
+		av_freep(&conv[0]);
+		av_freep(&conv);
+	}
+	for (size_t i = 0; ring && i < ring->storage().size(); i++) {
+		pcm_block& b = ring->storage()[i];
+		if (b.data != nullptr) {
+			av_freep(&b.data[0]);
+			av_freep(&b.data);
+		}
+	}
+	av_packet_free(&pkt);
+	av_frame_free(&frame);
+	if (fifo != nullptr)
+		av_audio_fifo_free(fifo);
+	swr_free(&resample_ctx);
+	if (codec_ctx != nullptr)
+		avcodec_free_context(&codec_ctx);
+	if (fmt_ctx != nullptr) {
+		if (fmt_ctx->pb != nullptr) {
+			av_free(fmt_ctx->pb->buffer);
+			avio_context_free(&fmt_ctx->pb);
+		}
+		avformat_free_context(fmt_ctx);
+	}
+}
+
+int tc_sink::open(tc_job *out, const AVCodecContext *in)
+{
+	const tc_format *fmt = out->fmt;
+	AVStream *stream = nullptr;
+	AVCodec *out_codec = nullptr;
+	AVDictionary *mux_opts = nullptr;
+	unsigned char *iobuf = nullptr;
+	int err;
+
+	job = out;
+	if ((fmt_ctx = avformat_alloc_context()) == nullptr)
+		return AVERROR(ENOMEM);
+	if ((iobuf = (unsigned char *) av_malloc(OUTPUT_IO_SIZE)) == nullptr)
+		return AVERROR(ENOMEM);
+	if ((fmt_ctx->pb = avio_alloc_context(iobuf, OUTPUT_IO_SIZE, 1, reinterpret_cast<void*>(job), nullptr, iom_write, nullptr)) == nullptr) {
+		av_free(iobuf);
+		return AVERROR(ENOMEM);
+	}
+
+	if ((fmt_ctx->oformat = av_guess_format(fmt->muxer, nullptr, nullptr)) == nullptr) {
+		std::cerr << "tc no_muxer " << fmt->muxer << std::endl;
+		return AVERROR_MUXER_NOT_FOUND;
+	}
+	if ((out_codec = avcodec_find_encoder_by_name(fmt->encoder)) == nullptr && (out_codec = avcodec_find_encoder(fmt->codec_id)) == nullptr) {
+		std::cerr << "tc no_encoder " << fmt->encoder << std::endl;
+		return AVERROR_ENCODER_NOT_FOUND;
+	}
+	if ((stream = avformat_new_stream(fmt_ctx, nullptr)) == nullptr)
+		return AVERROR(ENOMEM);
+	if ((codec_ctx = avcodec_alloc_context3(out_codec)) == nullptr)
+		return AVERROR(ENOMEM);
+
+	codec_ctx->channels = 2;
+	codec_ctx->channel_layout = av_get_default_channel_layout(2);
+	codec_ctx->sample_rate = fmt->sample_rate;
+	codec_ctx->time_base = {1, fmt->sample_rate};
+	if (fmt->codec_id == AV_CODEC_ID_MP3) {
+		codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+		codec_ctx->cutoff = 0;
+		codec_ctx->sample_fmt = AV_SAMPLE_FMT_S16P;
+		codec_ctx->global_quality = job->quality * FF_QP2LAMBDA;
+	} else {
+		codec_ctx->sample_fmt = out_codec->sample_fmts ? out_codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+		codec_ctx->bit_rate = fmt->kbps[job->quality] * 1000;
+	}
+	stream->time_base = codec_ctx->time_base;
+
+	if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if ((err = avcodec_open2(codec_ctx, out_codec, nullptr)) < 0) {
+		std::cerr << "tc fail_open_out : " << av_err2str(err) << std::endl;
+		return err;
+	}
+	if ((err = avcodec_parameters_from_context(stream->codecpar, codec_ctx)) < 0) {
+		std::cerr << "tc par4ctx" << std::endl;
+		return err;
+	}
+
+	// Nothing can be seeked back to on a stream, so fragmented MP4 has to be asked for.
+	if (fmt->mux_opts != nullptr)
+		av_dict_parse_string(&mux_opts, fmt->mux_opts, "=", ":", 0);
+	err = avformat_write_header(fmt_ctx, &mux_opts);
+	av_dict_free(&mux_opts);
+	if (err < 0) {
+		std::cerr << "tc write_header : " << av_err2str(err) << std::endl;
+		return err;
+	}
+
+	/* A whole cached track in a format that can start at any frame gets an index, so later requests
+	 * can start anywhere in the cache file. MP3 also gets a Xing frame in the cache file, right after
+	 * the header; the muxer only writes one itself when it can seek back to fill it in. */
+	if (job->cache_fd >= 0 && job->full_length() && (strcmp(fmt->muxer, "mp3") == 0 || strcmp(fmt->muxer, "adts") == 0)) {
+		indexed = true;
+		if (strcmp(fmt->muxer, "mp3") == 0 && !(xing = mp3_xing_frame(codec_ctx->sample_rate, codec_ctx->channels)).empty()) {
+			avio_flush(fmt_ctx->pb);
+			xing_at = avio_tell(fmt_ctx->pb);
+			cache_write(job, xing.data(), xing.size());
+		}
+	}
+
+	in_sample_rate = in->sample_rate;
+	in_time_base = in->pkt_timebase;
+	// Stereo at the right rate only needs its samples converted, which is done without swresample.
+	if (in->sample_rate == codec_ctx->sample_rate && in->channels == 2 && codec_ctx->channels == 2)
+		conv_fn = find_sampleconv(in->sample_fmt, codec_ctx->sample_fmt);
+	if (conv_fn == nullptr && (resample_ctx = swr_alloc_set_opts(nullptr,
+					  av_get_default_channel_layout(codec_ctx->channels),
+					  codec_ctx->sample_fmt,
+					  codec_ctx->sample_rate,
+					  av_get_default_channel_layout(in->channels),
+					  in->sample_fmt,
+					  in->sample_rate,
+					  0, nullptr)) == nullptr)
+		return AVERROR(ENOMEM);
+	if (resample_ctx != nullptr && (err = swr_init(resample_ctx)) < 0) {
+		std::cerr << "tc resample_init : " << av_err2str(err) << std::endl;
+		return err;
+	}
+
+	// Sized for the largest frame the input will usually have, so they are never grown after this.
+	if ((err = reserve_conv(av_rescale_rnd(std::max(in->frame_size, MIN_INPUT_FRAME), codec_ctx->sample_rate, in->sample_rate, AV_ROUND_UP) + 64)) < 0)
+		return err;
+	if ((fifo = av_audio_fifo_alloc(codec_ctx->sample_fmt, codec_ctx->channels, codec_ctx->frame_size + conv_capacity)) == nullptr)
+		return AVERROR(ENOMEM);
+	if ((frame = av_frame_alloc()) == nullptr || (pkt = av_packet_alloc()) == nullptr)
+		return AVERROR(ENOMEM);
+	frame->nb_samples = codec_ctx->frame_size;
+	frame->channel_layout = codec_ctx->channel_layout;
+	frame->format = codec_ctx->sample_fmt;
+	frame->sample_rate = codec_ctx->sample_rate;
+	if ((err = av_frame_get_buffer(frame, 0)) < 0)
+		return err;
+
+	// Timestamps carry on from where in the track the output starts, so segments line up.
+	start_sample = av_rescale(job->start_ms, codec_ctx->sample_rate, 1000);
+	if (job->end_ms > 0)
+		end_sample = av_rescale(job->end_ms, codec_ctx->sample_rate, 1000);
+	next_sample = job->start_ms > 0 ? -1 : 0;
+	pts = start_sample;
+	return 0;
+}
+
+int tc_sink::reserve_conv(int samples)
+{
+	return grow_samples(&conv, &conv_capacity, samples, codec_ctx);
+}
+
+/* Converts as much of a frame as fits in dst; the resampler keeps the rest for next time. Without
+ * one, dst has to fit all of it. Returns the number of samples, of which the first *skip are from
+ * before the start. */
+int tc_sink::resample(const AVFrame *in, uint8_t **dst, int capacity, int *skip)
+{
+	int n;
+	if (conv_fn != nullptr) {
+		n = std::min(in->nb_samples, capacity);
+		conv_fn(dst, in->extended_data, n);
+	} else if ((n = swr_convert(resample_ctx, dst, capacity, (const uint8_t **) in->extended_data, in->nb_samples)) < 0) {
+		std::cerr << "tc fail_conv_input : " << av_err2str(n) << std::endl;
+		return n;
+	}
+
+	if (next_sample < 0)
+		next_sample = in->best_effort_timestamp == AV_NOPTS_VALUE ? start_sample :
+			av_rescale_q(in->best_effort_timestamp, in_time_base, {1, codec_ctx->sample_rate});
+	*skip = std::clamp<int64_t>(start_sample - next_sample, 0, n);
+	next_sample += n;
+	return n;
+}
+
+int tc_sink::store(const AVFrame *in)
+{
+	const int max_out = conv_fn != nullptr ? in->nb_samples :
+		av_rescale_rnd(swr_get_delay(resample_ctx, in_sample_rate) + in->nb_samples, codec_ctx->sample_rate, in_sample_rate, AV_ROUND_UP);
+	int err, n, skip;
+	if ((err = reserve_conv(max_out)) < 0)
+		return err;
+	if ((n = resample(in, conv, max_out, &skip)) < 0)
+		return n;
+	if (av_audio_fifo_write(fifo, (void **) conv, n) < n) {
+		std::cerr << "tc write_fifo" << std::endl;
+		return AVERROR_EXIT;
+	}
+
+	// Drop what a seek decoded before the requested time. Nothing was kept before it, so it is
+	// all at the front.
+	if (skip > 0)
+		av_audio_fifo_drain(fifo, skip);
+	return 0;
+}
+
+int tc_sink::open_ring(size_t blocks)
+{
+	int err;
+	ring = std::make_unique<spsc_ring<pcm_block>>(blocks);
+	for (auto& b : ring->storage()) {
+		if ((err = grow_samples(&b.data, &b.capacity, conv_capacity, codec_ctx)) < 0)
+			return err;
+	}
+	return 0;
+}
+
+int tc_sink::store_block(const AVFrame *in, pcm_block& b)
+{
+	int err, n, skip;
+	// Only ever needed for an unusually long frame, which the converter cannot split.
+	if (conv_fn != nullptr && (err = grow_samples(&b.data, &b.capacity, in->nb_samples, codec_ctx)) < 0)
+		return err;
+	if ((n = resample(in, b.data, b.capacity, &skip)) < 0)
+		return n;
+	b.first = skip;
+	// Whatever is past the end of a segment is left out.
+	b.count = n - skip - std::clamp<int64_t>(next_sample - end_sample, 0, n - skip);
+	b.eof = false;
+	b.error = 0;
+	return 0;
+}
+
+int tc_sink::send_filled()
+{
+	int err;
+	frame->nb_samples = filled;
+	frame->pts = pts;
+	pts += filled;
+	filled = 0;
+	if ((err = send(frame)) < 0)
+		return err;
+	return 0;
+}
+
+int tc_sink::encode_ring()
+{
+	const int frame_size = codec_ctx->frame_size;
+	const int channels = codec_ctx->channels;
+	int spins = 0, err;
+
+	while (true) {
+		if (job->cancelled)
+			return AVERROR_EXIT;
+		pcm_block *b = ring->front();
+		if (b == nullptr) {
+			backoff(spins);
+			continue;
+		}
+		spins = 0;
+
+		if (b->eof) {
+			err = b->error;
+			ring->pop();
+			if (err == 0 && filled > 0)
+				err = send_filled();
+			return err;
+		}
+
+		while (b->count > 0) {
+			if (filled == 0) {
+				frame->nb_samples = frame_size;
+				if ((err = av_frame_make_writable(frame)) < 0)
+					return err;
+			}
+			const int k = std::min(b->count, frame_size - filled);
+			av_samples_copy(frame->data, b->data, filled, b->first, k, channels, codec_ctx->sample_fmt);
+			b->first += k;
+			b->count -= k;
+			filled += k;
+			if (filled == frame_size && (err = send_filled()) < 0)
+				return err;
+		}
+		ring->pop();
+	}
+}
+
+int tc_sink::send(const AVFrame *f)
+{
+	int err = avcodec_send_frame(codec_ctx, f);
+	if (err == AVERROR_EOF) {
+		return 0;
+	} else if (err < 0) {
+		std::cerr << "tc send_pkt_encode : " << av_err2str(err) << std::endl;
+		return err;
+	}
+
+	while ((err = avcodec_receive_packet(codec_ctx, pkt)) == 0) {
+		// The muxer may have picked its own time base for the stream.
+		av_packet_rescale_ts(pkt, codec_ctx->time_base, fmt_ctx->streams[0]->time_base);
+		pkt->stream_index = 0;
+		if (indexed)
+			index.add(av_rescale_q(pkt->pts, fmt_ctx->streams[0]->time_base, {1, 1000}), avio_tell(fmt_ctx->pb) + xing.size());
+		err = av_write_frame(fmt_ctx, pkt);
+		av_packet_unref(pkt);
+		if (err < 0) {
+			if (err != AVERROR_EXIT) // AVERROR_EXIT is iom_write reporting that everyone left
+				std::cerr << "tc write_frame : " << av_err2str(err) << std::endl;
+			return err;
+		}
+	}
+	if (err == AVERROR(EAGAIN) || err == AVERROR_EOF)
+		return 0;
+	std::cerr << "tc encode_frame : " << av_err2str(err) << std::endl;
+	return err;
+}
+
+int tc_sink::encode(bool flush)
+{
+	const int frame_size = codec_ctx->frame_size;
+	// Whatever is past the end of a segment stays in the fifo.
+	int available = av_audio_fifo_size(fifo) - std::max<int64_t>(0, next_sample - end_sample);
+	int err;
+
+	while (available >= frame_size || (flush && available > 0)) {
+		const int n = std::min(available, frame_size);
+		frame->nb_samples = frame_size;
+		if ((err = av_frame_make_writable(frame)) < 0)
+			return err;
+		frame->nb_samples = n;
+		if (av_audio_fifo_read(fifo, (void **) frame->data, n) < n) {
+			std::cerr << "tc read_fifo" << std::endl;
+			return AVERROR_EXIT;
+		}
+		frame->pts = pts;
+		pts += n;
+		if ((err = send(frame)) < 0)
+			return err;
+		available -= n;
+	}
+	return 0;
+}
+
+int tc_sink::finish()
+{
+	int err;
+	if ((err = send(nullptr)) < 0)
+		return err;
+	if ((err = av_write_trailer(fmt_ctx)) < 0) {
+		std::cerr << "tc write_trailer : " << av_err2str(err) << std::endl;
+		return err;
+	}
+
+	if (xing_at >= 0 && job->cache_fd >= 0) {
+		mp3_fill_xing(xing, index, codec_ctx->sample_rate, xing_at, avio_tell(fmt_ctx->pb) + xing.size() - xing_at);
+		if (pwrite(job->cache_fd, xing.data(), xing.size(), xing_at) != static_cast<ssize_t>(xing.size()))
+			perror("tc fail_cache_xing");
+	}
+	return 0;
+}
+
+static void drop(tc_sink *sink, int err, const char *why)
+{
+	sink->error = err;
+	sink->fail = sink->job->cancelled ? "transcode cancelled\r\n" : why;
+}
+
+void tc_run(tc_source& src, const std::vector<tc_sink*>& sinks)
+{
+	size_t running = sinks.size();
+	int err;
+	while (running > 0) {
+		bool finished = false;
+		if ((err = src.decode(&finished)) != 0) {
+			for (auto sink : sinks) {
+				if (!sink->complete && sink->fail == nullptr)
+					drop(sink, err, "failed to accumulate samples\r\n");
+			}
+			return;
+		}
+
+		running = 0;
+		for (auto sink : sinks) {
+			if (sink->complete || sink->fail != nullptr)
+				continue;
+			if (sink->job->cancelled) {
+				drop(sink, AVERROR_EXIT, "");
+				continue;
+			}
+			if (!finished && (err = sink->store(src.frame)) != 0) {
+				drop(sink, err, "failed to accumulate samples\r\n");
+				continue;
+			}
+			const bool done = finished || sink->done();
+			if ((err = sink->encode(done)) != 0) {
+				drop(sink, err, "failed to encode samples\r\n");
+				continue;
+			}
+			if (!done)
+				running++;
+			else if ((err = sink->finish()) < 0)
+				drop(sink, err, "failed to finish output\r\n");
+			else
+				sink->complete = true;
+		}
+	}
+}
+
+void tc_run_pipelined(tc_source& src, tc_sink& sink)
+{
+	std::atomic<bool> stop{false};
+	int err;
+	if ((err = sink.open_ring(PIPE_BLOCKS)) != 0)
+		return drop(&sink, err, "failed to allocate buffer\r\n");
+
+	std::thread decoder([&] {
+		int derr = 0, spins = 0;
+		bool finished = false;
+		pcm_block *b;
+		while (!finished) {
+			if ((derr = src.decode(&finished)) != 0 || finished)
+				break;
+			while ((b = sink.ring->claim()) == nullptr) {
+				if (stop)
+					return;
+				backoff(spins);
+			}
+			spins = 0;
+			if ((derr = sink.store_block(src.frame, *b)) != 0)
+				break;
+			sink.ring->publish();
+			finished = sink.done();
+		}
+
+		while ((b = sink.ring->claim()) == nullptr) {
+			if (stop)
+				return;
+			backoff(spins);
+		}
+		b->count = 0;
+		b->eof = true;
+		b->error = derr;
+		sink.ring->publish();
+	});
+
+	err = sink.encode_ring();
+	stop = true;
+	decoder.join();
+	if (err != 0)
+		drop(&sink, err, "failed to encode samples\r\n");
+	else if ((err = sink.finish()) < 0)
+		drop(&sink, err, "failed to finish output\r\n");
+	else
+		sink.complete = true;
+}
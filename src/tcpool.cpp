@@ -0,0 +1,129 @@
+#include "ffmpeg.h"
+#include "tcpool.h"
+#include <algorithm>
+
+tc_pool::tc_pool(unsigned num_workers, size_t max_queued, runner_t run)
+	: run(run), max_queued(max_queued), num_queued(0), num_active(0), stopping(false)
+{
+	if (num_workers == 0)
+		num_workers = 1;
+	threads.reserve(num_workers);
+	for (unsigned i = 0; i < num_workers; i++)
+		threads.emplace_back(&tc_pool::worker, this);
+}
+
+tc_pool::~tc_pool()
+{
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (auto& t : threads)
+		t.join();
+
+	// Nobody is going to run what is left; let its listeners go.
+	for (auto& q : queues) {
+		for (auto& job : q) {
+			job->finish(AVERROR_EXIT, "server is shutting down\r\n");
+			for (auto& b : job->branches)
+				b->finish(AVERROR_EXIT, "server is shutting down\r\n");
+		}
+	}
+}
+
+void tc_pool::worker()
+{
+	std::unique_lock<std::mutex> lck(mtx);
+	while (true) {
+		cv.wait(lck, [this] { return stopping || num_queued > 0; });
+		if (stopping)
+			return;
+
+		auto q = std::find_if(queues.begin(), queues.end(), [](const auto& q) { return !q.empty(); });
+		std::shared_ptr<tc_job> job = std::move(q->front());
+		const size_t cls = q - queues.begin();
+		q->pop_front();
+		num_queued--;
+		num_active++;
+		running[cls]++;
+
+		lck.unlock();
+		run(job);
+		job.reset();
+		lck.lock();
+		num_active--;
+		running[cls]--;
+	}
+}
+
+bool tc_pool::submit(std::shared_ptr<tc_job> job)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	const size_t limit = job->priority == TC_INTERACTIVE ? max_queued : max_queued / 2;
+	if (stopping || num_queued >= limit)
+		return false;
+
+	queues[job->priority.load()].push_back(job);
+	num_queued++;
+	cv.notify_one();
+	return true;
+}
+
+void tc_pool::promote(const std::shared_ptr<tc_job>& job, tc_priority priority)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	if (priority >= job->priority)
+		return;
+
+	// Only a job still waiting needs moving; a running one just keeps going.
+	auto& from = queues[job->priority.load()];
+	auto it = std::find(from.begin(), from.end(), job);
+	if (it != from.end()) {
+		from.erase(it);
+		queues[priority].push_back(job);
+	}
+	job->priority = priority;
+}
+
+// Takes the job back out of the queue, unless a worker has already taken it.
+bool tc_pool::withdraw(const std::shared_ptr<tc_job>& job)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	auto& q = queues[job->priority.load()];
+	auto it = std::find(q.begin(), q.end(), job);
+	if (it == q.end())
+		return false;
+	q.erase(it);
+	num_queued--;
+	return true;
+}
+
+size_t tc_pool::queued()
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	return num_queued;
+}
+
+size_t tc_pool::active()
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	return num_active;
+}
+
+// Jobs queued or running in the classes at least as urgent as priority, by the class they started in.
+size_t tc_pool::pending(tc_priority priority)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	size_t n = 0;
+	for (int p = 0; p <= priority; p++)
+		n += queues[p].size() + running[p];
+	return n;
+}
+
+// Whether every worker is busy and at least waiting jobs someone listens to are queued already.
+bool tc_pool::saturated(size_t waiting)
+{
+	std::lock_guard<std::mutex> lck(mtx);
+	return num_active >= threads.size() && queues[TC_INTERACTIVE].size() >= waiting;
+}
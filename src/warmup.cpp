@@ -0,0 +1,193 @@
+#include "http.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Transcoding ahead of time: the most played tracks, the newest albums and some playlists, at a
+ * few qualities, so they come out of the cache the first time anyone plays them. A pass runs once
+ * the first library scan is over, again every WARMUP_INTERVAL, and on POST /api/v1/warmup. Its jobs
+ * run on warmup_pool, whose threads are niced, so warmup.jobs is the most cores it ever takes. */
+constexpr auto WARMUP_INTERVAL = std::chrono::hours(1);
+constexpr auto WARMUP_POLL = std::chrono::seconds(1);
+// How long the pool has to have had nothing for listeners before the server counts as idle.
+constexpr auto WARMUP_QUIET = std::chrono::seconds(10);
+
+// Niced for each job, since warmup_renice may have taken it back for the last one.
+void surf_server::warmup_transcode(std::shared_ptr<tc_job> job)
+{
+#ifdef __linux__
+	// Given a thread's own id, this applies to that thread alone.
+	const long tid = syscall(SYS_gettid);
+	if (warmup_opts.nice > 0 && setpriority(PRIO_PROCESS, tid, warmup_opts.nice) != 0)
+		perror("warmup setpriority");
+	{
+		std::lock_guard<std::mutex> lck(warmup_mtx);
+		warmup_tids[job.get()] = tid;
+	}
+#endif
+	api_v1_transcode(job);
+#ifdef __linux__
+	std::lock_guard<std::mutex> lck(warmup_mtx);
+	warmup_tids.erase(job.get());
+#endif
+}
+
+/* Puts the thread running a warm-up job someone now listens to back at the usual nice level.
+ * Unprivileged processes may not lower a nice level unless RLIMIT_NICE allows it (LimitNICE= in
+ * systemd, say); without that the job carries on niced. Returns false if the job is not running here. */
+bool surf_server::warmup_renice(const tc_job *job)
+{
+	std::lock_guard<std::mutex> lck(warmup_mtx);
+	auto it = warmup_tids.find(job);
+	if (it == warmup_tids.end())
+		return false;
+#ifdef __linux__
+	static bool warned = false;
+	if (setpriority(PRIO_PROCESS, it->second, 0) != 0 && !warned) {
+		warned = true;
+		perror("warmup renice");
+	}
+#endif
+	return true;
+}
+
+void surf_server::warmup_run()
+{
+	auto next_pass = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lck(warmup_mtx);
+	while (true) {
+		warmup_cv.wait_until(lck, next_pass, [this] { return stop || warmup_requested; });
+		if (stop)
+			return;
+		// A library still being scanned would leave half of it out of the plan.
+		if (mdb.scan_status().running) {
+			warmup_cv.wait_for(lck, WARMUP_POLL, [this] { return stop; });
+			continue;
+		}
+
+		warmup_requested = false;
+		warmup_progress = warmup_stats{};
+		warmup_progress.running = true;
+		warmup_progress.started = time(nullptr);
+		lck.unlock();
+		warmup_pass();
+		lck.lock();
+		warmup_progress.running = false;
+		warmup_progress.waiting = false;
+		warmup_progress.finished = time(nullptr);
+		next_pass = std::chrono::steady_clock::now() + WARMUP_INTERVAL;
+	}
+}
+
+// Walks the plan in order, keeping up to warmup.jobs tracks in flight while the server is idle.
+void surf_server::warmup_pass()
+{
+	std::vector<std::string> plan;
+	try {
+		plan = mdb.warmup_tracks(warmup_opts.most_played, warmup_opts.newest_albums, warmup_opts.playlists);
+	} catch (const std::exception& e) {
+		std::cerr << "warmup fail_plan " << e.what() << std::endl;
+		return;
+	}
+
+	std::unique_lock<std::mutex> lck(warmup_mtx);
+	warmup_progress.tracks = plan.size();
+	warmup_progress.planned = plan.size() * warmup_opts.qualities.size();
+
+	// The outputs queued for each track, which finish with the decode they share.
+	std::vector<std::vector<std::shared_ptr<tc_job>>> in_flight;
+	auto reap = [&] {
+		in_flight.erase(std::remove_if(in_flight.begin(), in_flight.end(), [&](const auto& jobs) {
+			if (std::any_of(jobs.begin(), jobs.end(), [](const auto& j) { return !j->done(); }))
+				return false;
+			for (const auto& j : jobs) {
+				if (j->error != 0) {
+					warmup_progress.failed++;
+				} else {
+					warmup_progress.done++;
+					warmup_progress.bytes += j->length;
+				}
+			}
+			return true;
+		}), in_flight.end());
+		warmup_progress.in_flight = in_flight.size();
+	};
+
+	auto busy_at = std::chrono::steady_clock::now() - WARMUP_QUIET;
+	for (const auto& uuid : plan) {
+		while (true) {
+			reap();
+			if (stop)
+				return;
+			const auto now = std::chrono::steady_clock::now();
+			if (warmup_opts.idle_only && tcp.pending(TC_PREFETCH) > 0)
+				busy_at = now;
+			warmup_progress.waiting = now - busy_at < WARMUP_QUIET;
+			if (!warmup_progress.waiting && in_flight.size() < std::max(1U, warmup_opts.jobs))
+				break;
+			warmup_cv.wait_for(lck, WARMUP_POLL, [this] { return stop; });
+		}
+		// Checked before each track, so tracks already in flight may take it a little past.
+		if (mdb.cache_usage().second >= warmup_opts.budget) {
+			warmup_progress.budget_reached = true;
+			break;
+		}
+		lck.unlock();
+		warmup_track(uuid, in_flight);
+		lck.lock();
+	}
+
+	while (!in_flight.empty()) {
+		reap();
+		if (stop)
+			return;
+		warmup_cv.wait_for(lck, WARMUP_POLL, [this] { return stop; });
+	}
+}
+
+/* Queues one transcode of the track for all the qualities it still needs, branching the rest off
+ * the first. Outputs that are already cached, or being made for someone else, are left alone. */
+void surf_server::warmup_track(const std::string& track_uuid, std::vector<std::vector<std::shared_ptr<tc_job>>>& in_flight)
+{
+	size_t cached = 0;
+	auto track = mdb.get_track(track_uuid);
+	std::vector<std::shared_ptr<tc_job>> jobs;
+	for (int q : warmup_opts.qualities) {
+		if (mdb.has_cached_transcode(tc_job::key(track_uuid, q, warmup_fmt)))
+			cached++;
+		else if (track && !is_passthrough(*track, q, warmup_fmt))
+			jobs.push_back(std::make_shared<tc_job>(track_uuid, track->path, q, warmup_fmt, TC_WARMUP));
+	}
+
+	bool queued = false;
+	if (!jobs.empty()) {
+		std::lock_guard<std::mutex> lck(tc_mtx);
+		jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [this](const auto& j) {
+			return tc_jobs.find(j->key()) != tc_jobs.end();
+		}), jobs.end());
+		if (!jobs.empty()) {
+			jobs[0]->branches.assign(jobs.begin() + 1, jobs.end());
+			if ((queued = warmup_pool.submit(jobs[0]))) {
+				for (auto& j : jobs) {
+					if (j != jobs[0])
+						j->host = jobs[0];
+					tc_jobs[j->key()] = j;
+				}
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lck(warmup_mtx);
+	warmup_progress.cached += cached;
+	warmup_progress.skipped += warmup_opts.qualities.size() - cached - (queued ? jobs.size() : 0);
+	if (queued) {
+		in_flight.push_back(std::move(jobs));
+		warmup_progress.in_flight = in_flight.size();
+	}
+}
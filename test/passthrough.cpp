@@ -0,0 +1,135 @@
+#include "config.h"
+#include "http.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sockpp/tcp_connector.h>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+/* Scans a library of one 128 kbps MP3 and streams it: asked for at a quality no better than that,
+ * it has to go out as the original file, and asked for at a lower one, as a transcode. The server
+ * has no way to stop, so the test exits without tearing it down. */
+constexpr unsigned short TEST_PORT = 18931;
+constexpr int TEST_FRAMES = 250; // six seconds
+// 128 kbps MPEG-1 Layer III at 48 kHz, mono: 384 bytes a frame with no padding.
+constexpr size_t TEST_FRAME_BYTES = 384;
+constexpr unsigned char TEST_FRAME_HEADER[] = {0xff, 0xfb, 0x94, 0xc4};
+
+static void id3_frame(std::string& tag, const char *id, const std::string& text)
+{
+	const uint32_t size = text.length() + 1;
+	tag.append(id, 4);
+	for (int shift = 24; shift >= 0; shift -= 8)
+		tag.push_back(static_cast<char>((size >> shift) & 0xff));
+	tag.append(2, '\0'); // flags
+	tag.push_back('\0'); // ISO-8859-1
+	tag += text;
+}
+
+static bool write_mp3(const fs::path& path)
+{
+	std::string frames;
+	id3_frame(frames, "TIT2", "Passthrough");
+	id3_frame(frames, "TALB", APP_NAME " tests");
+	id3_frame(frames, "TPE1", APP_NAME);
+	const uint32_t size = frames.length();
+	const char header[10] = {'I', 'D', '3', 3, 0, 0,
+		static_cast<char>((size >> 21) & 0x7f), static_cast<char>((size >> 14) & 0x7f),
+		static_cast<char>((size >> 7) & 0x7f), static_cast<char>(size & 0x7f)};
+
+	// Zeroed side information leaves no Huffman data to decode: silence.
+	std::string frame(TEST_FRAME_BYTES, '\0');
+	std::copy(std::begin(TEST_FRAME_HEADER), std::end(TEST_FRAME_HEADER), frame.begin());
+
+	std::ofstream out(path, std::ios::binary);
+	out.write(header, sizeof(header));
+	out << frames;
+	for (int i = 0; i < TEST_FRAMES; i++)
+		out << frame;
+	return static_cast<bool>(out);
+}
+
+static std::string only_track(mediadb& md)
+{
+	db_connection dbc = md.dbconn();
+	sqlite3_stmt *stmt = nullptr;
+	std::string uuid;
+	if (sqlite3_prepare_v2(dbc.handle(), "SELECT UUID FROM TRACKS", -1, &stmt, nullptr) != SQLITE_OK)
+		return uuid;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		uuid = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+	sqlite3_finalize(stmt);
+	return uuid;
+}
+
+// Everything up to the blank line after the response headers.
+static std::string response_head(const std::string& url)
+{
+	sockpp::tcp_connector conn(sockpp::inet_address("127.0.0.1", TEST_PORT));
+	if (!conn)
+		return "";
+	conn.read_timeout(std::chrono::seconds(30));
+	conn.write("GET " + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n");
+
+	std::string head;
+	char buf[4096];
+	ssize_t n;
+	while (head.find("\r\n\r\n") == std::string::npos && (n = conn.read(buf, sizeof(buf))) > 0)
+		head.append(buf, n);
+	return head.substr(0, head.find("\r\n\r\n"));
+}
+
+static bool expect_quality(const std::string& url, const std::string& quality)
+{
+	const std::string head = response_head(url);
+	const bool ok = head.find("\r\nX-Surf-Quality: " + quality + "\r\n") != std::string::npos;
+	std::cout << (ok ? "ok   " : "FAIL ") << url << " -> X-Surf-Quality: " << quality << std::endl;
+	if (!ok)
+		std::cout << head << std::endl;
+	return ok;
+}
+
+int main()
+{
+	av_log_set_level(AV_LOG_ERROR);
+	sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
+
+	std::error_code ec;
+	const fs::path root = fs::temp_directory_path() / (APP_NAME "-test-passthrough-" + std::to_string(getpid()));
+	fs::create_directories(root / "library");
+	if (!write_mp3(root / "library" / "track.mp3")) {
+		std::cerr << "could not write " << root / "library" / "track.mp3" << std::endl;
+		return 1;
+	}
+
+	mediadb md((root / "library").string(), (root / "cache").string(), "lru", 0, 64 << 20);
+	md.scan_path(root / "library");
+	const std::string uuid = only_track(md);
+	if (uuid.empty()) {
+		std::cerr << "the scan found no track" << std::endl;
+		fs::remove_all(root, ec);
+		return 1;
+	}
+
+	server_options opts{};
+	opts.tc_workers = 1;
+	opts.tc_queue = 4;
+	opts.chunk_bytes = 1;
+	opts.warmup.format = "mp3";
+	surf_server server(md, TEST_PORT, opts);
+	std::thread(&surf_server::run, &server).detach();
+
+	// The ladder's mp3 rates are 245 kbps at q=0 and 130 at q=5, but 65 at q=9.
+	bool ok = expect_quality("/api/v1/stream/" + uuid + "?q=0", "orig");
+	ok = expect_quality("/api/v1/stream/" + uuid + "?q=5", "orig") && ok;
+	ok = expect_quality("/api/v1/stream/" + uuid + "?q=9", "9") && ok;
+
+	// The q=9 transcode may still be writing into the cache.
+	fs::remove_all(root, ec);
+	std::cout.flush();
+	std::_Exit(ok ? 0 : 1);
+}